@@ -2,7 +2,6 @@
 
 #include <atomic>
 #include <filesystem>
-#include <random>
 #include <stdexcept>
 #include <algorithm>
 
@@ -17,10 +16,10 @@
 #include <tlgsutils/robots_txt_parser.hpp>
 #include <tlgsutils/url_parser.hpp>
 #include <tlgsutils/utils.hpp>
-#include <trantor/utils/Logger.h>
+#include <tlgsutils/recrawl.hpp>
 #include <tlgsutils/counter.hpp>
+#include <trantor/utils/Logger.h>
 
-#include <tbb/concurrent_unordered_map.h>
 
 #include "iconv.hpp"
 #include "blacklist.hpp"
@@ -87,63 +86,519 @@ static std::pair<std::string, std::unordered_map<std::string, std::string>> pars
     return {mime_str, params};
 }
 
-Task<std::optional<std::string>> GeminiCrawler::getNextPotentialCarwlUrl()
+/**
+ * @brief What robots.txt of a host tells us
+ */
+struct RobotsPolicy
+{
+    std::vector<std::string> disallowed;
+    double crawl_delay = 0;
+};
+
+/**
+ * @brief RobotsPolicy ready to check paths against
+ */
+struct CompiledRobotsPolicy
+{
+    tlgs::RobotsMatcher matcher;
+    double crawl_delay = 0;
+};
+using CompiledRobotsPolicyPtr = std::shared_ptr<const CompiledRobotsPolicy>;
+
+// Keyed by host with port. Shared by all crawlers. Entries expire so policies updated in the DB are picked up
+static tlgs::LruCache<std::string, CompiledRobotsPolicyPtr> policy_cache(16 * 1024 * 1024);
+
+/**
+ * @brief The policy of a host being loaded. Everyone asking for the host meanwhile waits for it instead of
+ * fetching robots.txt again
+ */
+struct PolicyFlight
+{
+    std::mutex mutex;
+    bool done = false;
+    // nullptr if robots.txt could not be fetched
+    CompiledRobotsPolicyPtr policy;
+    std::exception_ptr error;
+    // Resumed on their own loops
+    std::vector<std::pair<std::coroutine_handle<>, EventLoop*>> waiters;
+};
+
+struct PolicyFlightAwaiter
+{
+    std::shared_ptr<PolicyFlight> flight;
+    EventLoop* loop;
+
+    bool await_ready()
+    {
+        std::lock_guard lock(flight->mutex);
+        return flight->done;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard lock(flight->mutex);
+        if(flight->done)
+            return false;
+        flight->waiters.emplace_back(handle, loop);
+        return true;
+    }
+
+    CompiledRobotsPolicyPtr await_resume()
+    {
+        if(flight->error)
+            std::rethrow_exception(flight->error);
+        return flight->policy;
+    }
+};
+
+// Keyed by host with port. Shared by all crawlers as links lead to hosts of any of them
+static std::mutex policy_flights_mutex;
+static std::unordered_map<std::string, std::shared_ptr<PolicyFlight>> policy_flights;
+
+static void finishPolicyFlight(const std::string& key, const std::shared_ptr<PolicyFlight>& flight,
+    CompiledRobotsPolicyPtr policy, std::exception_ptr error)
+{
+    {
+        std::lock_guard lock(policy_flights_mutex);
+        policy_flights.erase(key);
+    }
+    std::vector<std::pair<std::coroutine_handle<>, EventLoop*>> waiters;
+    {
+        std::lock_guard lock(flight->mutex);
+        flight->done = true;
+        flight->policy = std::move(policy);
+        flight->error = error;
+        waiters.swap(flight->waiters);
+    }
+    for(auto [handle, loop] : waiters)
+        loop->queueInLoop([handle]() { handle.resume(); });
+}
+
+// Seconds until a page is crawled again when there's nothing to tell how often it changes. i.e. failed crawls
+static constexpr double default_recrawl_interval = 3 * 24 * 3600;
+// Bounds of the interval adapted to how often the content of a page changes
+static constexpr double min_recrawl_interval = 12 * 3600;
+static constexpr double max_recrawl_interval = 60 * 24 * 3600;
+
+// Hosts asking for a longer Crawl-delay than this will get this instead. So they can't stall the crawl
+static constexpr double max_crawl_delay = 60;
+
+// Share of the allowed concurrent connections slow hosts can take. So they can't starve fast ones
+static constexpr double slow_host_share = 0.25;
+
+// Statements writing crawled pages that are queued in or running on the DB client, across all crawlers. The DB
+// is shared by all of them. Fetching and parsing pages doesn't count. Only work the DB hasn't finished does
+static std::atomic<size_t> pending_db_writes = 0;
+
+/**
+ * @brief Run a statement on the DB. Counted in pending_db_writes until the DB answers
+ */
+template <typename... Args>
+static Task<drogon::orm::Result> execCounted(std::string sql, Args... args)
+{
+    tlgs::Counter writing(pending_db_writes);
+    co_return co_await app().getDbClient()->execSqlCoro(sql, std::move(args)...);
+}
+
+/**
+ * @brief The key the frontier keeps politeness by. All URLs with the same key are crawled one at a time
+ */
+static std::string frontierHost(const std::string& url_str)
+{
+    auto url = tlgs::Url(url_str);
+    if(url.good() == false)
+        return url_str;
+    return url.hostWithPort(1965);
+}
+
+struct GeminiCrawler::WakeAwaiter
+{
+    GeminiCrawler* crawler;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        crawler->waiting_workers_.push_back(handle);
+    }
+
+    void await_resume() const noexcept {}
+};
+
+struct GeminiCrawler::EndAwaiter
 {
-    std::string result;
-    if(craw_queue_.try_pop(result))
-        co_return result;
+    GeminiCrawler* crawler;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
 
-    // co_return {};
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        crawler->loop_->runInLoop([crawler = crawler, handle]() {
+            if(crawler->ended_ && crawler->running_workers_ == 0)
+                handle.resume();
+            else
+                crawler->end_waiters_.push_back(handle);
+        });
+    }
+
+    void await_resume() const noexcept {}
+};
+
+GeminiCrawler::GeminiCrawler(EventLoop* loop, size_t shard, size_t shard_count, std::shared_ptr<CrawlBarrier> barrier)
+    : loop_(loop)
+    , shard_(shard)
+    , shard_count_(shard_count)
+    , barrier_(barrier ? std::move(barrier) : std::make_shared<CrawlBarrier>())
+{
+    barrier_->add(this);
+}
+
+void GeminiCrawler::start()
+{
+    loop_->queueInLoop([this]() {
+        // A fixed pool of workers. Each crawls one page at a time and sleeps when there is nothing to crawl
+        for(size_t i = 0; i < std::max<size_t>(max_concurrent_connections_, 1); i++) {
+            running_workers_++;
+            async_run([this, i]() -> Task<void> {
+                co_await runWorker(i);
+            });
+        }
+    });
+}
 
-    // Even if multiple threads are trying to aquire data from the same table, they push into the same queue. Thus
-    // we can safely stop querying if we got data in the queue. (as long as LIMIT >> max_concurrent_connections_)
-    static std::atomic<int> sample_pct{1};
-    constexpr int urls_per_batch = 360;
-    while(craw_queue_.empty()) {
+Task<void> GeminiCrawler::awaitEnd()
+{
+    co_await EndAwaiter{this};
+}
+
+Task<void> GeminiCrawler::addUrl(const std::string& url)
+{
+    auto parsed = tlgs::Url(url);
+    if(parsed.good() == false) {
+        LOG_ERROR << "Failed to parse URL " << url;
+        co_return;
+    }
+    auto db = app().getDbClient();
+    co_await db->execSqlCoro("INSERT INTO pages (url, domain_name, port, first_seen_at) VALUES ($1, $2, $3, CURRENT_TIMESTAMP) "
+        "ON CONFLICT DO NOTHING;", parsed.str(), parsed.host(), parsed.port());
+    co_await db->execSqlCoro("INSERT INTO crawl_queue (url, due_at, host_hash) SELECT url, CURRENT_TIMESTAMP, "
+        "hashtext(domain_name || ':' || port) FROM pages WHERE url = $1 "
+        "ON CONFLICT (url) DO UPDATE SET due_at = LEAST(crawl_queue.due_at, EXCLUDED.due_at);", parsed.str());
+}
+
+void GeminiCrawler::releaseHost(const std::string& url_str)
+{
+    loop_->runInLoop([this, host = frontierHost(url_str)]() {
+        frontier_.release(host);
+        concurrency_.release();
+        barrier_->crawlFinished();
+        if(concurrency_.update(pending_db_writes))
+            LOG_DEBUG << "Crawler " << shard_ << " now allows " << concurrency_.limit() << " concurrent connections";
+        scheduleWakeUp();
+    });
+}
+
+void GeminiCrawler::recordFetch(const tlgs::Url& url, double latency, const std::string& error)
+{
+    bool timed_out = error == "Timeout";
+    bool failed = timed_out || error == "NetworkFailure";
+    // Other errors are the host answering badly. It is still up but the time it took is unknown
+    if(!error.empty() && !failed)
+        return;
+    async_run([this, url, latency, timed_out, failed]() -> Task<void> {
+        co_await drogon::switchThreadCoro(loop_);
+        concurrency_.recordFetch(latency, timed_out);
+
+        const auto key = url.hostWithPort(1965);
+        tlgs::HostHealth health;
+        // Not seen yet. i.e. the target of a redirect. Start from the stored state, so the failure is added to it
+        // instead of overwriting an open circuit with a fresh one
+        if(!host_health_.findAndFetch(key, health)) {
+            try {
+                co_await hostHealth(url);
+            }
+            catch(std::exception& e) {
+                LOG_WARN << "Cannot load the health of " << key << ": " << e.what();
+            }
+            co_await drogon::switchThreadCoro(loop_);
+            host_health_.findAndFetch(key, health);
+        }
+        bool was_open = health.openFor().has_value();
+        bool was_slow = health.slow();
+        bool had_failures = health.failureScore() > 0.1;
+        if(failed)
+            health.recordFailure();
+        else
+            health.recordSuccess(latency);
+        // Applies when the host is released after this fetch
+        frontier_.setSlow(key, health.slow());
+        // Healthy hosts are not written back after every fetch. Only when something worth remembering changes
+        if(failed || was_open || had_failures || was_slow != health.slow())
+            async_run([host = url.host(), port = url.port(), health]() -> Task<void> {
+                co_await storeHostHealth(host, port, health);
+            });
+        host_health_.insert(key, std::move(health), 1);
+    });
+}
+
+Task<tlgs::HostHealth> GeminiCrawler::hostHealth(const tlgs::Url& url)
+{
+    const auto key = url.hostWithPort(1965);
+    tlgs::HostHealth health;
+    if(host_health_.findAndFetch(key, health))
+        co_return health;
+
+    auto db = app().getDbClient();
+    auto stored = co_await db->execSqlCoro("SELECT failure_score, EXTRACT(EPOCH FROM CURRENT_TIMESTAMP - scored_at) AS score_age, "
+        "latency, EXTRACT(EPOCH FROM open_until - CURRENT_TIMESTAMP) AS open_for, backoff FROM host_health "
+        "WHERE host = $1 AND port = $2", url.host(), url.port());
+    if(stored.size() != 0) {
+        const auto& row = stored[0];
+        health = tlgs::HostHealth::restore(row["failure_score"].as<double>(), row["score_age"].as<double>()
+            , row["latency"].as<double>()
+            , row["open_for"].isNull() ? std::optional<double>() : row["open_for"].as<double>()
+            , row["backoff"].as<double>());
+    }
+    co_await drogon::switchThreadCoro(loop_);
+    // A fetch may have recorded the host meanwhile
+    if(!host_health_.findAndFetch(key, health)) {
+        frontier_.setSlow(key, health.slow());
+        host_health_.insert(key, health, 1);
+    }
+    co_return health;
+}
+
+Task<void> GeminiCrawler::storeHostHealth(std::string host, int port, tlgs::HostHealth health)
+{
+    try {
         auto db = app().getDbClient();
-        try {
-            int tablesample_pct = sample_pct.load(std::memory_order_acquire);
-            // HACK: Seems we can't pass bind variables to a subquery, Just compose the query string
-            std::string sample_str;
-            if(tablesample_pct <= 80)
-                sample_str = fmt::format("TABLESAMPLE SYSTEM({})", tablesample_pct);
-            auto urls = co_await db->execSqlCoro(fmt::format("UPDATE pages SET last_queued_at = CURRENT_TIMESTAMP "
-                "WHERE url in (SELECT url FROM pages {} WHERE (last_crawled_at < CURRENT_TIMESTAMP - INTERVAL '3' DAY "
-                "OR last_crawled_at IS NULL) AND (last_queued_at < CURRENT_TIMESTAMP - INTERVAL '5' MINUTE OR last_queued_at IS NULL) "
-                "LIMIT {} FOR UPDATE) RETURNING url"
-                ,sample_str , urls_per_batch));
-            if(urls.size() < urls_per_batch*0.9) {
-                const int new_value = std::min(tablesample_pct + 10, 100);
-                sample_pct.compare_exchange_strong(tablesample_pct, new_value, std::memory_order_acq_rel);
+        co_await db->execSqlCoro("INSERT INTO host_health (host, port, failure_score, scored_at, latency, open_until, backoff) "
+            "VALUES ($1, $2, $3, CURRENT_TIMESTAMP, $4, CURRENT_TIMESTAMP + $5::float8 * INTERVAL '1' SECOND, $6) "
+            "ON CONFLICT (host, port) DO UPDATE SET failure_score = EXCLUDED.failure_score, scored_at = EXCLUDED.scored_at, "
+            "latency = EXCLUDED.latency, open_until = EXCLUDED.open_until, backoff = EXCLUDED.backoff;"
+            , host, port, health.failureScore(), health.latency(), health.openFor(), health.backoff());
+    }
+    catch(std::exception& e) {
+        LOG_WARN << "Cannot store the health of " << host << ":" << port << ": " << e.what();
+    }
+}
+
+bool GeminiCrawler::allowSlowHosts() const
+{
+    auto slots = std::max<size_t>(concurrency_.limit() * slow_host_share, 1);
+    return frontier_.busySlowHosts() < slots;
+}
+
+void GeminiCrawler::setCrawlDelay(const std::string& host, double crawl_delay)
+{
+    loop_->runInLoop([this, host, crawl_delay]() {
+        auto delay = std::clamp(crawl_delay, host_delay_, std::max(host_delay_, max_crawl_delay));
+        frontier_.setDelay(host, std::chrono::duration_cast<tlgs::HostFrontier::Clock::duration>(
+            std::chrono::duration<double>(delay)));
+    });
+}
+
+Task<bool> GeminiCrawler::refillFrontier()
+{
+    constexpr int64_t urls_per_batch = 360;
+    // Never claim more than the frontier has room for. Only URLs of hosts whose queue is full spill
+    const auto batch_size = std::min<int64_t>(urls_per_batch, frontier_.room());
+    if(batch_size == 0)
+        co_return false;
+    auto db = app().getDbClient();
+    // Claimed URLs are leased by pushing their due time ahead. So other crawlers skip them and they come back if
+    // this one dies before crawling them. A deep host queue can outlast the lease. The URL is then claimed again
+    // while still queued (hosts are never split across shards) and the frontier drops the duplicate.
+    // SKIP LOCKED lets concurrent claims pass each other instead of waiting on (or deadlocking with) each other.
+    // The claim reads a window of the longest due URLs off the due_at index and takes the most important of
+    // them. So its cost is bounded by the window, however large the queue is. Pages that are important but
+    // not due (i.e. just crawled) are never looked at.
+    // With multiple shards, only the hosts of this shard are claimed. The host hash is stored with each queued
+    // URL, so that is a plain filter on the rows read
+    const int64_t window = batch_size * 4;
+    auto urls = shard_count_ == 1
+        ? co_await db->execSqlCoro("UPDATE crawl_queue SET due_at = CURRENT_TIMESTAMP + INTERVAL '5' MINUTE "
+            "WHERE url IN (SELECT url FROM (SELECT url, priority FROM crawl_queue WHERE due_at <= CURRENT_TIMESTAMP "
+            "ORDER BY due_at LIMIT $2 FOR UPDATE SKIP LOCKED) AS due ORDER BY priority DESC LIMIT $1) "
+            "RETURNING url, priority", batch_size, window)
+        : co_await db->execSqlCoro("UPDATE crawl_queue SET due_at = CURRENT_TIMESTAMP + INTERVAL '5' MINUTE "
+            "WHERE url IN (SELECT url FROM (SELECT url, priority FROM crawl_queue WHERE due_at <= CURRENT_TIMESTAMP "
+            "AND mod(host_hash::bigint + 2147483648, $3) = $4 "
+            "ORDER BY due_at LIMIT $2 FOR UPDATE SKIP LOCKED) AS due ORDER BY priority DESC LIMIT $1) "
+            "RETURNING url, priority", batch_size, window, static_cast<int64_t>(shard_count_), static_cast<int64_t>(shard_));
+    co_await drogon::switchThreadCoro(loop_);
+    if(urls.size() == 0)
+        co_return false;
+
+    std::vector<std::string> spilled;
+    for(const auto& row : urls) {
+        auto url = row["url"].as<std::string>();
+        if(!frontier_.push(frontierHost(url), url, row["priority"].as<double>()))
+            spilled.push_back(std::move(url));
+    }
+    if(spilled.empty())
+        co_return true;
+
+    // URLs of hosts that already have a full queue are handed back to the DB instead of sitting out the lease.
+    // They are due again a minute later, so the next batches go to other hosts while these drain
+    LOG_DEBUG << spilled.size() << " URLs do not fit in the frontier. Handing them back to the DB";
+    bool found = spilled.size() != urls.size();
+    co_await db->execSqlCoro("UPDATE crawl_queue SET due_at = CURRENT_TIMESTAMP + INTERVAL '1' MINUTE "
+        "WHERE url = ANY($1::text[])", tlgs::pgTextArray(spilled));
+    co_await drogon::switchThreadCoro(loop_);
+    co_return found;
+}
+
+Task<void> GeminiCrawler::scheduleRecrawl(const std::string& url_str, double recrawl_interval)
+{
+    // Pages deleted while crawling are not scheduled again. Their queue entries are gone with them
+    co_await execCounted("INSERT INTO crawl_queue (url, due_at, host_hash) SELECT url, "
+        "CURRENT_TIMESTAMP + $2::float8 * INTERVAL '1' SECOND, hashtext(domain_name || ':' || port) "
+        "FROM pages WHERE url = $1 ON CONFLICT (url) DO UPDATE SET due_at = EXCLUDED.due_at;", url_str, recrawl_interval);
+}
+
+Task<void> GeminiCrawler::distributeCash(const std::string& url_str)
+{
+    // OPIC (Abiteboul et al. 2003). Every page is queued with some cash. Crawling a page moves its cash into its
+    // history and splits it evenly among the pages it links to. The importance (history + cash, the priority) of
+    // a page thus grows as more crawled pages link to it. Cash of pages linking nowhere stays in their history.
+    auto spent = co_await execCounted("WITH old AS (SELECT url, cash FROM crawl_queue WHERE url = $1 FOR UPDATE) "
+        "UPDATE crawl_queue SET history = crawl_queue.history + old.cash, cash = crawl_queue.cash - old.cash "
+        "FROM old WHERE crawl_queue.url = old.url RETURNING old.cash", url_str);
+    if(spent.size() == 0)
+        co_return;
+    double cash = spent[0]["cash"].as<double>();
+    if(cash <= 0)
+        co_return;
+
+    // Rows are locked in URL order. So concurrent distributions can't deadlock each other. Pages queued here for
+    // the first time get the initial 1 cash on top of their share. So the share is EXCLUDED.cash - 1
+    co_await execCounted("INSERT INTO crawl_queue AS queue (url, due_at, cash, priority, host_hash) "
+        "SELECT to_url, CURRENT_TIMESTAMP, 1 + $2::float8 / COUNT(*) OVER (), 1 + $2::float8 / COUNT(*) OVER (), host_hash "
+        "FROM (SELECT DISTINCT links.to_url, hashtext(pages.domain_name || ':' || pages.port) AS host_hash FROM links JOIN pages ON pages.url = links.to_url "
+        "WHERE links.url = $1 AND links.to_url <> $1) AS targets ORDER BY to_url "
+        "ON CONFLICT (url) DO UPDATE SET cash = queue.cash + EXCLUDED.cash - 1, priority = queue.priority + EXCLUDED.cash - 1;"
+        , url_str, cash);
+}
+
+Task<std::optional<std::string>> GeminiCrawler::getNextPotentialCarwlUrl(Clock::duration& waited)
+{
+    // The frontier is only touched from the loop. Everything below either runs on it or switches back to it
+    co_await drogon::switchThreadCoro(loop_);
+    while(!ended_) {
+        // Only take a ready host if the concurrency controller allows another fetch
+        // Slow hosts wait while they hold their share of slots
+        bool allow_slow = allowSlowHosts();
+        auto next_ready = frontier_.nextReadyTime(allow_slow);
+        if(next_ready.has_value() && *next_ready <= Clock::now() && concurrency_.tryAcquire()) {
+            auto next = frontier_.pop(Clock::now(), allow_slow);
+            if(next.has_value()) {
+                barrier_->crawlStarted();
+                // Another host may be ready as well. Pass it on to the next waiting worker
+                scheduleWakeUp();
+                co_return std::move(next->second);
             }
-            if(urls.size() == 0 && tablesample_pct >= 100)
-                co_return {};
-            
-            thread_local std::mt19937 rng(std::random_device{}());
-            std::vector<std::string> vec;
-            vec.reserve(urls.size());
-            for(const auto& url : urls)
-                vec.push_back(url["url"].as<std::string>());
-            // XXX: Half-working attempt at randomizing the crawling order.
-            std::shuffle(vec.begin(), vec.end(), rng);
-            for(auto&& url : vec)
-                craw_queue_.emplace(std::move(url));
+            concurrency_.release();
         }
-        catch(std::exception& e) {
-            // Only keep trying if is a transaction rollback
-            if(std::string_view(e.what()).find("deadlock") == std::string_view::npos &&
-                std::string_view(e.what()).find("transaction") == std::string_view::npos) {
-                throw;
+
+        // No host is ready. Ask the DB for more hosts to work on. One worker at a time, and only when the DB
+        // may have something new since it last came back empty
+        if(need_refill_ && !refilling_ && !frontier_.full()) {
+            refilling_ = true;
+            need_refill_ = false;
+            auto epoch = barrier_->epoch();
+            std::exception_ptr error;
+            bool found = false;
+            try {
+                found = co_await refillFrontier();
+            }
+            catch(...) {
+                error = std::current_exception();
             }
-            LOG_INFO << "Query for next URL failed due to transaction rollback. Retrying...";
+            co_await drogon::switchThreadCoro(loop_);
+            refilling_ = false;
+            if(error) {
+                need_refill_ = true;
+                std::rethrow_exception(error);
+            }
+            // A full batch likely means there is more in the DB
+            need_refill_ = found;
+            if(!found && frontier_.empty() && concurrency_.active() == 0)
+                barrier_->idle(this, epoch);
+            continue;
         }
+
+        // Sleep until a host becomes ready, a host is released or another crawl may have queued pages for us
+        scheduleWakeUp();
+        auto wait_start = Clock::now();
+        co_await WakeAwaiter{this};
+        waited += Clock::now() - wait_start;
     }
+    co_return std::nullopt;
+}
 
-    if(craw_queue_.try_pop(result))
-        co_return result;
-    co_return {};
+void GeminiCrawler::wakeWorkers(size_t n)
+{
+    while(n-- != 0 && !waiting_workers_.empty()) {
+        auto handle = waiting_workers_.front();
+        waiting_workers_.pop_front();
+        loop_->queueInLoop([handle]() { handle.resume(); });
+    }
+}
+
+void GeminiCrawler::scheduleWakeUp()
+{
+    // All slots are taken. Releasing one schedules again
+    if(concurrency_.active() >= concurrency_.limit())
+        return;
+    auto next_ready = frontier_.nextReadyTime(allowSlowHosts());
+    if(next_ready.has_value() == false)
+        return;
+    auto now = Clock::now();
+    if(*next_ready <= now) {
+        wakeWorkers(1);
+        return;
+    }
+    // A timer firing earlier wakes a worker that schedules the next one
+    if(wake_up_at_.has_value() && *wake_up_at_ <= *next_ready)
+        return;
+    wake_up_at_ = *next_ready;
+    loop_->runAfter(std::chrono::duration<double>(*next_ready - now).count(), [this, at = *next_ready]() {
+        if(wake_up_at_ == at)
+            wake_up_at_.reset();
+        wakeWorkers(1);
+    });
+}
+
+void GeminiCrawler::poke()
+{
+    need_refill_ = true;
+    if(!refilling_)
+        wakeWorkers(1);
 }
 
+void GeminiCrawler::finish()
+{
+    ended_ = true;
+    wakeWorkers(waiting_workers_.size());
+}
+
+std::optional<bool> GeminiCrawler::shouldCrawlCached(const tlgs::Url& url)
+{
+    if(url.good() == false || url.protocol() != "gemini" || inBlacklist(url.str()))
+        return false;
+    const auto key = url.hostWithPort(1965);
+    CompiledRobotsPolicyPtr policy;
+    if(!policy_cache.findAndFetch(key, policy))
+        return std::nullopt;
+    return !policy->matcher.isBlocked(url.path());
+}
 
 Task<bool> GeminiCrawler::shouldCrawl(std::string url_str)
 {
@@ -158,45 +613,77 @@ Task<bool> GeminiCrawler::shouldCrawl(std::string url_str)
         LOG_ERROR << url_str << " is not a Gemini URL";
         co_return false;
     }
-    if(inBlacklist(url.str()))
-        co_return false;
-    // Do not crawl hosts known to be down
-    // TODO: Put this on SQL
-    auto timeout = host_timeout_count_.find(url.hostWithPort(1965));
-    if(timeout != host_timeout_count_.end() && timeout->second > 3)
-        co_return false;
+    if(auto cached = shouldCrawlCached(url); cached.has_value())
+        co_return *cached;
 
-    // TODO: Use a LRU cache
-    // Consult the database to see if this URL is in robots.txt. Contents from the DB is cache locally to 
-    // redule the number of DB queries
+    // Consult the database to see if this URL is in robots.txt. Policies from the DB are compiled and cached
+    // locally to reduce the number of DB queries
     const std::string cache_key = url.hostWithPort(1965);
-    static drogon::CacheMap<std::string, std::vector<std::string>> policy_cache(loop_, 5);
-    std::vector<std::string> disallowed_path;
-    if(policy_cache.findAndFetch(cache_key, disallowed_path))
-        co_return !tlgs::isPathBlocked(url.path(), disallowed_path);
+    CompiledRobotsPolicyPtr policy;
+    if(policy_cache.findAndFetch(cache_key, policy))
+        co_return !policy->matcher.isBlocked(url.path());
+
+    // Only one caller loads the policy of a host. The others wait for it
+    std::shared_ptr<PolicyFlight> flight;
+    bool leader = false;
+    {
+        std::lock_guard lock(policy_flights_mutex);
+        auto& entry = policy_flights[cache_key];
+        if(entry == nullptr) {
+            entry = std::make_shared<PolicyFlight>();
+            leader = true;
+        }
+        flight = entry;
+    }
+    if(leader) {
+        CompiledRobotsPolicyPtr loaded;
+        std::exception_ptr error;
+        try {
+            // The previous flight may have just finished
+            if(!policy_cache.findAndFetch(cache_key, loaded)) {
+                auto fetched = co_await loadRobotsPolicy(url);
+                if(fetched.has_value())
+                    loaded = std::make_shared<const CompiledRobotsPolicy>(
+                        CompiledRobotsPolicy{tlgs::RobotsMatcher(fetched->disallowed), fetched->crawl_delay});
+            }
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        // Cached before the flight is gone. So no one starts another one in between
+        if(loaded != nullptr)
+            policy_cache.insert(cache_key, loaded, loaded->matcher.memoryUsage() + cache_key.size(), 60);
+        finishPolicyFlight(cache_key, flight, std::move(loaded), error);
+    }
+
+    policy = co_await PolicyFlightAwaiter{flight, loop_};
+    // XXX: Failed to handshake with the host. We should retry later
+    if(policy == nullptr)
+        co_return true;
+    co_return !policy->matcher.isBlocked(url.path());
+}
 
-    LOG_TRACE << "Cannot find " << cache_key << " in local policy cache";
+Task<std::optional<RobotsPolicy>> GeminiCrawler::loadRobotsPolicy(const tlgs::Url& url)
+{
+    RobotsPolicy policy;
+    auto& disallowed_path = policy.disallowed;
+    LOG_TRACE << "Cannot find " << url.hostWithPort(1965) << " in local policy cache";
     auto db = app().getDbClient();
-    auto policy_status = co_await db->execSqlCoro("SELECT have_policy FROM robot_policies_status "
+    auto policy_status = co_await db->execSqlCoro("SELECT have_policy, crawl_delay FROM robot_policies_status "
         "WHERE host = $1 AND port = $2 AND last_crawled_at > CURRENT_TIMESTAMP - INTERVAL '7' DAY", url.host(), url.port());
     if(policy_status.size() == 0) {
         LOG_TRACE << url.hostWithPort(1965) << " has no up to date robots policy stored in DB. Asking the host for robots.txt";
         HttpResponsePtr resp;
-        // FIXME: THe crawler may request robots.txt multiple times if multiple URLs on the same host are requested.
-        // This is not as efficient as it could be. But does not cause any problems otherwise.
         try {
             std::string robot_url = tlgs::Url(url).withParam("").withPath("/robots.txt").withFragment("").str();
             LOG_TRACE << "Fetching robots.txt from " << robot_url;
+            auto request_start = Clock::now();
             resp = co_await dremini::sendRequestCoro(robot_url, 10, loop_, 0x2625a0, {}, 10);
+            recordFetch(url, std::chrono::duration<double>(Clock::now() - request_start).count());
         }
         catch(std::exception& e) {
-            // XXX: Failed to handshake with the host. We should retry later
-            // Shoud we cache the result as no policy is available?
-            // policy_cache[cache_key] = {};
-            std::string error = e.what();
-            if(error == "Timeout" || error == "NetworkFailure")
-                host_timeout_count_[url.hostWithPort(1965)]++;
-            co_return true;
+            recordFetch(url, 0, e.what());
+            co_return std::nullopt;
         }
 
         assert(resp != nullptr);
@@ -204,26 +691,30 @@ Task<bool> GeminiCrawler::shouldCrawl(std::string url_str)
         int status = std::stoi(resp->getHeader("gemini-status"));
         // HACK: Some capsules have broken MIME
         bool have_robots_txt = status == 20 && (mime == "text/plain" || mime == "text/gemini");
+        std::optional<double> crawl_delay;
         if(have_robots_txt) {
-            disallowed_path = tlgs::parseRobotsTxt(std::string(resp->body()), {"*", "tlgs", "indexer"});
+            std::string robots_txt(resp->body());
+            disallowed_path = tlgs::parseRobotsTxt(robots_txt, {"*", "tlgs", "indexer"});
+            crawl_delay = tlgs::parseRobotsCrawlDelay(robots_txt, {"*", "tlgs", "indexer"});
+            policy.crawl_delay = crawl_delay.value_or(0);
         }
 
         try {
-            auto t = co_await db->newTransactionCoro();
-            co_await t->execSqlCoro("DELETE FROM robot_policies WHERE host = $1 AND port = $2;", url.host(), url.port());
-            for(const auto& disallow : disallowed_path) {
-                co_await t->execSqlCoro("INSERT INTO robot_policies (host, port, disallowed) VALUES ($1, $2, $3)",
-                    url.host(), url.port(), disallow);
-            }
-            co_await t->execSqlCoro("INSERT INTO robot_policies_status(host, port, last_crawled_at, have_policy) VALUES ($1, $2, CURRENT_TIMESTAMP, $3) "
-                "ON CONFLICT (host, port) DO UPDATE SET last_crawled_at = CURRENT_TIMESTAMP, have_policy = $3;"
-                , url.host(), url.port(), have_robots_txt);
+            // One statement replaces the whole policy. The DELETE doesn't see the rows inserted next to it
+            co_await db->execSqlCoro("WITH deleted AS (DELETE FROM robot_policies WHERE host = $1 AND port = $2), "
+                "inserted AS (INSERT INTO robot_policies (host, port, disallowed) SELECT $1, $2, unnest($5::text[])) "
+                "INSERT INTO robot_policies_status(host, port, last_crawled_at, have_policy, crawl_delay) "
+                "VALUES ($1, $2, CURRENT_TIMESTAMP, $3, $4) "
+                "ON CONFLICT (host, port) DO UPDATE SET last_crawled_at = CURRENT_TIMESTAMP, have_policy = $3, crawl_delay = $4;"
+                , url.host(), url.port(), have_robots_txt, crawl_delay, tlgs::pgTextArray(disallowed_path));
         }
         catch(...) {
             // Screw it. Someone else updated the policies. They've done the same job. We can keep on working
         }
     }
     else if(policy_status[0]["have_policy"].as<bool>()) {
+        if(!policy_status[0]["crawl_delay"].isNull())
+            policy.crawl_delay = policy_status[0]["crawl_delay"].as<double>();
         LOG_TRACE << url.hostWithPort(1965) << " has robots policy stored in DB.";
         auto stored_policy = co_await db->execSqlCoro("SELECT disallowed FROM robot_policies WHERE host = $1 AND port = $2;"
             , url.host(), url.port());
@@ -231,16 +722,14 @@ Task<bool> GeminiCrawler::shouldCrawl(std::string url_str)
             disallowed_path.push_back(path["disallowed"].as<std::string>());
     }
 
-    bool should_crawl = !tlgs::isPathBlocked(url.path(), disallowed_path);
-    policy_cache.insert(cache_key, std::move(disallowed_path), 60);
-    co_return should_crawl;
+    co_return policy;
 }
 
-Task<std::optional<std::string>> GeminiCrawler::getNextCrawlPage() 
+Task<std::optional<std::string>> GeminiCrawler::getNextCrawlPage(Clock::duration& waited)
 {
     auto db = app().getDbClient();
     while(1) {
-        auto next_url = co_await getNextPotentialCarwlUrl();
+        auto next_url = co_await getNextPotentialCarwlUrl(waited);
         if(next_url.has_value() == false)
             co_return {};
         
@@ -248,12 +737,38 @@ Task<std::optional<std::string>> GeminiCrawler::getNextCrawlPage()
 
         // URL should not contain any ASCII control characters
         auto it = std::find_if(url_str.begin(), url_str.end(), [](char c) { return c < 0x20; });
-        auto can_crawl = it == url_str.end() && co_await shouldCrawl(url_str);
+        bool can_crawl = false;
+        std::optional<double> host_down_for;
+        try {
+            can_crawl = it == url_str.end() && co_await shouldCrawl(url_str);
+            if(can_crawl) {
+                const auto url = tlgs::Url(url_str);
+                host_down_for = (co_await hostHealth(url)).openFor();
+                // Only for the page being crawled. Not for every link checked by shouldCrawl(). The policy was
+                // just cached by shouldCrawl() unless the host couldn't be asked for it
+                CompiledRobotsPolicyPtr policy;
+                if(policy_cache.findAndFetch(url.hostWithPort(1965), policy))
+                    setCrawlDelay(url.hostWithPort(1965), policy->crawl_delay);
+            }
+        }
+        catch(...) {
+            releaseHost(url_str);
+            throw;
+        }
+        // The host is known to be down. The page isn't blocked though, it comes back once it's time to probe the
+        // host again
+        if(host_down_for.has_value() && *host_down_for > 0) {
+            releaseHost(url_str);
+            co_await scheduleRecrawl(url_str, *host_down_for);
+            continue;
+        }
         if(can_crawl == false) {
+            releaseHost(url_str);
             co_await db->execSqlCoro("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_status = $2, last_meta = $3 WHERE url = $1;"
                 , url_str, 0, std::string("blocked"));
             co_await db->execSqlCoro("DELETE FROM pages WHERE url = $1 AND last_crawl_success_at < CURRENT_TIMESTAMP - INTERVAL '30' DAY;"
                 , url_str);
+            co_await scheduleRecrawl(url_str, default_recrawl_interval);
             continue;
         }
 
@@ -265,41 +780,34 @@ Task<std::optional<std::string>> GeminiCrawler::getNextCrawlPage()
     co_return {};
 }
 
-void GeminiCrawler::dispatchCrawl()
+Task<void> GeminiCrawler::runWorker(size_t id)
 {
-    if(ended_)
-        return;
-    // In case I forgot how this works in the future:
-    // Start new crawls up to max_concurrent_connections_. And launch new crawls when we might have more pages to crawl.
-    // This function is tricky and difficult to understand. It's a bit of a hack. But it is 100% lock free. The general idea is asi
-    // follows:
-    // 1. A atomic counter is used to keep track of the number of active crawls.
-    // 2. If we successfully got new url to crawl, we spawn dispatch a new crawl.
-    // 3. When a crawl finishes, we resubmit the crawl task.
-    //    * Keep re-submiting crawls until there's no more to crawl
-    //    * It doesn't matter if currently enough crawler exists. Since the counter stops them from crawling
-    // 4. Near the end of crawling. It might be possible that there's not enough pages to be crawled
-    //    * But a crawler may suddenly submit more links for crawling.
-    //    * The nature of dispatching more and more crawlers help. Reactivating crawls if neded.
-    auto counter = std::make_shared<tlgs::Counter>(ongoing_crawlings_);
-    if(counter->count() >= max_concurrent_connections_)
-        return;
-
-    async_run([counter, this]() mutable -> Task<void> {try{
-        auto url_str = co_await getNextCrawlPage();
-        // Crawling has ended if the following is true
-        // 1. There's no more URL to crawl
-        // 2. The current crawl is the last one in existance
-        //    * Since a crawler can add new items into the queue
-        if(url_str.has_value() == false) {
-            if(counter->release() == 1)
-                ended_ = true;
-            co_return;
+    const auto started_at = Clock::now();
+    // Time spent waiting for work. The rest of the worker's life it is handling a URL (or failing to get one)
+    Clock::duration waited{};
+    size_t crawled = 0;
+    while(true) {
+        std::optional<std::string> url_str;
+        bool failed = false;
+        try {
+            url_str = co_await getNextCrawlPage(waited);
+        }
+        catch(std::exception& e) {
+            LOG_ERROR << "Exception escaped in getNextCrawlPage(): " << e.what();
+            failed = true;
         }
-        loop_->runInLoop([this](){dispatchCrawl();});
+        if(failed) {
+            // Most likely the DB is unreachable. Don't hammer it
+            co_await drogon::sleepCoro(loop_, 1.0);
+            continue;
+        }
+        if(url_str.has_value() == false)
+            break;
 
+        double recrawl_interval = default_recrawl_interval;
+        bool success = false;
         try {
-            bool success = co_await crawlPage(url_str.value());
+            success = co_await crawlPage(url_str.value(), recrawl_interval);
             if(success)
                 LOG_INFO << "Processed " << url_str.value();
             // else // we already print out the error message in crawlPage()
@@ -309,15 +817,32 @@ void GeminiCrawler::dispatchCrawl()
             LOG_ERROR << "Exception escaped crawling "<< url_str.value() <<": " << e.what();
             abort();
         }
-        loop_->queueInLoop([this](){dispatchCrawl();});
+        // Not worth stopping the crawl for. The lease of the URL expires and it is claimed again
+        try {
+            co_await scheduleRecrawl(url_str.value(), recrawl_interval);
+            if(success)
+                co_await distributeCash(url_str.value());
+        }
+        catch(std::exception& e) {
+            LOG_WARN << "Failed to reschedule " << url_str.value() << ": " << e.what();
+        }
+        releaseHost(url_str.value());
+        crawled++;
+    }
+
+    co_await drogon::switchThreadCoro(loop_);
+    double lifetime = std::chrono::duration<double>(Clock::now() - started_at).count();
+    double busy = lifetime - std::chrono::duration<double>(waited).count();
+    LOG_INFO << fmt::format("Crawler {} worker {}: {} pages, busy {:.1f}% of {:.0f}s", shard_, id, crawled
+        , lifetime > 0 ? 100 * busy / lifetime : 0.0, lifetime);
+    if(--running_workers_ == 0) {
+        for(auto handle : end_waiters_)
+            loop_->queueInLoop([handle]() { handle.resume(); });
+        end_waiters_.clear();
     }
-    catch(std::exception& e) {
-        LOG_ERROR << "Exception escaped in dispatchCrawl(): " << e.what();
-        dispatchCrawl();
-    }});
 }
 
-Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
+Task<bool> GeminiCrawler::crawlPage(const std::string& url_str, double& recrawl_interval)
 {
     auto db = app().getDbClient();
     const auto url = tlgs::Url(url_str);
@@ -330,14 +855,32 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
     }
 
     std::string error;
+    // The URL fetched last. The target of a redirect is not the host of url
+    auto crawl_url = url;
     try {
         if(co_await shouldCrawl(url.str()) == false)
             throw std::runtime_error("Blocked by robots.txt");
         auto record = co_await db->execSqlCoro("SELECT url, indexed_content_hash , raw_content_hash, last_status"
-            ", last_crawled_at FROM pages WHERE url = $1;", url.str());
+            ", last_crawled_at, change_count, observed_since FROM pages WHERE url = $1;", url.str());
         bool have_record = record.size() != 0;
         auto indexed_content_hash = have_record ? record[0]["indexed_content_hash"].as<std::string>() : "";
         auto raw_content_hash = have_record ? record[0]["raw_content_hash"].as<std::string>() : "";
+        int64_t change_count = have_record ? record[0]["change_count"].as<int64_t>() : 0;
+        // Seconds since the given column. 0 if it's NULL
+        auto secondsSince = [&](const char* column) -> double {
+            if(!have_record || record[0][column].isNull())
+                return 0;
+            auto time = trantor::Date::fromDbStringLocal(record[0][column].as<std::string>());
+            return (trantor::Date::now().microSecondsSinceEpoch() - time.microSecondsSinceEpoch()) / 1e6;
+        };
+        // How long until the content should be checked again. From how often it changed and whether it did now
+        auto contentRecrawlInterval = [&](bool changed) {
+            double last_interval = secondsSince("last_crawled_at");
+            if(last_interval <= 0)
+                last_interval = default_recrawl_interval;
+            return tlgs::recrawlInterval(secondsSince("observed_since"), change_count, last_interval, changed,
+                min_recrawl_interval, max_recrawl_interval);
+        };
 
         if(!have_record) {
             co_await db->execSqlCoro("INSERT INTO pages(url, domain_name, port, first_seen_at)"
@@ -356,9 +899,13 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
                     return trantor::Date::fromDbStringLocal(var.as<std::string>());
             }();
 
-            if(last_status == 53 && last_crawled_at.after(21*7*24*3600) < trantor::Date::now()) {
+            const auto retry_at = last_crawled_at.after(21*24*3600);
+            const auto now = trantor::Date::now();
+            if(last_status == 53 && now < retry_at) {
                 LOG_INFO << "Skipping " << url.str() << " that was proxy-errored recently";
-                co_return true;
+                // Not fetched. So it comes back when the window is over and has no cash to hand out
+                recrawl_interval = (retry_at.microSecondsSinceEpoch() - now.microSecondsSinceEpoch()) / 1e6;
+                co_return false;
             }
         }
 
@@ -367,10 +914,11 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
         HttpResponsePtr resp;
         int redirection_count = 0;
         int status;
-        auto crawl_url = url;
         do {
             // 2.5MB is the maximum size of page we will index. 10s timeout, max 5 redirects and 25s max transfer time.
+            auto request_start = Clock::now();
             resp = co_await dremini::sendRequestCoro(crawl_url.str(), 10, loop_, 0x2625a0, indexd_mimes, 25.0);
+            recordFetch(crawl_url, std::chrono::duration<double>(Clock::now() - request_start).count());
 
             status = std::stoi(resp->getHeader("gemini-status"));
             if(status / 10 == 3) {
@@ -381,6 +929,8 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
                     throw std::runtime_error("Redirected to non-gemini URL");
                 if(co_await shouldCrawl(redirect_url.str()) == false)
                     throw std::runtime_error("Redirected to blocked URL");
+                if(!(co_await hostHealth(redirect_url)).available())
+                    throw std::runtime_error("Redirected to unavailable host");
                 crawl_url = std::move(redirect_url);
             }
         } while(status / 10 == 3 && redirection_count++ < 5);
@@ -406,10 +956,12 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
 
             // No reason to reindex if the content hasn't changed. `force_reindex_` is used to force reindexing of files
             if(force_reindex_ == false && raw_content_hash == new_raw_content_hash) {
-                co_await db->execSqlCoro("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_crawl_success_at = CURRENT_TIMESTAMP, "
-                    "last_status = $2, last_meta = $3, content_type = $4 WHERE url = $1;",
+                co_await execCounted("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_crawl_success_at = CURRENT_TIMESTAMP, "
+                    "last_status = $2, last_meta = $3, content_type = $4, observed_since = COALESCE(observed_since, CURRENT_TIMESTAMP) "
+                    "WHERE url = $1;",
                     url.str(), status, meta, mime);
-                    co_return true;
+                recrawl_interval = contentRecrawlInterval(false);
+                co_return true;
             }
 
             // We should only have text files at this point. Try convert everything to UTF-8 because iconv will
@@ -459,19 +1011,26 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
         }
         else {
             LOG_ERROR << "Failed to fetch " << url.str() << ": " << status;
-            co_await db->execSqlCoro("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_status = $2, last_meta = $3 WHERE url = $1;"
+            co_await execCounted("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_status = $2, last_meta = $3 WHERE url = $1;"
                 , url.str(), status, meta);
-            co_await db->execSqlCoro("DELETE FROM pages WHERE url = $1 AND last_crawl_success_at < CURRENT_TIMESTAMP - INTERVAL '30' DAY;"
+            co_await execCounted("DELETE FROM pages WHERE url = $1 AND last_crawl_success_at < CURRENT_TIMESTAMP - INTERVAL '30' DAY;"
                 , url.str());
             co_return false;
         }
 
+        // A page seen for the first time isn't a change. The content is watched from now on
+        bool content_changed = !raw_content_hash.empty() && new_raw_content_hash != raw_content_hash;
+        if(content_changed)
+            change_count++;
+        recrawl_interval = raw_content_hash.empty() ? default_recrawl_interval : contentRecrawlInterval(content_changed);
+
         auto new_indexed_content_hash = tlgs::xxHash64(body);
         // Absolutelly no reason to reindex if the content hasn't changed even after post processing.
         if(new_indexed_content_hash == indexed_content_hash && new_raw_content_hash == raw_content_hash) {
             // Maybe this is too strict? The conent doesn't change means the content_type doesn't change, right...?
-            co_await db->execSqlCoro("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_crawl_success_at = CURRENT_TIMESTAMP, "
-                "last_status = $2, last_meta = $3, content_type = $4 WHERE url = $1;",
+            co_await execCounted("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_crawl_success_at = CURRENT_TIMESTAMP, "
+                "last_status = $2, last_meta = $3, content_type = $4, observed_since = COALESCE(observed_since, CURRENT_TIMESTAMP) "
+                "WHERE url = $1;",
                 url.str(), status, meta, mime);
             co_return true;
         }
@@ -522,15 +1081,16 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
             });
 
         // TODO: Guess the language of the content. Then index them with different parsers
-        co_await db->execSqlCoro("UPDATE pages SET content_body = $2, size = $3, charset = $4, lang = $5, last_crawled_at = CURRENT_TIMESTAMP, "
+        co_await execCounted("UPDATE pages SET content_body = $2, size = $3, charset = $4, lang = $5, last_crawled_at = CURRENT_TIMESTAMP, "
             "last_crawl_success_at = CURRENT_TIMESTAMP, last_status = $6, last_meta = $7, content_type = $8, title = $9, "
-            "cross_site_links = $10::json, internal_links = $11::json, indexed_content_hash = $12, raw_content_hash = $13, feed_type = $14 WHERE url = $1;",
+            "cross_site_links = $10::json, internal_links = $11::json, indexed_content_hash = $12, raw_content_hash = $13, feed_type = $14, "
+            "change_count = $15, observed_since = COALESCE(observed_since, CURRENT_TIMESTAMP) WHERE url = $1;",
             url.str(), body, body_size, charset, lang, status, meta, mime, title, nlohmann::json(cross_site_links).dump()
-            , nlohmann::json(internal_links).dump(), new_indexed_content_hash, new_raw_content_hash, feed_type);
+            , nlohmann::json(internal_links).dump(), new_indexed_content_hash, new_raw_content_hash, feed_type, change_count);
 
         // Full text index update
         auto index_firendly_url = indexFriendly(url);
-        co_await db->execSqlCoro("UPDATE pages SET search_vector = to_tsvector(REPLACE(title, '.', ' ') || ' ' || $2 || ' ' || content_body), "
+        co_await execCounted("UPDATE pages SET search_vector = to_tsvector(REPLACE(title, '.', ' ') || ' ' || $2 || ' ' || content_body), "
             "title_vector = to_tsvector(REPLACE(title, '.', ' ') || ' ' || $2), last_indexed_at = CURRENT_TIMESTAMP WHERE url = $1;"
             , url.str(), index_firendly_url);
         if(internal_links.size() == 0 && cross_site_links.size() == 0)
@@ -540,7 +1100,7 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
         // XXX: Drogon does not support bulk insert API. We have to do with string concatenation (with proper escaping)
         std::string link_query = "INSERT INTO links (url, host, port, to_url, is_cross_site, to_host, to_port) VALUES ";
         std::string page_query = "INSERT INTO pages (url, domain_name, port, first_seen_at) VALUES ";
-        size_t page_count = 0;
+        std::vector<std::string> new_urls;
         for(const auto& link_url : link_urls) {
             bool is_cross_site = link_url.host() != url.host() || url.port() != link_url.port();
 
@@ -548,30 +1108,104 @@ Task<bool> GeminiCrawler::crawlPage(const std::string& url_str)
                 pgSQLRealEscape(url.str()), pgSQLRealEscape(url.host()), url.port(), pgSQLRealEscape(link_url.str()),
                 is_cross_site, pgSQLRealEscape(link_url.host()), link_url.port());
 
-            if(co_await shouldCrawl(link_url.str()) == false)
+            // Most links go to hosts seen just before. Answer those without a coroutine
+            bool crawlable;
+            if(auto cached = shouldCrawlCached(link_url); cached.has_value())
+                crawlable = *cached;
+            else
+                crawlable = co_await shouldCrawl(link_url.str());
+            if(crawlable == false)
                 continue;
             page_query += fmt::format("('{}', '{}', {}, CURRENT_TIMESTAMP), ",
                 pgSQLRealEscape(link_url.str()), pgSQLRealEscape(link_url.host()), link_url.port());
-            page_count++;
+            new_urls.push_back(link_url.str());
         }
 
-        co_await db->execSqlCoro("DELETE FROM links WHERE url = $1", url.str());
-        co_await db->execSqlCoro(link_query.substr(0, link_query.size() - 2) + " ON CONFLICT DO NOTHING;");
-        if(page_count != 0)
-            co_await db->execSqlCoro(page_query.substr(0, page_query.size() - 2) + " ON CONFLICT DO NOTHING;");
+        co_await execCounted("DELETE FROM links WHERE url = $1", url.str());
+        co_await execCounted(link_query.substr(0, link_query.size() - 2) + " ON CONFLICT DO NOTHING;");
+        if(new_urls.size() != 0) {
+            co_await execCounted(page_query.substr(0, page_query.size() - 2) + " ON CONFLICT DO NOTHING;");
+            // Pages seen before are already queued
+            auto queued = co_await execCounted("INSERT INTO crawl_queue (url, due_at, host_hash) SELECT pages.url, "
+                "CURRENT_TIMESTAMP, hashtext(pages.domain_name || ':' || pages.port) FROM unnest($1::text[]) AS new_urls(url) "
+                "JOIN pages ON pages.url = new_urls.url ORDER BY pages.url ON CONFLICT DO NOTHING;", tlgs::pgTextArray(new_urls));
+            if(queued.affectedRows() != 0)
+                barrier_->pagesQueued();
+        }
     }
     catch(std::exception& e) {
         error = e.what();
     }
 
     if(error == "Timeout" || error == "NetworkFailure")
-        host_timeout_count_[url.hostWithPort(1965)]++;
+        recordFetch(crawl_url, 0, error);
     if(error != "") {
-        co_await db->execSqlCoro("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_status = $2, last_meta = $3 WHERE url = $1;"
+        co_await execCounted("UPDATE pages SET last_crawled_at = CURRENT_TIMESTAMP, last_status = $2, last_meta = $3 WHERE url = $1;"
             , url.str(), 0, error);
-        co_await db->execSqlCoro("DELETE FROM pages WHERE url = $1 AND last_crawl_success_at < CURRENT_TIMESTAMP - INTERVAL '30' DAY;"
+        co_await execCounted("DELETE FROM pages WHERE url = $1 AND last_crawl_success_at < CURRENT_TIMESTAMP - INTERVAL '30' DAY;"
             , url.str());
         co_return false;
     }
     co_return true;
 }
+
+void CrawlBarrier::add(GeminiCrawler* crawler)
+{
+    std::lock_guard lock(mutex_);
+    crawlers_.push_back(crawler);
+}
+
+void CrawlBarrier::crawlStarted()
+{
+    std::lock_guard lock(mutex_);
+    in_flight_++;
+}
+
+void CrawlBarrier::pagesQueued()
+{
+    std::vector<GeminiCrawler*> crawlers;
+    {
+        std::lock_guard lock(mutex_);
+        epoch_++;
+        crawlers = crawlers_;
+    }
+    // The pages may belong to any of the crawlers
+    for(auto crawler : crawlers)
+        crawler->loop_->queueInLoop([crawler]() { crawler->poke(); });
+}
+
+void CrawlBarrier::crawlFinished()
+{
+    // Crawls that queued nothing don't send anyone to the DB. Then the crawlers that are idle stay idle, and this
+    // may have been the last crawl in flight
+    std::lock_guard lock(mutex_);
+    in_flight_--;
+    finishIfIdle();
+}
+
+uint64_t CrawlBarrier::epoch()
+{
+    std::lock_guard lock(mutex_);
+    return epoch_;
+}
+
+void CrawlBarrier::idle(GeminiCrawler* crawler, uint64_t epoch)
+{
+    std::lock_guard lock(mutex_);
+    idle_[crawler] = epoch;
+    finishIfIdle();
+}
+
+void CrawlBarrier::finishIfIdle()
+{
+    if(done_ || in_flight_ != 0)
+        return;
+    for(auto c : crawlers_) {
+        auto it = idle_.find(c);
+        if(it == idle_.end() || it->second != epoch_)
+            return;
+    }
+    done_ = true;
+    for(auto c : crawlers_)
+        c->loop_->queueInLoop([c]() { c->finish(); });
+}
@@ -3,11 +3,21 @@
 #include <string>
 #include <vector>
 #include <optional>
-#include <tbb/concurrent_unordered_map.h>
-#include <tbb/concurrent_queue.h>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <coroutine>
+#include <unordered_map>
 #include <trantor/net/EventLoop.h>
 #include <drogon/utils/coroutine.h>
+#include <tlgsutils/host_frontier.hpp>
+#include <tlgsutils/concurrency_controller.hpp>
+#include <tlgsutils/host_health.hpp>
+#include <tlgsutils/lru_cache.hpp>
+#include <tlgsutils/url_parser.hpp>
 
+class CrawlBarrier;
+struct RobotsPolicy;
 
 class GeminiCrawler : public trantor::NonCopyable
 {
@@ -16,54 +26,40 @@ public:
     template<typename T>
     using Task = drogon::Task<T>;
 
-    GeminiCrawler(EventLoop* loop) : loop_(loop) {}
+    /**
+     * @brief Construct a crawler. Multiple crawlers on different loops split the work by host. Each of them
+     * only crawls hosts whose hash (computed by the DB) modulo shard_count is shard. So all requests to a
+     * host come from one loop and the frontier is only ever touched from that loop
+     *
+     * @param loop the loop crawling happens in
+     * @param shard index of this crawler
+     * @param shard_count total number of crawlers
+     * @param barrier shared by all the crawlers. Ends the crawl when none of them has anything left
+     */
+    GeminiCrawler(EventLoop* loop, size_t shard = 0, size_t shard_count = 1,
+        std::shared_ptr<CrawlBarrier> barrier = nullptr);
 
     /**
-     * @brief Adds a url to the crawling queue.
+     * @brief Adds a url to the crawling queue. The URL is stored in the DB, due now. So whichever crawler
+     * owns its host picks it up
      * 
      * @param url the URL to be queued.
      */
-
-    void addUrl(const std::string& url)
-    {
-        craw_queue_.push(url);
-    }
+    static Task<void> addUrl(const std::string& url);
 
     /**
-     * @brief Start the crawler.
+     * @brief Start maxConcurrentConnections() workers. Each of them crawls one page at a time until the
+     * crawl is over.
      * @note This function is async and returns immediately.
      * 
      */
-    void start()
-    {
-        dispatchCrawl();
-    }
+    void start();
 
     /**
-     * @brief co_returns when the crawler is done.
+     * @brief co_returns when all workers of this crawler are done. That is when the barrier tells the
+     * crawl is over.
      */
-    Task<void> awaitEnd()
-    {
-        int finish_count = 0;
-        while(true) {
-            co_await drogon::sleepCoro(loop_, 0.2);
-            if(ended_)
-                break;
-
-            // HACK: Sometimes ended_ is not set. Workaround when we see 5 conseqitive 0 crawlings 
-            if(ongoing_crawlings_ == 0) {
-                finish_count ++;
-                loop_->runInLoop([this] {dispatchCrawl();});
-            }
-            else
-                finish_count = 0;
-            if(finish_count == 5) {
-                ended_ = true;
-                break;
-            }
-        }
-        co_return;
-    }
+    Task<void> awaitEnd();
 
     /**
      * @brief Crawl all the pages
@@ -72,15 +68,47 @@ public:
      */
     Task<void> crawlAll()
     {
-        dispatchCrawl();
+        start();
         return awaitEnd();
     }
 
+    /**
+     * @brief Max number of concurrent fetches. Also the number of workers. The number actually allowed is
+     * adjusted at runtime between the min and this by how fast fetches are, how many of them time out and
+     * how far behind the DB writes are
+     */
     void setMaxConcurrentConnections(size_t n)
     {
-        max_concurrent_connections_ = n;
+        loop_->runInLoop([this, n]() {
+            max_concurrent_connections_ = n;
+            concurrency_.setLimits(min_concurrent_connections_, n);
+        });
     }
 
+    /**
+     * @brief Concurrent fetches allowed at the start and when congested
+     */
+    void setMinConcurrentConnections(size_t n)
+    {
+        loop_->runInLoop([this, n]() {
+            min_concurrent_connections_ = n;
+            concurrency_.setLimits(n, max_concurrent_connections_);
+        });
+    }
+
+    /**
+     * @brief Fewer fetches are allowed when more DB writes than this (of all crawlers) are pending
+     */
+    void setMaxDbBacklog(size_t n)
+    {
+        loop_->runInLoop([this, n]() {
+            concurrency_.setMaxBacklog(n);
+        });
+    }
+
+    /**
+     * @brief Read it on the crawler's loop. The setter applies there
+     */
     size_t maxConcurrentConnections() const
     {
         return max_concurrent_connections_;
@@ -90,15 +118,57 @@ public:
     {
         force_reindex_ = enable;
     }
+
+    /**
+     * @brief Max number of URLs kept in memory waiting to be crawled. The rest stay in the DB
+     */
+    void setFrontierSize(size_t n)
+    {
+        loop_->runInLoop([this, n]() {
+            frontier_.setMaxSize(n);
+        });
+    }
+
+    /**
+     * @brief Min seconds between the end of a request to a host and the start of the next one. Hosts
+     * asking for a longer Crawl-delay in robots.txt get that instead
+     */
+    void setHostDelay(double seconds)
+    {
+        loop_->runInLoop([this, seconds]() {
+            host_delay_ = seconds;
+            frontier_.setDefaultDelay(std::chrono::duration_cast<tlgs::HostFrontier::Clock::duration>(
+                std::chrono::duration<double>(seconds)));
+        });
+    }
 protected:
+    friend class CrawlBarrier;
+    struct WakeAwaiter;
+    struct EndAwaiter;
+    using Clock = tlgs::HostFrontier::Clock;
+
     /**
-     * @brief Launches up to max_concurrent_connections_ concurrent crawler tasks (not threads)
-     * to fetch content from URLs. This function is async and returns immediately.
-     * 
-     * @note await on `awaiteEnd()` to wait for all the tasks to finish.
-     * @note This function continues launch tasks until all the URLs are crawled.
+     * @brief A worker. Takes pages from the frontier and crawls them one by one until the crawl ends
+     *
+     * @param id index of the worker. For reporting
+     */
+    Task<void> runWorker(size_t id);
+    /**
+     * @brief Resume up to n workers waiting for work. Must be called from loop_
+     */
+    void wakeWorkers(size_t n = 1);
+    /**
+     * @brief Make sure a worker is woken up when the next host becomes ready. Must be called from loop_
+     */
+    void scheduleWakeUp();
+    /**
+     * @brief A crawl somewhere queued pages due now. Called by the barrier
+     */
+    void poke();
+    /**
+     * @brief The crawl is over. Called by the barrier
      */
-    void dispatchCrawl();
+    void finish();
     /**
      * @brief Should the crawler crawl this URL? Checks against robots.txt and an internel
      * blacklist.
@@ -107,27 +177,161 @@ protected:
      * @return true if the crawler should crawl this URL.
      */
     Task<bool> shouldCrawl(std::string url_str);
+    /**
+     * @brief shouldCrawl() answered from the caches alone. Without suspending
+     *
+     * @return std::nullopt if the answer needs the DB or the host
+     */
+    std::optional<bool> shouldCrawlCached(const tlgs::Url& url);
+    /**
+     * @brief Load the robots.txt policy of the host of the URL from the DB. Or fetch and store it if the
+     * DB has none or an outdated one
+     *
+     * @return std::nullopt if robots.txt could not be fetched
+     */
+    Task<std::optional<RobotsPolicy>> loadRobotsPolicy(const tlgs::Url& url);
     /**
      * 
      * @brief Get the next URL that the crawler should crawl.
      * @param url The URL to crawl.
      * 
+     * @param waited time spent waiting for work is added to it
      * @return std::nullopt if no URL is available.
      */
-    Task<std::optional<std::string>> getNextCrawlPage();
-    Task<std::optional<std::string>> getNextPotentialCarwlUrl();
+    Task<std::optional<std::string>> getNextCrawlPage(Clock::duration& waited);
+    /**
+     * @brief Get the next URL from the frontier. Waits for a host to become ready and refills the
+     * frontier from the DB when needed. The host of the URL is busy until releaseHost() is called
+     *
+     * @param waited time spent waiting for a host is added to it
+     * @return std::nullopt if there's nothing left to crawl
+     */
+    Task<std::optional<std::string>> getNextPotentialCarwlUrl(Clock::duration& waited);
+    /**
+     * @brief Claim a batch of URLs due for crawling from the DB and queue them into the frontier
+     *
+     * @return false if the DB has nothing left to crawl or nothing the frontier has room for
+     */
+    Task<bool> refillFrontier();
+    /**
+     * @brief Queue the URL to be crawled again after it is crawled
+     *
+     * @param recrawl_interval seconds from now until the URL is due again
+     */
+    Task<void> scheduleRecrawl(const std::string& url_str, double recrawl_interval);
+    /**
+     * @brief Pass the cash of a crawled page on to the pages it links to. Updating their importance
+     */
+    Task<void> distributeCash(const std::string& url_str);
+    /**
+     * @brief Tell the frontier that we are done with the host of the URL. Must be called exactly once
+     * for each URL returned by getNextPotentialCarwlUrl()
+     */
+    void releaseHost(const std::string& url_str);
+    /**
+     * @brief Tell the concurrency controller and the health of the host how a fetch went
+     *
+     * @param latency seconds the fetch took. Ignored if it failed
+     * @param error what the fetch threw. Empty if it succeeded
+     */
+    void recordFetch(const tlgs::Url& url, double latency, const std::string& error = "");
+    /**
+     * @brief Health of the host of the URL. Hosts not seen yet are loaded from the DB (or start healthy).
+     * A host being down only postpones crawling its pages. It doesn't affect shouldCrawl()
+     */
+    Task<tlgs::HostHealth> hostHealth(const tlgs::Url& url);
+    static Task<void> storeHostHealth(std::string host, int port, tlgs::HostHealth health);
+    /**
+     * @brief Can another slow host be crawled. Slow hosts only get a share of the slots. Must be called from loop_
+     */
+    bool allowSlowHosts() const;
+    /**
+     * @brief Set how long a host must be left alone between requests. In seconds. Applies from the next
+     * time the host is released
+     *
+     * @param host the frontier key of the host. i.e. Url::hostWithPort(1965)
+     */
+    void setCrawlDelay(const std::string& host, double crawl_delay);
     /**
      * @brief Crawl the given URL. Then add the content found in that URL to the DB
      * 
      * @param url_str the URL to crawl
+     * @param recrawl_interval set to seconds until the URL should be crawled again. Adapted to how often the
+     * content changes. Left alone if the crawl fails
+     * @return true if the page is fetched. false if the crawl failed or the page is skipped without fetching it
      */
-    Task<bool> crawlPage(const std::string& url_str);
+    Task<bool> crawlPage(const std::string& url_str, double& recrawl_interval);
 
     EventLoop* loop_;
-    tbb::concurrent_unordered_map<std::string, size_t> host_timeout_count_;
-    tbb::concurrent_queue<std::string> craw_queue_;
+    // Keyed by host with port. Only modified from loop_
+    tlgs::LruCache<std::string, tlgs::HostHealth> host_health_{100000};
+    size_t shard_;
+    size_t shard_count_;
+    // Only touched from loop_
+    tlgs::HostFrontier frontier_;
+    double host_delay_ = 1;
+    bool refilling_ = false;
     size_t max_concurrent_connections_ = 1;
-    std::atomic<size_t> ongoing_crawlings_ = 0;
-    std::atomic<bool> ended_ = false;
+    size_t min_concurrent_connections_ = 1;
     bool force_reindex_ = false;
+
+    // Worker state. Only touched from loop_
+    std::shared_ptr<CrawlBarrier> barrier_;
+    bool ended_ = false;
+    // The DB may have new pages due for us since the last refill
+    bool need_refill_ = true;
+    // Slots for URLs handed out and not yet released
+    tlgs::AimdController concurrency_;
+    size_t running_workers_ = 0;
+    std::deque<std::coroutine_handle<>> waiting_workers_;
+    std::vector<std::coroutine_handle<>> end_waiters_;
+    std::optional<Clock::time_point> wake_up_at_;
+};
+
+/**
+ * @brief Tells when the crawl is over across all crawlers (shards). Which is when no crawler has anything
+ * queued or in flight and all of them found nothing due in the DB after the last crawl anywhere queued
+ * new pages. A crawl in flight can still discover new pages, for any shard. So a crawl queueing pages wakes
+ * all crawlers to look in the DB again. Crawls that queued nothing wake no one.
+ */
+class CrawlBarrier : public trantor::NonCopyable
+{
+public:
+    void add(GeminiCrawler* crawler);
+    /**
+     * @brief A crawler handed out a URL
+     */
+    void crawlStarted();
+    /**
+     * @brief A crawl in flight inserted new pages into the crawl queue
+     */
+    void pagesQueued();
+    /**
+     * @brief A URL handed out is done. Anything it discovered is in the DB by now
+     */
+    void crawlFinished();
+    /**
+     * @brief Count of crawls that queued new pages. Read before looking for due pages in the DB
+     */
+    uint64_t epoch();
+    /**
+     * @brief The crawler has nothing queued or in flight and found nothing in the DB. Looking after epoch.
+     * Ends the crawl if all crawlers are in that state and nothing finished since they looked
+     */
+    void idle(GeminiCrawler* crawler, uint64_t epoch);
+
+protected:
+    /**
+     * @brief End the crawl if nothing is in flight and all crawlers are idle at the current epoch. mutex_ must
+     * be held
+     */
+    void finishIfIdle();
+
+    std::mutex mutex_;
+    std::vector<GeminiCrawler*> crawlers_;
+    // Epoch each idle crawler looked in the DB at
+    std::unordered_map<GeminiCrawler*, uint64_t> idle_;
+    size_t in_flight_ = 0;
+    uint64_t epoch_ = 0;
+    bool done_ = false;
 };
@@ -1,6 +1,7 @@
 #include <string>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <unordered_map>
 #include <trantor/utils/Logger.h>
 #include <drogon/HttpAppFramework.h>
@@ -20,21 +21,46 @@ int main(int argc, char** argv)
 
     std::string seed_link_file;
     size_t concurrent_connections = 1;
+    size_t min_connections = 1;
+    size_t max_db_backlog = 32;
     bool force_reindex = false;
+    size_t frontier_size = 10000;
+    double host_delay = 1;
+    size_t threads = 0;
     std::string config_file = "/etc/tlgs/config.json";
     cli.add_option("-s,--seed", seed_link_file, "Path to seed links for initalizing crawling");
-    cli.add_option("-c", concurrent_connections, "Number of concurrent connections");
+    cli.add_option("-c", concurrent_connections, "Max number of concurrent connections");
+    cli.add_option("--min-connections", min_connections, "Number of concurrent connections to start with and to fall back to when congested");
+    cli.add_option("--max-db-backlog", max_db_backlog, "Allow fewer connections when more page writing statements than this are waiting for or running on the DB");
     cli.add_option("--force-reindex", force_reindex, "Force re-indexing of all links");
+    cli.add_option("--frontier-size", frontier_size, "Max number of URLs waiting to be crawled kept in memory");
+    cli.add_option("--host-delay", host_delay, "Min seconds between requests to the same host");
+    cli.add_option("-t,--threads", threads, "Number of threads to crawl with. Hosts are split among them (0 uses threads_num in the config)");
     cli.add_option("config_file", config_file, "Path to TLGS config file");
 
     CLI11_PARSE(cli, argc, argv);
     LOG_INFO << "Loading config from " << config_file;
     app().loadConfigFile(config_file);
+    if(threads != 0)
+        app().setThreadNum(threads);
 
     app().getLoop()->queueInLoop(async_func([&]() -> Task<void> {
-        auto crawler = std::make_shared<GeminiCrawler>(app().getIOLoop(0));
-        crawler->setMaxConcurrentConnections(concurrent_connections);
-        crawler->enableForceReindex(force_reindex);
+        // One crawler per IO loop. Connections and the frontier are split evenly among them
+        const size_t shard_count = app().getThreadNum();
+        // Ends the crawl once no crawler has anything left. Links found by one crawler may be for another
+        auto barrier = std::make_shared<CrawlBarrier>();
+        std::vector<std::shared_ptr<GeminiCrawler>> crawlers;
+        for(size_t i = 0; i < shard_count; i++) {
+            auto crawler = std::make_shared<GeminiCrawler>(app().getIOLoop(i), i, shard_count, barrier);
+            // Rounded down. So all crawlers together don't go over what is asked for
+            crawler->setMaxConcurrentConnections(std::max<size_t>(concurrent_connections / shard_count, 1));
+            crawler->setMinConcurrentConnections(std::max<size_t>(min_connections / shard_count, 1));
+            crawler->setMaxDbBacklog(max_db_backlog);
+            crawler->enableForceReindex(force_reindex);
+            crawler->setFrontierSize(std::max<size_t>(frontier_size / shard_count, 1));
+            crawler->setHostDelay(host_delay);
+            crawlers.push_back(std::move(crawler));
+        }
         if(!seed_link_file.empty()) {
             std::ifstream in(seed_link_file);
             if(in.is_open() == false) {
@@ -46,11 +72,27 @@ int main(int argc, char** argv)
                 if(line.empty())
                     continue;
                 LOG_INFO << "Seed added: " << line << "\n";
-                crawler->addUrl(line);
+                co_await GeminiCrawler::addUrl(line);
             }
         }
 
-        co_await crawler->crawlAll();
+        // Record the crawl so the search server knows when the index changed
+        auto db = app().getDbClient();
+        int64_t crawl_run = -1;
+        try {
+            auto result = co_await db->execSqlCoro("INSERT INTO crawl_runs (started_at) VALUES (CURRENT_TIMESTAMP) RETURNING id");
+            crawl_run = result[0]["id"].as<int64_t>();
+        }
+        catch(std::exception& e) {
+            LOG_WARN << "Cannot record crawl run (run `tlgs_ctl populate_schema` to create the crawl_runs table): " << e.what();
+        }
+
+        for(auto& crawler : crawlers)
+            crawler->start();
+        for(auto& crawler : crawlers)
+            co_await crawler->awaitEnd();
+        if(crawl_run != -1)
+            co_await db->execSqlCoro("UPDATE crawl_runs SET finished_at = CURRENT_TIMESTAMP WHERE id = $1", crawl_run);
         app().quit();
     }));
 
@@ -0,0 +1,178 @@
+#include "admission_controller.hpp"
+
+#include <algorithm>
+
+using Clock = tlgs::TokenBucket::Clock;
+
+/**
+ * @brief Suspends the request until wakeWaiters() admits it or its deadline passes
+ */
+struct AdmissionController::WaitAwaiter
+{
+    AdmissionController* controller;
+    std::shared_ptr<Waiter> waiter;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard lock(controller->mutex_);
+        // Admitted between queuing and suspending
+        if(waiter->done)
+            return false;
+        waiter->handle = handle;
+        waiter->timer = waiter->loop->runAfter(controller->config_.max_wait, [controller = controller, waiter = waiter]() {
+            {
+                std::lock_guard lock(controller->mutex_);
+                if(waiter->done)
+                    return;
+                waiter->done = true;
+                auto& queue = controller->queue_;
+                queue.erase(std::find(queue.begin(), queue.end(), waiter));
+                // The head of the queue might have been blocking smaller requests behind it
+                controller->wakeWaiters();
+            }
+            waiter->handle.resume();
+        });
+        return true;
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+};
+
+void AdmissionController::setConfig(const Config& config)
+{
+    std::lock_guard lock(mutex_);
+    config_ = config;
+    cached_buckets_.clear();
+    cold_buckets_.clear();
+}
+
+drogon::Task<AdmissionController::Admission> AdmissionController::admit(Lane lane, const std::string& client, double cost)
+{
+    auto now = Clock::now();
+    Admission result;
+    std::unique_lock lock(mutex_);
+    if(lane == Lane::Cached) {
+        auto& bucket = cached_buckets_.try_emplace(client, config_.cached_rate, config_.cached_burst, now).first->second;
+        if(!bucket.tryConsume(1, now)) {
+            result.retry_after = bucket.timeUntil(1, now);
+            co_return result;
+        }
+        result.admitted = true;
+        co_return result;
+    }
+
+    // A single query more expensive than the entire budget still gets to run. Alone
+    cost = std::clamp(cost, 1.0, std::max(std::min(config_.cold_capacity, config_.cold_burst), 1.0));
+    auto& bucket = cold_buckets_.try_emplace(client, config_.cold_rate, config_.cold_burst, now).first->second;
+    if(!bucket.tryConsume(cost, now)) {
+        result.retry_after = bucket.timeUntil(cost, now);
+        co_return result;
+    }
+
+    if(queue_.empty() && cold_in_use_ + cost <= config_.cold_capacity) {
+        cold_in_use_ += cost;
+        result.admitted = true;
+        result.ticket = Ticket(this, cost);
+        co_return result;
+    }
+
+    auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+    if(queue_.size() >= config_.max_queue_size || loop == nullptr) {
+        bucket.refund(cost, now);
+        result.retry_after = config_.max_wait;
+        co_return result;
+    }
+    auto waiter = std::make_shared<Waiter>();
+    waiter->cost = cost;
+    waiter->loop = loop;
+    queue_.push_back(waiter);
+    lock.unlock();
+
+    co_await WaitAwaiter{this, waiter};
+
+    if(!waiter->admitted) {
+        // Timed out. The request never ran, don't charge the client for it
+        lock.lock();
+        auto it = cold_buckets_.find(client);
+        if(it != cold_buckets_.end())
+            it->second.refund(cost);
+        result.retry_after = config_.max_wait;
+        co_return result;
+    }
+    result.admitted = true;
+    result.ticket = Ticket(this, cost);
+    co_return result;
+}
+
+std::optional<AdmissionController::Ticket> AdmissionController::admitIdle(double cost, double max_load)
+{
+    std::lock_guard lock(mutex_);
+    if(!queue_.empty() || cold_in_use_ + cost > config_.cold_capacity * max_load)
+        return std::nullopt;
+    cold_in_use_ += cost;
+    return Ticket(this, cost);
+}
+
+void AdmissionController::release(double cost)
+{
+    std::lock_guard lock(mutex_);
+    cold_in_use_ = std::max(cold_in_use_ - cost, 0.0);
+    wakeWaiters();
+}
+
+void AdmissionController::wakeWaiters()
+{
+    while(!queue_.empty()) {
+        auto waiter = queue_.front();
+        if(cold_in_use_ + waiter->cost > config_.cold_capacity && cold_in_use_ > 0)
+            break;
+        queue_.pop_front();
+        cold_in_use_ += waiter->cost;
+        waiter->done = true;
+        waiter->admitted = true;
+        // Not suspended yet otherwise. It will notice by itself
+        if(waiter->handle) {
+            waiter->loop->invalidateTimer(waiter->timer);
+            waiter->loop->queueInLoop([handle = waiter->handle]() {
+                handle.resume();
+            });
+        }
+    }
+}
+
+void AdmissionController::prune()
+{
+    auto now = Clock::now();
+    std::lock_guard lock(mutex_);
+    // A full bucket is the same as a new one
+    for(auto* buckets : {&cached_buckets_, &cold_buckets_}) {
+        for(auto it = buckets->begin(); it != buckets->end();) {
+            if(it->second.full(now))
+                it = buckets->erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+double AdmissionController::coldLoad() const
+{
+    std::lock_guard lock(mutex_);
+    double queued = 0;
+    for(const auto& waiter : queue_)
+        queued += waiter->cost;
+    return (cold_in_use_ + queued) / std::max(config_.cold_capacity, 1.0);
+}
+
+size_t AdmissionController::queueSize() const
+{
+    std::lock_guard lock(mutex_);
+    return queue_.size();
+}
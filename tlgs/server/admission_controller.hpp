@@ -0,0 +1,154 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <coroutine>
+#include <unordered_map>
+#include <drogon/utils/coroutine.h>
+#include <trantor/net/EventLoop.h>
+#include <tlgsutils/token_bucket.hpp>
+
+/**
+ * @brief Decides whether a search request gets to run. Requests are split into two lanes:
+ *  - Cached: answered from the result cache. Only limited by a per client token bucket
+ *  - Cold: needs the DB and ranking. Limited by a per client token bucket charged by the estimated cost
+ *    of the query, and by a global budget of cost running at once. Requests over the budget wait in a
+ *    bounded FIFO queue until there is room or their deadline passes.
+ * The lanes don't share anything. So cached traffic is never rejected because of expensive cold queries.
+ */
+class AdmissionController
+{
+public:
+    enum class Lane
+    {
+        Cached,
+        Cold
+    };
+
+    struct Config
+    {
+        // Per client token buckets. Cached requests costs 1 token
+        double cached_rate = 10;
+        double cached_burst = 30;
+        double cold_rate = 1;
+        double cold_burst = 20;
+        // Total cost of cold searches allowed to run at once
+        double cold_capacity = 64;
+        size_t max_queue_size = 128;
+        // Seconds a cold search may wait in queue
+        double max_wait = 5;
+    };
+
+    /**
+     * @brief Holds the admitted cost. Gives it back to the controller when destroyed
+     */
+    class Ticket
+    {
+    public:
+        Ticket() = default;
+        Ticket(AdmissionController* controller, double cost)
+            : controller_(controller)
+            , cost_(cost)
+        {
+        }
+        Ticket(Ticket&& other)
+            : controller_(other.controller_)
+            , cost_(other.cost_)
+        {
+            other.controller_ = nullptr;
+        }
+        Ticket& operator=(Ticket&& other)
+        {
+            if(this != &other) {
+                release();
+                controller_ = other.controller_;
+                cost_ = other.cost_;
+                other.controller_ = nullptr;
+            }
+            return *this;
+        }
+        ~Ticket()
+        {
+            release();
+        }
+        void release()
+        {
+            if(controller_ != nullptr)
+                controller_->release(cost_);
+            controller_ = nullptr;
+        }
+
+    protected:
+        AdmissionController* controller_ = nullptr;
+        double cost_ = 0;
+    };
+
+    struct Admission
+    {
+        bool admitted = false;
+        // Seconds the client should wait before trying again. Only meaningful when rejected
+        double retry_after = 0;
+        Ticket ticket;
+    };
+
+    AdmissionController() = default;
+    AdmissionController(const AdmissionController&) = delete;
+    AdmissionController& operator=(const AdmissionController&) = delete;
+
+    void setConfig(const Config& config);
+
+    /**
+     * @brief Ask to run a request. Cold requests may wait (without blocking the thread) for other cold
+     * requests to finish
+     *
+     * @param lane which lane the request goes into
+     * @param client identifies the client. Usually the IP address
+     * @param cost estimated cost of the request. Ignored for cached requests
+     */
+    drogon::Task<Admission> admit(Lane lane, const std::string& client, double cost);
+
+    /**
+     * @brief Admit background work only while the cold lane is idle. Never queues. The cost counts towards
+     * the cold lane while the ticket is held, so user requests are never delayed by more than that
+     *
+     * @param max_load only admitted if the cold lane stays below this fraction of its capacity
+     */
+    std::optional<Ticket> admitIdle(double cost, double max_load);
+
+    /**
+     * @brief Drop buckets of clients that haven't been seen for a while. So the buckets don't grow forever
+     */
+    void prune();
+
+    size_t queueSize() const;
+    /**
+     * @brief How busy the cold lane is. Cost running over the capacity. Above 1 if requests are queued
+     */
+    double coldLoad() const;
+
+protected:
+    struct Waiter
+    {
+        double cost;
+        std::coroutine_handle<> handle;
+        trantor::EventLoop* loop;
+        trantor::TimerId timer = 0;
+        bool done = false;
+        bool admitted = false;
+    };
+
+    struct WaitAwaiter;
+
+    void release(double cost);
+    void wakeWaiters();
+
+    Config config_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, tlgs::TokenBucket> cached_buckets_;
+    std::unordered_map<std::string, tlgs::TokenBucket> cold_buckets_;
+    double cold_in_use_ = 0;
+    std::deque<std::shared_ptr<Waiter>> queue_;
+};
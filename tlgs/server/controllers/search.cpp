@@ -2,9 +2,11 @@
 #include <drogon/HttpController.h>
 #include <drogon/utils/coroutine.h>
 #include <drogon/HttpAppFramework.h>
+#include <trantor/net/EventLoopThread.h>
 #include <tlgsutils/utils.hpp>
-#include <tlgsutils/counter.hpp>
 #include <tlgsutils/url_parser.hpp>
+#include <tlgsutils/lru_cache.hpp>
+#include <tlgsutils/snippet.hpp>
 #include <nlohmann/json.hpp>
 #include <ranges>
 #include <atomic>
@@ -14,61 +16,21 @@
 #include <random>
 #include <filesystem>
 #include <fmt/core.h>
+#include <thread>
+#include <mutex>
+#include <unordered_set>
+#include <coroutine>
 
 #include "search_result.hpp"
+#include "persistent_cache.hpp"
+#include "query_log.hpp"
+#include "admission_controller.hpp"
+#include "metrics.hpp"
+#include "slow_query_log.hpp"
+#include "forward_store.hpp"
 
 using namespace drogon;
 
-struct RankedResult
-{
-    std::string url;
-    std::string content_type;
-    size_t size;
-    uint64_t content_hash;
-    float score;
-};
-
-struct SearchController : public HttpController<SearchController>
-{
-public:
-    enum class RankingAlgorithm
-    {
-        HITS,
-        SALSA
-    };
-
-    SearchController();
-    Task<HttpResponsePtr> tlgs_search(HttpRequestPtr req);
-    Task<HttpResponsePtr> add_seed(HttpRequestPtr req);
-    Task<HttpResponsePtr> jump_search(HttpRequestPtr req, std::string search_term);
-    Task<HttpResponsePtr> backlinks(HttpRequestPtr req);
-
-    METHOD_LIST_BEGIN
-    ADD_METHOD_TO(SearchController::tlgs_search, "/search", {Get});
-    ADD_METHOD_TO(SearchController::tlgs_search, "/search/{page}", {Get});
-    ADD_METHOD_TO(SearchController::jump_search, "/search_jump/{search_term}", {Get});
-    ADD_METHOD_TO(SearchController::tlgs_search, "/v/search", {Get});
-    ADD_METHOD_TO(SearchController::tlgs_search, "/v/search/{page}", {Get});
-    ADD_METHOD_TO(SearchController::jump_search, "/v/search_jump/{search_term}", {Get});
-    ADD_METHOD_TO(SearchController::backlinks, "/backlinks", {Get});
-    METHOD_LIST_END
-
-
-    Task<std::vector<RankedResult>> pageSearch(const std::string& query_str);
-    std::atomic<size_t> search_in_flight{0};
-    RankingAlgorithm ranking_algorithm = RankingAlgorithm::SALSA;
-};
-
-auto sanitizeGemini(std::string preview) -> std::string {
-    utils::replaceAll(preview, "\n", " ");
-    utils::replaceAll(preview, "\t", " ");
-    utils::replaceAll(preview, "```", " ");
-    auto idx = preview.find_first_not_of("`*=>#");
-    if(idx == std::string::npos)
-        return preview;
-    return preview.substr(idx);
-}
-
 enum class TokenType
 {
     Text = 0,
@@ -101,43 +63,418 @@ struct SearchFilter
     }
 };
 
-namespace std
+/**
+ * @brief A parsed search query
+ */
+struct SearchQuery
 {
-template<>
-struct hash<FilterConstrant>
+    // The text to search for. Terms are case folded, deduplicated and sorted
+    std::string text;
+    SearchFilter filter;
+    // Canonical form of the entire query (text and filters). Equivalent queries have the same canonical form
+    std::string canonical;
+    // Canonical form of the text alone. The same as `canonical` if there are no filters
+    std::string canonical_text;
+};
+
+/**
+ * @brief An entry in the result cache. The entry is served as-is until `fresh_until`. After that it is
+ * still served (stale) while a single background task refreshes it. The cache itself drops the entry
+ * at `expire_at`
+ */
+struct CachedResult
 {
-    size_t operator()(const FilterConstrant& fc) const
+    std::shared_ptr<const RankedResults> results;
+    std::chrono::steady_clock::time_point fresh_until;
+    std::chrono::steady_clock::time_point expire_at;
+    std::atomic<bool> refreshing{false};
+    // Search text of a raw (unfiltered) result. Empty for filtered results
+    std::string query;
+    // false if the search ran out of time and the results are partial
+    bool complete = true;
+    // Index into search_tiers the result is computed with
+    size_t tier = 0;
+    // Index generation the result is computed against. -1 if unknown
+    int64_t generation = -1;
+
+    /**
+     * @brief Within the soft TTL and computed against the current index generation. Results of an older
+     * index are stale right away after a crawl
+     */
+    bool fresh(int64_t index_generation) const
     {
-        return std::hash<std::string>{}(fc.value) + fc.negate;
+        if(index_generation >= 0 && generation != index_generation)
+            return false;
+        return std::chrono::steady_clock::now() < fresh_until;
     }
 };
 
-template<>
-struct hash<SizeConstrant>
+/**
+ * @brief A page matching a single search term. `rank` is the text score of the page for that term
+ */
+struct CandidatePage
 {
-    size_t operator()(const SizeConstrant& sc) const
+    std::string url;
+    std::string content_type;
+    size_t size;
+    uint64_t content_hash;
+    double rank;
+    std::vector<std::string> cross_site_links;
+};
+
+/**
+ * @brief Cross site link pointing to a page that matches the term
+ */
+struct CandidateLink
+{
+    std::string source_url;
+    std::string dest_url;
+};
+
+/**
+ * @brief How much work pageSearch() may do. The server drops to lower tiers when busy. Trading quality
+ * for throughput
+ */
+struct SearchTier
+{
+    std::string_view name;
+    // Max number of pages matching a term to consider. Also the LIMIT of the SQL query
+    size_t root_limit;
+    // Max number of pages linking into the root set to add
+    size_t base_limit;
+    size_t max_iter;
+    // Also merge duplicates mirrored under different paths/user directories
+    bool full_dedup;
+};
+
+// Number of results on a page
+static constexpr size_t item_per_page = 10;
+
+static constexpr SearchTier search_tiers[] = {
+    {"full", 50000, std::numeric_limits<size_t>::max(), 300, true},
+    {"reduced", 20000, 20000, 100, true},
+    {"minimal", 5000, 5000, 30, false},
+};
+
+/**
+ * @brief Everything pageSearch() needs from the DB for a single search term. Multi-term queries are
+ * answered by intersecting these sets.
+ */
+struct TermCandidates
+{
+    std::vector<CandidatePage> pages;
+    std::vector<CandidateLink> links;
+    // Index into search_tiers of the limits the sets are fetched with
+    size_t tier;
+    // `links` hit the base limit. They are an arbitrary part of the links then
+    bool links_truncated = false;
+
+    size_t estimatedSize() const;
+};
+
+/**
+ * @brief A term being looked up in the DB. Searches needing the same term meanwhile wait for it instead of
+ * running the same SQL again
+ */
+struct TermLookup
+{
+    std::mutex mutex;
+    bool done = false;
+    std::shared_ptr<const TermCandidates> candidates;
+    std::exception_ptr error;
+    // The lookup gives up once it passes. Waiters with a later deadline try again on their own
+    std::chrono::steady_clock::time_point deadline;
+    // Time the lookup spent. Added to the trace of everyone waiting for it
+    SearchTrace trace;
+    // Resumed on their own loops
+    std::vector<std::pair<std::coroutine_handle<>, trantor::EventLoop*>> waiters;
+};
+
+struct TermLookupAwaiter
+{
+    std::shared_ptr<TermLookup> lookup;
+    trantor::EventLoop* loop;
+
+    bool await_ready()
+    {
+        std::lock_guard lock(lookup->mutex);
+        return lookup->done;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard lock(lookup->mutex);
+        if(lookup->done)
+            return false;
+        lookup->waiters.emplace_back(handle, loop);
+        return true;
+    }
+
+    std::shared_ptr<const TermCandidates> await_resume()
     {
-        return std::hash<size_t>{}(sc.size) + sc.greater;
+        if(lookup->error)
+            std::rethrow_exception(lookup->error);
+        return lookup->candidates;
     }
 };
 
-template<>
-struct hash<SearchFilter>
+/**
+ * @brief How the result of a search request was produced. For logging and the verbose view
+ */
+struct ResultInfo
 {
-    size_t operator()(const SearchFilter& sf) const
+    // Where the result comes from
+    std::string cache_status;
+    // false if the search ran out of time and the results are partial
+    bool complete = true;
+    // Index into search_tiers
+    size_t tier = 0;
+    SearchTrace trace;
+};
+
+/**
+ * @brief What pageSearch() found. `complete` is false if the search hit its deadline and only the work
+ * done so far is in `results`
+ */
+struct SearchOutcome
+{
+    RankedResults results;
+    bool complete = true;
+    // The search ran out of time before it could tell which pages match. `results` is empty and is not an
+    // answer to the query
+    bool gave_up = false;
+    size_t tier = 0;
+    // Index generation when the search started. -1 if unknown
+    int64_t generation = -1;
+    SearchTrace trace;
+};
+
+/**
+ * @brief A rendered page of search results. Only valid as long as the results it is rendered from are
+ * still the ones in the result cache
+ */
+struct RenderedPage
+{
+    std::string body;
+    std::weak_ptr<const RankedResults> results;
+};
+
+struct SearchController : public HttpController<SearchController>
+{
+public:
+    enum class RankingAlgorithm
     {
-        size_t hash = 0;
-        for(const auto& fc : sf.content_type)
-            hash ^= std::hash<FilterConstrant>{}(fc);
-        for(const auto& dc : sf.domain)
-            hash ^= std::hash<FilterConstrant>{}(dc);
-        for(const auto& sc : sf.size)
-            hash ^= std::hash<SizeConstrant>{}(sc);
-        for(const auto& tc : sf.title)
-            hash ^= std::hash<FilterConstrant>{}(tc);
-        return hash;
-    }
+        HITS,
+        SALSA
+    };
+
+    SearchController();
+    Task<HttpResponsePtr> tlgs_search(HttpRequestPtr req);
+    Task<HttpResponsePtr> add_seed(HttpRequestPtr req);
+    Task<HttpResponsePtr> jump_search(HttpRequestPtr req, std::string search_term);
+    Task<HttpResponsePtr> backlinks(HttpRequestPtr req);
+
+    METHOD_LIST_BEGIN
+    ADD_METHOD_TO(SearchController::tlgs_search, "/search", {Get});
+    ADD_METHOD_TO(SearchController::tlgs_search, "/search/{page}", {Get});
+    ADD_METHOD_TO(SearchController::jump_search, "/search_jump/{search_term}", {Get});
+    ADD_METHOD_TO(SearchController::tlgs_search, "/v/search", {Get});
+    ADD_METHOD_TO(SearchController::tlgs_search, "/v/search/{page}", {Get});
+    ADD_METHOD_TO(SearchController::jump_search, "/v/search_jump/{search_term}", {Get});
+    ADD_METHOD_TO(SearchController::backlinks, "/backlinks", {Get});
+    METHOD_LIST_END
+
+
+    /**
+     * @brief Search and rank pages matching the query
+     *
+     * @param deadline the search stops and returns partial results once it passes
+     */
+    Task<SearchOutcome> pageSearch(const std::string& query_str,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    /**
+     * @brief Get the candidate sets of a term. From the term cache if possible
+     *
+     * @param deadline the SQL statements are cancelled by the DB once it passes
+     * @param tier fetch at least as many candidates as this tier needs
+     * @param trace time spent on the DB is added to it if not null
+     */
+    Task<std::shared_ptr<const TermCandidates>> termCandidates(const std::string& term,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), size_t tier = 0,
+        SearchTrace* trace = nullptr);
+    /**
+     * @brief Start getting the candidate sets of a term without waiting for them. Joins the lookup of the
+     * same term if one is running already
+     */
+    std::shared_ptr<TermLookup> lookupTerm(const std::string& term, std::chrono::steady_clock::time_point deadline, size_t tier);
+    /**
+     * @brief Wait for a lookup started by lookupTerm(). Parameters are the same as termCandidates()
+     */
+    Task<std::shared_ptr<const TermCandidates>> awaitTermLookup(const std::string& term, std::shared_ptr<TermLookup> lookup,
+        std::chrono::steady_clock::time_point deadline, size_t tier, SearchTrace* trace);
+    /**
+     * @brief Run the SQL statements of a term and cache the candidate sets. Parameters are the same as
+     * termCandidates()
+     */
+    Task<std::shared_ptr<const TermCandidates>> fetchTermCandidates(const std::string& term,
+        std::chrono::steady_clock::time_point deadline, size_t tier, SearchTrace* trace);
+    /**
+     * @brief Let Postgres stem the search text and drop stop words
+     *
+     * @param trace time spent on the DB is added to it if not null
+     * @return text form of the tsquery. From the tsquery cache if possible
+     */
+    Task<std::string> tsQuery(const std::string& text, SearchTrace* trace = nullptr);
+    /**
+     * @brief Pick the search tier from how busy the cold search lane is
+     */
+    size_t currentSearchTier() const;
+    /**
+     * @brief Get the (filtered) ranked results of a query. From the result cache if possible.
+     * 
+     * @param info set to how the result is produced
+     * @param deadline passed to pageSearch() if the DB has to be searched
+     */
+    Task<std::shared_ptr<const RankedResults>> rankedResults(const SearchQuery& query, ResultInfo& info,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    /**
+     * @brief Re-run the search and replace the cached result in the background. Stale results are kept
+     * and served if the search fails
+     */
+    void refreshInBackground(const SearchQuery& query, std::shared_ptr<CachedResult> stale);
+    std::shared_ptr<CachedResult> cacheResult(const std::string& key, std::shared_ptr<const RankedResults> results,
+        std::chrono::steady_clock::time_point fresh_until, std::chrono::steady_clock::time_point expire_at, std::string query = "",
+        bool complete = true, size_t tier = 0, int64_t generation = -1);
+    /**
+     * @brief Cache a freshly computed raw result and its filtered variant. Incomplete results are cached
+     * as stale. So they are served but refreshed on the next request. Searches that gave up are not cached
+     *
+     * @return the cached filtered result
+     */
+    std::shared_ptr<CachedResult> cacheSearchOutcome(const SearchQuery& query, SearchOutcome outcome, SearchTrace* trace = nullptr);
+    /**
+     * @brief Fetch the current index generation from the DB. The persistent result cache is only valid for
+     * the generation it was computed against
+     */
+    Task<void> updateIndexGeneration();
+    /**
+     * @brief Write the most recently used raw results into the persistent result cache. Asynchronously
+     */
+    void snapshotResultCache();
+    /**
+     * @brief Run the most frequent queries in the query log so they are cached before users ask for them
+     *
+     * @param recompute search again even if the query is cached. i.e. after the index changed
+     */
+    Task<void> warmUpResultCache(bool recompute);
+    /**
+     * @brief Look up the results of a query precomputed against the current index generation
+     *
+     * @param query_text the search text (SearchQuery::text)
+     * @return nullptr if not precomputed
+     */
+    Task<std::shared_ptr<RankedResults>> precomputedResults(const std::string& query_text);
+    /**
+     * @brief Store the results of a head query. So no server has to compute them online until the next crawl
+     */
+    Task<void> storePrecomputedResults(const std::string& query_text, const RankedResults& results, int64_t generation);
+    /**
+     * @brief Fetch which queries are precomputed against the generation. So looking up a query that isn't
+     * costs no DB round trip
+     */
+    Task<void> loadPrecomputedQueries(int64_t generation);
+    /**
+     * @brief Can the query be answered without searching the DB
+     */
+    bool isCached(const SearchQuery& query);
+    /**
+     * @brief Guess how expensive searching the DB for a query is. From the size of the root set
+     * last time the query (or any query) was searched
+     */
+    double estimatedCost(const SearchQuery& query);
+    /**
+     * @brief Capture the plans of the SQL statements of the term that took the longest in the background.
+     * Rate limited by the slow query log
+     */
+    void explainSlowQuery(const SlowQuery& query, size_t tier);
+    /**
+     * @brief Get the rendered text/gemini of a page of results. From the page cache if it's rendered from the
+     * same results
+     *
+     * @param input the search query as the user typed it
+     * @param page_idx 0 based page number
+     * @param info how the results are produced. The time spent here is added to its trace
+     */
+    Task<std::shared_ptr<const RenderedPage>> renderedPage(const SearchQuery& query, const std::string& input, size_t page_idx,
+        bool verbose, std::shared_ptr<const RankedResults> results, ResultInfo& info);
+    /**
+     * @brief Render the page after page_idx into the page cache in the background. Users almost always
+     * look at the next page. Only done while the admission controller has idle capacity. Verbose pages are
+     * not prefetched
+     */
+    void prefetchNextPage(const SearchQuery& query, const std::string& input, size_t page_idx, bool verbose,
+        std::shared_ptr<const RankedResults> results, const ResultInfo& info);
+    AdmissionController admission_controller;
+    // Root set sizes of recent queries. Used to estimate the cost of searching again
+    tlgs::LruCache<std::string, size_t> root_set_sizes{4*1024*1024};
+    std::atomic<double> average_root_set_size{1000};
+    RankingAlgorithm ranking_algorithm = RankingAlgorithm::SALSA;
+    tlgs::LruCache<std::string, std::shared_ptr<CachedResult>> result_cache{512*1024*1024};
+    // Results are served without revalidation for the soft TTL. And served stale while being refreshed
+    // until the hard TTL
+    double result_cache_soft_ttl = 600;
+    double result_cache_hard_ttl = 6*3600;
+    // Seconds a search request may take before returning partial results. 0 means no limit
+    double search_deadline = 10;
+    PersistentResultCache persistent_cache;
+    size_t persistent_cache_size = 256*1024*1024;
+    std::atomic<bool> snapshot_running{false};
+    // ID of the last finished crawl. -1 if unknown
+    std::atomic<int64_t> index_generation{-1};
+    // The last attempt to fetch the index generation failed. So the failure is only logged once
+    std::atomic<bool> index_generation_failed{false};
+    std::unique_ptr<QueryLog> query_log;
+    size_t warm_up_queries = 100;
+    // Store the results of the warm up queries in the DB. Shared by all servers and across restarts
+    bool precompute_head_queries = true;
+    // Queries in precomputed_results for precomputed_generation
+    std::mutex precomputed_mutex;
+    std::unordered_set<std::string> precomputed_queries;
+    int64_t precomputed_generation = -1;
+    // The last attempt to list the precomputed queries failed. i.e. the table doesn't exist
+    std::atomic<bool> precomputed_failed{false};
+    std::atomic<bool> warm_up_running{false};
+    // For blocking work that would stall the event loops. i.e. reading the query log
+    trantor::EventLoopThread background_thread{"SearchBackground"};
+    std::unique_ptr<SlowQueryLog> slow_query_log;
+    // Seconds a search request takes before it is written to the slow query log
+    double slow_query_threshold = 2;
+    // Per term candidate sets. Keyed by the Postgres tsquery of the term. So different spellings of the
+    // same lexeme share the same entry
+    tlgs::LruCache<std::string, std::shared_ptr<const TermCandidates>> term_cache{256*1024*1024};
+    // Terms being looked up in the DB. Keyed by the tsquery of the term and the tier
+    std::mutex term_lookups_mutex;
+    std::unordered_map<std::string, std::shared_ptr<TermLookup>> term_lookups;
+    // Search text to the text form of its tsquery. Stemming only depends on the text search configuration.
+    // So this saves a round trip to the DB per search
+    tlgs::LruCache<std::string, std::string> tsquery_cache{8*1024*1024};
+    // Titles, metadata and leading text of pages shown in search results. For generating previews
+    ForwardStore forward_store;
+    // Rendered result pages. Keyed by the canonical query, the input as typed (it's in the page) and page
+    // number. Verbose pages show how the request was served and are never cached
+    tlgs::LruCache<std::string, std::shared_ptr<const RenderedPage>> page_cache{64*1024*1024};
+    // Prefetch the next page only while the cold lane is below this fraction of its capacity. 0 disables
+    double prefetch_max_load = 0.25;
 };
+
+auto sanitizeGemini(std::string preview) -> std::string {
+    utils::replaceAll(preview, "\n", " ");
+    utils::replaceAll(preview, "\t", " ");
+    utils::replaceAll(preview, "```", " ");
+    auto idx = preview.find_first_not_of("`*=>#");
+    if(idx == std::string::npos)
+        return preview;
+    return preview.substr(idx);
 }
 
 std::optional<size_t> parseSizeUnits(std::string unit)
@@ -164,11 +501,24 @@ std::optional<size_t> parseSizeUnits(std::string unit)
         return {};
 }
 
-std::pair<std::string, SearchFilter> parseSearchQuery(const std::string& query)
+/**
+ * @brief Sort and deduplicate filter constraints so the order they are written in does not matter
+ */
+template <typename T, typename Proj>
+static void canonicalizeConstraints(std::vector<T>& constraints, Proj&& proj)
+{
+    std::sort(constraints.begin(), constraints.end(), [&](const T& a, const T& b) {
+        return proj(a) < proj(b);
+    });
+    constraints.erase(std::unique(constraints.begin(), constraints.end(), [&](const T& a, const T& b) {
+        return proj(a) == proj(b);
+    }), constraints.end());
+}
+
+SearchQuery parseSearchQuery(const std::string& query)
 {
-    std::pair<std::string, std::string> result;
     auto words = utils::splitString(query, " ");
-    std::string search_query = "";
+    std::vector<std::string> search_terms;
     SearchFilter filter;
     std::vector<TokenType> token_type;
 
@@ -194,17 +544,17 @@ std::pair<std::string, SearchFilter> parseSearchQuery(const std::string& query)
         auto type = token_type[i];
         const auto& token = words[i];
         if(type == TokenType::Text)
-            search_query += token + " ";
+            search_terms.push_back(tlgs::utf8ToLower(token));
         else if(type == TokenType::Filter) {
             auto idx = token.find(':');
             auto key = token.substr(0, idx);
             auto value = token.substr(idx+1);
             if(key == "content_type")
-                filter.content_type.push_back({std::string(value), negate});
+                filter.content_type.push_back({tlgs::utf8ToLower(value), negate});
             else if(key == "domain")
-                filter.domain.push_back({std::string(value), negate});
+                filter.domain.push_back({tlgs::utf8ToLower(value), negate});
             else if(key == "intitle")
-                filter.title.push_back({std::string(value), negate});
+                filter.title.push_back({tlgs::utf8ToLower(value), negate});
             else if(key == "size") {
                 static const std::regex re(R"(([><])([\.0-9]+)([GBKMibyte]+)?)", std::regex_constants::icase);
                 std::smatch match;
@@ -230,17 +580,47 @@ std::pair<std::string, SearchFilter> parseSearchQuery(const std::string& query)
                 negate = true;
             }
             else
-                search_query += token + " ";
+                search_terms.push_back(tlgs::utf8ToLower(token));
         }
     }
 
-    if(!search_query.empty())
-        search_query.resize(search_query.size()-1);
-    
     // add title filters to search query
     for(const auto& tc : filter.title)
-        search_query += tc.value + " ";
-    return {search_query, filter};
+        search_terms.push_back(tc.value);
+
+    // Full text search does not care about the order of terms. Neither does filtering. Sort and remove
+    // duplicates so equivalent queries are recognized as the same one
+    std::sort(search_terms.begin(), search_terms.end());
+    search_terms.erase(std::unique(search_terms.begin(), search_terms.end()), search_terms.end());
+    auto filter_proj = [](const FilterConstrant& fc) { return std::tie(fc.value, fc.negate); };
+    canonicalizeConstraints(filter.content_type, filter_proj);
+    canonicalizeConstraints(filter.domain, filter_proj);
+    canonicalizeConstraints(filter.title, filter_proj);
+    canonicalizeConstraints(filter.size, [](const SizeConstrant& sc) { return std::tie(sc.size, sc.greater); });
+
+    SearchQuery result;
+    for(const auto& term : search_terms)
+        result.text += term + " ";
+    if(!result.text.empty())
+        result.text.resize(result.text.size()-1);
+
+    // Length prefix every field, the text included. So values containing separators can't be confused with
+    // other fields
+    result.canonical_text = fmt::format("{}:{}", result.text.size(), result.text);
+    result.canonical = result.canonical_text;
+    auto append_field = [&](std::string_view name, std::string_view value) {
+        result.canonical += fmt::format("|{}:{}:{}", name, value.size(), value);
+    };
+    for(const auto& fc : filter.content_type)
+        append_field(fc.negate ? "-content_type" : "content_type", fc.value);
+    for(const auto& dc : filter.domain)
+        append_field(dc.negate ? "-domain" : "domain", dc.value);
+    for(const auto& tc : filter.title)
+        append_field(tc.negate ? "-intitle" : "intitle", tc.value);
+    for(const auto& sc : filter.size)
+        append_field(sc.greater ? "size>" : "size<", std::to_string(sc.size));
+    result.filter = std::move(filter);
+    return result;
 }
 
 /**
@@ -248,16 +628,19 @@ std::pair<std::string, SearchFilter> parseSearchQuery(const std::string& query)
  * 
  * @param in_neighbous vector of vector where in_neighbous[i] is all inbound links of node i 
  * @param out_neighbous ector of vector where out_neighbous[i] is all outbound links of node i
+ * @param max_iter max number of iterations
+ * @param deadline stop iterating once it passes
+ * @param timed_out set to true if the deadline stopped the iteration
  * @return std::vector<double> The score of each node
  */
-std::vector<double> hitsRank(const std::vector<std::vector<size_t>>& in_neighbous, const std::vector<std::vector<size_t>>& out_neighbous)
+std::vector<double> hitsRank(const std::vector<std::vector<size_t>>& in_neighbous, const std::vector<std::vector<size_t>>& out_neighbous
+    , size_t max_iter, std::chrono::steady_clock::time_point deadline, bool& timed_out)
 {
     // The HITS algorithm
     size_t node_count = in_neighbous.size();
     assert(node_count == out_neighbous.size());
     float score_delta = std::numeric_limits<float>::max_digits10;
     constexpr float epsilon = 0.005;
-    constexpr size_t max_iter = 300;
     std::vector<double> auth_score;
     std::vector<double> hub_score;
     std::vector<double> new_auth_score;
@@ -268,6 +651,10 @@ std::vector<double> hitsRank(const std::vector<std::vector<size_t>>& in_neighbou
     new_hub_score.resize(node_count);
     size_t hits_iter = 0;
     for(hits_iter=0;hits_iter<max_iter && score_delta > epsilon;hits_iter++) {
+        if(std::chrono::steady_clock::now() >= deadline) {
+            timed_out = true;
+            break;
+        }
         for(size_t i=0;i<node_count;i++) {
             new_auth_score[i] = auth_score[i];
             new_hub_score[i] = hub_score[i];
@@ -310,10 +697,14 @@ std::vector<double> hitsRank(const std::vector<std::vector<size_t>>& in_neighbou
  * 
  * @param in_neighbous vector of vector where in_neighbous[i] is all inbound links of node i 
  * @param out_neighbous ector of vector where out_neighbous[i] is all outbound links of node i
+ * @param max_iter max number of iterations
+ * @param deadline stop iterating once it passes
+ * @param timed_out set to true if the deadline stopped the iteration
  * @return std::vector<double> The score of each node
  * @note in_neighbous and out_neighbous will be modified to become a biparte graph
  */
-std::vector<double> salsaRank(std::vector<std::vector<size_t>>& in_neighbous, std::vector<std::vector<size_t>>& out_neighbous)
+std::vector<double> salsaRank(std::vector<std::vector<size_t>>& in_neighbous, std::vector<std::vector<size_t>>& out_neighbous
+    , size_t max_iter, std::chrono::steady_clock::time_point deadline, bool& timed_out)
 {
     size_t node_count = in_neighbous.size();
     assert(node_count == out_neighbous.size());
@@ -355,7 +746,6 @@ std::vector<double> salsaRank(std::vector<std::vector<size_t>>& in_neighbous, st
 
     float score_delta = std::numeric_limits<float>::max_digits10;
     constexpr float epsilon = 0.005*2;
-    constexpr size_t max_iter = 300;
     std::vector<double> score;
     std::vector<double> new_score;
     score.resize(node_count);
@@ -369,6 +759,10 @@ std::vector<double> salsaRank(std::vector<std::vector<size_t>>& in_neighbous, st
     std::vector<float> local_in_score(node_count);
     std::vector<float> local_out_score(node_count);
     for(salsa_iter=0;salsa_iter<max_iter && score_delta > epsilon;salsa_iter++) {
+        if(std::chrono::steady_clock::now() >= deadline) {
+            timed_out = true;
+            break;
+        }
         for(size_t i=0;i<node_count;i++) {
             local_in_score[i] = -1;
             local_out_score[i] = -1;
@@ -411,12 +805,203 @@ std::vector<double> salsaRank(std::vector<std::vector<size_t>>& in_neighbous, st
     return score;
 }
 
+size_t TermCandidates::estimatedSize() const
+{
+    size_t size = sizeof(TermCandidates) + pages.capacity()*sizeof(CandidatePage) + links.capacity()*sizeof(CandidateLink);
+    for(const auto& page : pages) {
+        size += page.url.capacity() + page.content_type.capacity() + page.cross_site_links.capacity()*sizeof(std::string);
+        for(const auto& link : page.cross_site_links)
+            size += link.capacity();
+    }
+    for(const auto& link : links)
+        size += link.source_url.capacity() + link.dest_url.capacity();
+    return size;
+}
+
+/**
+ * @brief Split the text form of a tsquery generated by plainto_tsquery() into individual terms
+ * 
+ * @param tsquery something like "'gemini' & 'protocol'"
+ * @return std::vector<std::string> terms that can be cast back into tsquery. Sorted and deduplicated
+ */
+static std::vector<std::string> splitTsQuery(const std::string& tsquery)
+{
+    auto terms = utils::splitString(tsquery, " & ");
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    return terms;
+}
+
+/**
+ * @brief Words to highlight in previews. The lexemes Postgres matched pages on, so other forms of a word
+ * are highlighted too. Plus the words as typed whose lexeme differs at the end (i.e. happy -> happi) and
+ * so isn't a prefix of them
+ *
+ * @param tsquery_terms terms from splitTsQuery(). All words as typed are used if empty
+ */
+static std::vector<std::string> highlightTerms(const std::string& query_text, const std::vector<std::string>& tsquery_terms)
+{
+    std::vector<std::string> lexemes;
+    for(const auto& term : tsquery_terms) {
+        if(term.size() <= 2 || term.front() != '\'' || term.back() != '\'')
+            continue;
+        auto lexeme = term.substr(1, term.size() - 2);
+        utils::replaceAll(lexeme, "''", "'");
+        lexemes.push_back(std::move(lexeme));
+    }
+    auto terms = lexemes;
+    for(auto& word : utils::splitString(query_text, " ")) {
+        bool covered = false;
+        bool stemmed = lexemes.empty();
+        for(const auto& lexeme : lexemes) {
+            auto mismatch = std::mismatch(word.begin(), word.end(), lexeme.begin(), lexeme.end());
+            size_t common = mismatch.first - word.begin();
+            covered |= common == lexeme.size();
+            stemmed |= common + 1 >= lexeme.size();
+        }
+        // Stop words have no lexeme at all
+        if(!covered && stemmed)
+            terms.push_back(std::move(word));
+    }
+    return terms;
+}
+
+/**
+ * @brief SQL fetching the pages matching a term. $1 is the term as tsquery
+ */
+static std::string rootSetSql(size_t tier)
+{
+    return "SELECT url as source_url, cross_site_links, content_type, size, "
+        "indexed_content_hash AS content_hash, ts_rank_cd(pages.title_vector, "
+        "$1::tsquery)*50+ts_rank_cd(pages.search_vector, $1::tsquery) AS rank "
+        "FROM pages WHERE pages.search_vector @@ $1::tsquery "
+        "ORDER BY rank DESC LIMIT " + std::to_string(search_tiers[tier].root_limit) + ";";
+}
+
+/**
+ * @brief SQL fetching the cross site links pointing to pages matching a term. $1 is the term as tsquery
+ */
+static std::string baseSetSql(size_t tier)
+{
+    std::string base_limit;
+    if(search_tiers[tier].base_limit != std::numeric_limits<size_t>::max())
+        base_limit = " LIMIT " + std::to_string(search_tiers[tier].base_limit);
+    return "SELECT links.to_url AS dest_url, links.url AS source_url "
+        "FROM pages JOIN links ON pages.url=links.to_url "
+        "WHERE links.is_cross_site = TRUE AND pages.search_vector @@ $1::tsquery" + base_limit;
+}
+
+/**
+ * @brief Make the DB cancel the next statement of the transaction once the deadline passes. The timeout
+ * applies to each statement on its own. So it is set again with the time left before every statement.
+ * SET LOCAL only lasts until the end of the transaction
+ */
+static Task<void> setStatementDeadline(const std::shared_ptr<orm::Transaction>& transaction, std::chrono::steady_clock::time_point deadline)
+{
+    using namespace std::chrono;
+    auto timeout = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+    if(timeout <= 0)
+        throw std::runtime_error("Search deadline exceeded");
+    co_await transaction->execSqlCoro(fmt::format("SET LOCAL statement_timeout = {}", timeout));
+}
+
 SearchController::SearchController()
 {
+    background_thread.run();
+    app().getLoop()->runEvery(60, [this]() {
+        admission_controller.prune();
+    });
+    auto& metrics = SearchMetrics::instance();
+    metrics.addGauge("result_cache_bytes", "Estimated size of the search result cache", [this]() {
+        return double(result_cache.cost());
+    });
+    metrics.addGauge("result_cache_entries", "Number of entries in the search result cache", [this]() {
+        return double(result_cache.size());
+    });
+    metrics.addGauge("term_cache_bytes", "Estimated size of the term candidate cache", [this]() {
+        return double(term_cache.cost());
+    });
+    metrics.addGauge("page_cache_bytes", "Estimated size of the rendered page cache", [this]() {
+        return double(page_cache.cost());
+    });
+    metrics.addGauge("forward_store_bytes", "Estimated size of the forward store", [this]() {
+        return double(forward_store.bytes());
+    });
+    metrics.addGauge("search_queue_size", "Search requests waiting for the cold lane", [this]() {
+        return double(admission_controller.queueSize());
+    });
+    metrics.addGauge("search_cold_load", "Cold lane usage (including the queue) relative to its capacity", [this]() {
+        return admission_controller.coldLoad();
+    });
+    metrics.addGauge("query_log_dropped_entries", "Query log entries dropped because the writer fell behind", [this]() {
+        return query_log == nullptr ? 0.0 : double(query_log->droppedCount());
+    });
+
     auto tlgs = app().getCustomConfig()["tlgs"];
     if(tlgs.isNull())
         return;
 
+    AdmissionController::Config admission_config;
+    admission_config.cached_rate = tlgs.get("search_cached_rate", admission_config.cached_rate).asDouble();
+    admission_config.cached_burst = tlgs.get("search_cached_burst", admission_config.cached_burst).asDouble();
+    admission_config.cold_rate = tlgs.get("search_cold_rate", admission_config.cold_rate).asDouble();
+    admission_config.cold_burst = tlgs.get("search_cold_burst", admission_config.cold_burst).asDouble();
+    admission_config.cold_capacity = tlgs.get("search_cold_capacity", admission_config.cold_capacity).asDouble();
+    admission_config.max_queue_size = tlgs.get("search_queue_size", 128).asUInt64();
+    admission_config.max_wait = tlgs.get("search_queue_timeout", admission_config.max_wait).asDouble();
+    admission_controller.setConfig(admission_config);
+
+    auto term_cache_size = tlgs["term_cache_size_mb"];
+    if(!term_cache_size.isNull())
+        term_cache.setMaxCost(term_cache_size.asUInt64()*1024*1024);
+    auto result_cache_size = tlgs["result_cache_size_mb"];
+    if(!result_cache_size.isNull())
+        result_cache.setMaxCost(result_cache_size.asUInt64()*1024*1024);
+    auto page_cache_size = tlgs["page_cache_size_mb"];
+    if(!page_cache_size.isNull())
+        page_cache.setMaxCost(page_cache_size.asUInt64()*1024*1024);
+    prefetch_max_load = tlgs.get("search_prefetch_max_load", prefetch_max_load).asDouble();
+    auto forward_store_size = tlgs["forward_store_size_mb"];
+    if(!forward_store_size.isNull())
+        forward_store.setMaxBytes(forward_store_size.asUInt64()*1024*1024);
+    forward_store.setTextLength(tlgs.get("forward_store_text_length", 16384).asUInt64());
+    result_cache_soft_ttl = tlgs.get("result_cache_soft_ttl", result_cache_soft_ttl).asDouble();
+    result_cache_hard_ttl = std::max(tlgs.get("result_cache_hard_ttl", result_cache_hard_ttl).asDouble(), result_cache_soft_ttl);
+    search_deadline = tlgs.get("search_deadline", search_deadline).asDouble();
+
+    auto slow_query_log_path = tlgs["slow_query_log_path"];
+    if(!slow_query_log_path.isNull() && !slow_query_log_path.asString().empty()) {
+        slow_query_log = std::make_unique<SlowQueryLog>(slow_query_log_path.asString()
+            , tlgs.get("slow_query_explain_interval", 60.0).asDouble());
+        slow_query_threshold = tlgs.get("slow_query_threshold", slow_query_threshold).asDouble();
+    }
+
+    app().getLoop()->queueInLoop(async_func([this]() -> Task<void> {
+        co_await updateIndexGeneration();
+    }));
+    app().getLoop()->runEvery(60, async_func([this]() -> Task<void> {
+        co_await updateIndexGeneration();
+    }));
+
+    auto persistent_cache_path = tlgs["persistent_cache_path"];
+    if(!persistent_cache_path.isNull() && !persistent_cache_path.asString().empty()) {
+        persistent_cache.setPath(persistent_cache_path.asString());
+        auto persistent_cache_size_mb = tlgs["persistent_cache_size_mb"];
+        if(!persistent_cache_size_mb.isNull())
+            persistent_cache_size = persistent_cache_size_mb.asUInt64()*1024*1024;
+        double interval = tlgs.get("persistent_cache_interval", 300.0).asDouble();
+        app().getLoop()->runEvery(interval, [this]() {
+            snapshotResultCache();
+        });
+    }
+
+    auto query_log_path = tlgs["query_log_path"];
+    if(!query_log_path.isNull() && !query_log_path.asString().empty()) {
+        query_log = std::make_unique<QueryLog>(query_log_path.asString(), tlgs.get("query_log_buffer_size", 4096).asUInt64());
+        warm_up_queries = tlgs.get("warm_up_queries", 100).asUInt64();
+    }
+    precompute_head_queries = tlgs.get("precompute_head_queries", precompute_head_queries).asBool();
+
     auto ranking_algo = tlgs["ranking_algo"];
     if(!ranking_algo.isNull()) {
         auto algo = ranking_algo.asString();
@@ -431,60 +1016,360 @@ SearchController::SearchController()
     }
 }
 
-Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string& query_str)
+Task<std::shared_ptr<const TermCandidates>> SearchController::termCandidates(const std::string& term, std::chrono::steady_clock::time_point deadline,
+    size_t tier, SearchTrace* trace)
 {
-    auto sql_start = std::chrono::high_resolution_clock::now();
+    co_return co_await awaitTermLookup(term, lookupTerm(term, deadline, tier), deadline, tier, trace);
+}
+
+std::shared_ptr<TermLookup> SearchController::lookupTerm(const std::string& term, std::chrono::steady_clock::time_point deadline,
+    size_t tier)
+{
+    std::shared_ptr<const TermCandidates> cached;
+    // Sets fetched for a lower tier are truncated. Unless they are smaller than the limits anyway
+    auto& metrics = SearchMetrics::instance();
+    if(term_cache.findAndFetch(term, cached) && (cached->tier <= tier
+        || (cached->pages.size() < search_tiers[cached->tier].root_limit && !cached->links_truncated))) {
+        metrics.countTermCache(true);
+        auto lookup = std::make_shared<TermLookup>();
+        lookup->done = true;
+        lookup->candidates = std::move(cached);
+        return lookup;
+    }
+    metrics.countTermCache(false);
+
+    const auto key = fmt::format("{}|{}", term, tier);
+    auto lookup = std::make_shared<TermLookup>();
+    lookup->deadline = deadline;
+    {
+        std::lock_guard lock(term_lookups_mutex);
+        auto [it, inserted] = term_lookups.emplace(key, lookup);
+        if(!inserted)
+            return it->second;
+    }
+    async_run([this, term, deadline, tier, key, lookup]() -> Task<void> {
+        std::shared_ptr<const TermCandidates> candidates;
+        std::exception_ptr error;
+        try {
+            candidates = co_await fetchTermCandidates(term, deadline, tier, &lookup->trace);
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard lock(term_lookups_mutex);
+            term_lookups.erase(key);
+        }
+        std::vector<std::pair<std::coroutine_handle<>, trantor::EventLoop*>> waiters;
+        {
+            std::lock_guard lock(lookup->mutex);
+            lookup->done = true;
+            lookup->candidates = std::move(candidates);
+            lookup->error = error;
+            waiters.swap(lookup->waiters);
+        }
+        for(auto [handle, loop] : waiters) {
+            if(loop != nullptr)
+                loop->queueInLoop([handle]() { handle.resume(); });
+            else
+                handle.resume();
+        }
+    });
+    return lookup;
+}
+
+Task<std::shared_ptr<const TermCandidates>> SearchController::awaitTermLookup(const std::string& term, std::shared_ptr<TermLookup> lookup,
+    std::chrono::steady_clock::time_point deadline, size_t tier, SearchTrace* trace)
+{
+    std::shared_ptr<const TermCandidates> candidates;
+    bool retry = false;
+    try {
+        candidates = co_await TermLookupAwaiter{lookup, trantor::EventLoop::getEventLoopOfCurrentThread()};
+    }
+    catch(...) {
+        // The lookup we joined ran out of its time. We still have some
+        if(lookup->deadline >= deadline || std::chrono::steady_clock::now() >= deadline)
+            throw;
+        retry = true;
+    }
+    if(retry)
+        co_return co_await fetchTermCandidates(term, deadline, tier, trace);
+
+    if(trace != nullptr) {
+        for(size_t i = 0; i < search_stage_count; i++)
+            trace->stage_us[i] += lookup->trace.stage_us[i];
+        trace->term_sql_us.insert(trace->term_sql_us.end(), lookup->trace.term_sql_us.begin(), lookup->trace.term_sql_us.end());
+    }
+    co_return candidates;
+}
+
+Task<std::shared_ptr<const TermCandidates>> SearchController::fetchTermCandidates(const std::string& term,
+    std::chrono::steady_clock::time_point deadline, size_t tier, SearchTrace* trace)
+{
+    using namespace std::chrono;
+    constexpr size_t term_cache_time = 600;
+    auto& metrics = SearchMetrics::instance();
+    auto sql_start = steady_clock::now();
+
+    std::shared_ptr<orm::DbClient> db = app().getDbClient();
+    std::shared_ptr<orm::Transaction> transaction;
+    if(deadline != steady_clock::time_point::max()) {
+        // Let the DB cancel the statements when we run out of time. Instead of running them to completion
+        // for nobody
+        transaction = co_await app().getDbClient()->newTransactionCoro();
+        co_await setStatementDeadline(transaction, deadline);
+        db = transaction;
+    }
+    auto nodes_of_intrest = co_await db->execSqlCoro(rootSetSql(tier), term);
+    if(transaction != nullptr)
+        co_await setStatementDeadline(transaction, deadline);
+    auto links_to_node = co_await db->execSqlCoro(baseSetSql(tier), term);
+    auto sql_time = steady_clock::now() - sql_start;
+    metrics.recordStage(SearchStage::TermSql, sql_time, trace);
+    if(trace != nullptr)
+        trace->term_sql_us.emplace_back(term, duration_cast<microseconds>(sql_time).count());
+
+    StageTimer decode_timer(SearchStage::LinkDecode, trace);
+
+    auto candidates = std::make_shared<TermCandidates>();
+    candidates->tier = tier;
+    candidates->pages.reserve(nodes_of_intrest.size());
+    for(const auto& page : nodes_of_intrest) {
+        std::string content_hash = page["content_hash"].as<std::string>();
+        if(content_hash.empty())
+            content_hash = "0";
+        CandidatePage candidate;
+        candidate.url = page["source_url"].as<std::string>();
+        candidate.size = page["size"].as<int64_t>();
+        candidate.content_type = page["content_type"].as<std::string>();
+        candidate.content_hash = std::stoull(content_hash, nullptr, 16);
+        candidate.rank = page["rank"].as<double>();
+        if(!page["cross_site_links"].isNull()) {
+            auto links_str = page["cross_site_links"].as<std::string>();
+            candidate.cross_site_links = nlohmann::json::parse(std::move(links_str)).get<std::vector<std::string>>();
+        }
+        candidates->pages.emplace_back(std::move(candidate));
+    }
+    candidates->links_truncated = links_to_node.size() >= search_tiers[tier].base_limit;
+    candidates->links.reserve(links_to_node.size());
+    for(const auto& link : links_to_node) {
+        candidates->links.push_back(CandidateLink{
+            .source_url = link["source_url"].as<std::string>(),
+            .dest_url = link["dest_url"].as<std::string>()
+        });
+    }
+
+    term_cache.insert(term, candidates, candidates->estimatedSize(), term_cache_time);
+    co_return candidates;
+}
+
+Task<std::string> SearchController::tsQuery(const std::string& text, SearchTrace* trace)
+{
+    std::string tsquery;
+    if(tsquery_cache.findAndFetch(text, tsquery))
+        co_return tsquery;
+    StageTimer timer(SearchStage::TsQuerySql, trace);
     auto db = app().getDbClient();
-    auto nodes_of_intrest = co_await db->execSqlCoro("SELECT url as source_url, cross_site_links, content_type, size, "
-        "indexed_content_hash AS content_hash, ts_rank_cd(pages.title_vector, "
-        "plainto_tsquery($1))*50+ts_rank_cd(pages.search_vector, plainto_tsquery($1)) AS rank "
-        "FROM pages WHERE pages.search_vector @@ plainto_tsquery($1) "
-        "ORDER BY rank DESC LIMIT 50000;", query_str);
-    auto links_to_node = co_await db->execSqlCoro("SELECT links.to_url AS dest_url, links.url AS source_url, content_type, size, "
-        "indexed_content_hash AS content_hash, 0 AS rank FROM pages JOIN links ON pages.url=links.to_url "
-        "WHERE links.is_cross_site = TRUE AND pages.search_vector @@ plainto_tsquery($1)"
-        , query_str);
-    if(nodes_of_intrest.size() == 0) {
-        LOG_DEBUG << "DB returned no root set";
-        co_return {};
+    auto result = co_await db->execSqlCoro("SELECT plainto_tsquery($1)::text AS query", text);
+    tsquery = result[0]["query"].as<std::string>();
+    tsquery_cache.insert(text, tsquery, text.size() + tsquery.size() + 64);
+    co_return tsquery;
+}
+
+Task<SearchOutcome> SearchController::pageSearch(const std::string& query_str, std::chrono::steady_clock::time_point deadline)
+{
+    SearchOutcome outcome;
+    outcome.tier = currentSearchTier();
+    outcome.generation = index_generation.load();
+    const auto& tier = search_tiers[outcome.tier];
+    if(outcome.tier != 0)
+        LOG_DEBUG << "Searching `" << query_str << "` with " << tier.name << " quality";
+    auto& metrics = SearchMetrics::instance();
+    outcome.trace.searched = true;
+    auto sql_start = std::chrono::high_resolution_clock::now();
+    // Each lexeme is looked up (and cached) separately. So queries sharing terms can share the expensive
+    // lookups.
+    auto terms = splitTsQuery(co_await tsQuery(query_str, &outcome.trace));
+    if(terms.empty()) {
+        LOG_DEBUG << "Search query `" << query_str << "` contains no searchable term";
+        co_return outcome;
+    }
+    // Start every lookup before waiting for any. So the terms are fetched concurrently
+    std::vector<std::shared_ptr<TermLookup>> lookups;
+    lookups.reserve(terms.size());
+    for(const auto& term : terms)
+        lookups.push_back(lookupTerm(term, deadline, outcome.tier));
+    std::vector<std::shared_ptr<const TermCandidates>> term_sets;
+    term_sets.reserve(terms.size());
+    for(size_t i = 0; i < terms.size(); i++) {
+        const auto& term = terms[i];
+        try {
+            term_sets.push_back(co_await awaitTermLookup(term, lookups[i], deadline, outcome.tier, &outcome.trace));
+            continue;
+        }
+        catch(std::exception& e) {
+            if(std::chrono::steady_clock::now() < deadline)
+                throw;
+        }
+        // Out of time. A set cached for a lower tier is truncated but still only holds pages matching the
+        // term. Without any there is no telling which pages match every term. Give up instead of returning
+        // pages that don't
+        outcome.complete = false;
+        std::shared_ptr<const TermCandidates> cached;
+        if(term_cache.findAndFetch(term, cached)) {
+            LOG_DEBUG << "Search for `" << query_str << "` hit the deadline. Using truncated candidates of `" << term << "`";
+            term_sets.push_back(std::move(cached));
+            continue;
+        }
+        LOG_DEBUG << "Search for `" << query_str << "` hit the deadline while looking up `" << term << "`";
+        outcome.gave_up = true;
+        co_return outcome;
+    }
+    // Term sets are cut at the root limit of their tier. Intersecting cut sets would lose pages matching every
+    // term but ranking low for a common one. Search for all terms at once then. Which cuts the intersection
+    // instead
+    const bool any_truncated = std::any_of(term_sets.begin(), term_sets.end(), [](const auto& term_set) {
+        return term_set->pages.size() >= search_tiers[term_set->tier].root_limit;
+    });
+    if(term_sets.size() > 1 && any_truncated) {
+        std::string combined;
+        for(const auto& term : terms)
+            combined += (combined.empty() ? "" : " & ") + term;
+        LOG_DEBUG << "Term sets of `" << query_str << "` are truncated. Searching for `" << combined << "` instead";
+        std::shared_ptr<const TermCandidates> combined_set;
+        try {
+            combined_set = co_await termCandidates(combined, deadline, outcome.tier, &outcome.trace);
+        }
+        catch(std::exception& e) {
+            if(std::chrono::steady_clock::now() < deadline)
+                throw;
+            // Out of time. The intersection of the truncated sets still only holds pages matching every term
+            LOG_DEBUG << "Search for `" << query_str << "` hit the deadline while looking up `" << combined << "`";
+            outcome.complete = false;
+        }
+        if(combined_set != nullptr)
+            term_sets.assign(1, std::move(combined_set));
     }
     auto sql_end = std::chrono::high_resolution_clock::now();
+    auto graph_start = std::chrono::steady_clock::now();
 
-    std::unordered_map<std::string, size_t> node_table;
+    // Intersect the term sets, starting from the smallest one. The text score of a page is the sum of the
+    // score of each term
+    // Pages are sorted by rank. Lower tiers only look at the best matches
+    std::sort(term_sets.begin(), term_sets.end(), [](const auto& a, const auto& b) {
+        return a->pages.size() < b->pages.size();
+    });
+    const auto& smallest = *term_sets.front();
+    const auto smallest_pages = term_sets.size() == 1
+        ? std::span(smallest.pages).first(std::min(smallest.pages.size(), tier.root_limit))
+        : std::span(smallest.pages);
+    std::vector<const CandidatePage*> root_pages;
+    std::vector<double> root_rank;
+    root_pages.reserve(smallest_pages.size());
+    root_rank.reserve(smallest_pages.size());
+    if(term_sets.size() == 1) {
+        for(const auto& page : smallest_pages) {
+            root_pages.push_back(&page);
+            root_rank.push_back(page.rank);
+        }
+    }
+    else {
+        std::unordered_map<std::string_view, std::pair<size_t, double>> hits;
+        hits.reserve(smallest_pages.size());
+        for(const auto& page : smallest_pages)
+            hits.emplace(page.url, std::make_pair(size_t{1}, page.rank));
+        for(const auto& term_set : std::span(term_sets).subspan(1)) {
+            for(const auto& page : term_set->pages) {
+                auto it = hits.find(page.url);
+                if(it == hits.end())
+                    continue;
+                it->second.first++;
+                it->second.second += page.rank;
+            }
+        }
+        std::vector<std::pair<const CandidatePage*, double>> matches;
+        for(const auto& page : smallest_pages) {
+            const auto& [count, rank] = hits.at(page.url);
+            if(count == term_sets.size())
+                matches.emplace_back(&page, rank);
+        }
+        // The limit applies to the intersection. Keep the best matches of all terms combined
+        if(matches.size() > tier.root_limit) {
+            std::partial_sort(matches.begin(), matches.begin() + tier.root_limit, matches.end(), [](const auto& a, const auto& b) {
+                return a.second > b.second;
+            });
+            matches.resize(tier.root_limit);
+        }
+        for(const auto& [page, rank] : matches) {
+            root_pages.push_back(page);
+            root_rank.push_back(rank);
+        }
+    }
+
+    root_set_sizes.insert(query_str, root_pages.size(), query_str.size() + sizeof(size_t) + 64);
+    // Searches finish on any thread. A plain load and store would lose updates
+    double average = average_root_set_size.load();
+    while(!average_root_set_size.compare_exchange_weak(average, average*0.9 + root_pages.size()*0.1));
+    if(root_pages.size() == 0) {
+        LOG_DEBUG << "DB returned no root set";
+        co_return outcome;
+    }
+
+    std::unordered_map<std::string_view, size_t> node_table;
     std::vector<RankedResult> nodes;
     std::vector<double> text_rank;
     std::vector<unsigned char> is_root;
-    nodes.reserve(nodes_of_intrest.size());
-    is_root.reserve(nodes_of_intrest.size());
-    node_table.reserve(nodes_of_intrest.size());
-    text_rank.reserve(nodes_of_intrest.size());
+    nodes.reserve(root_pages.size());
+    is_root.reserve(root_pages.size());
+    node_table.reserve(root_pages.size());
+    text_rank.reserve(root_pages.size());
     // Add all nodes to our graph
     // TODO: Graph construction seems to be the slow part then a common term is being search. "Gemini", "capsule" are good examples.
     // Optimize it
-    for(const auto& links : {nodes_of_intrest, links_to_node}) {
-        for(const auto& link : links) {
-            auto source_url = link["source_url"].as<std::string>();
-            if(node_table.count(source_url) == 0) {
-                std::string content_hash = link["content_hash"].as<std::string>();
-                if(content_hash.empty())
-                    content_hash = "0";
-                RankedResult node;
-                double rank = link["rank"].as<double>();
-                node.url = source_url;
-                node.size = link["size"].as<int64_t>();
-                node.content_type = link["content_type"].as<std::string>();
-                node.content_hash = std::stoull(content_hash, nullptr, 16);
-                text_rank.emplace_back(rank);
-                is_root.push_back(bool(rank != 0)); // Since the only reason for rank == 0 is it's in the base but not root
-                nodes.emplace_back(std::move(node));
-                node_table[source_url] = nodes.size()-1;
-            }
-        }
+    for(size_t i=0;i<root_pages.size();i++) {
+        const auto& page = *root_pages[i];
+        if(node_table.count(page.url) != 0)
+            continue;
+        RankedResult node;
+        double rank = root_rank[i];
+        node.url = page.url;
+        node.size = page.size;
+        node.content_type = page.content_type;
+        node.content_hash = page.content_hash;
+        text_rank.emplace_back(rank);
+        is_root.push_back(bool(rank != 0)); // Since the only reason for rank == 0 is it's in the base but not root
+        nodes.emplace_back(std::move(node));
+        node_table[page.url] = nodes.size()-1;
+    }
+    // Links pointing into the root set. Any page in the intersection must be in every term set, so the links
+    // of the smallest set covers all of them
+    std::vector<const CandidateLink*> links_to_node;
+    links_to_node.reserve(smallest.links.size());
+    const bool root_truncated = root_pages.size() != smallest.pages.size();
+    for(const auto& link : smallest.links) {
+        if((term_sets.size() != 1 || root_truncated) && node_table.count(link.dest_url) == 0)
+            continue;
+        links_to_node.push_back(&link);
+    }
+    size_t base_size = 0;
+    for(const auto link : links_to_node) {
+        if(node_table.count(link->source_url) != 0)
+            continue;
+        if(base_size++ >= tier.base_limit)
+            break;
+        RankedResult node;
+        node.url = link->source_url;
+        node.size = 0;
+        node.content_hash = 0;
+        text_rank.emplace_back(0);
+        is_root.push_back(false);
+        nodes.emplace_back(std::move(node));
+        node_table[link->source_url] = nodes.size()-1;
     }
 
     LOG_DEBUG << "DB returned " << nodes.size() << " pages";
-    LOG_DEBUG << "Root set: " << nodes_of_intrest.size() << " pages";
-    LOG_DEBUG << "Base set: " << nodes.size() - nodes_of_intrest.size() << " pages";
+    LOG_DEBUG << "Root set: " << root_pages.size() << " pages";
+    LOG_DEBUG << "Base set: " << nodes.size() - root_pages.size() << " pages";
 
     std::vector<std::vector<size_t>> out_neighbous(nodes.size());
     std::vector<std::vector<size_t>> in_neighbous(nodes.size());
@@ -496,18 +1381,13 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
             return -1;
         return it->second;
     };
-    for(const auto& page : nodes_of_intrest) {
-        auto source_url = page["source_url"].as<std::string>();
-        if(page["cross_site_links"].isNull())
-            continue;
-        auto links_str = page["cross_site_links"].as<std::string>();
-        auto links = nlohmann::json::parse(std::move(links_str)).get<std::vector<std::string>>();
+    for(const auto page : root_pages) {
+        const auto& source_url = page->url;
         auto source_node_idx = getIfExists(source_url);
         if(source_node_idx == -1) // Should not ever happen
             continue;
-        out_neighbous[source_node_idx].reserve(links.size());
-        for(const auto& link : links) {
-            const auto& dest_url = link;
+        out_neighbous[source_node_idx].reserve(page->cross_site_links.size());
+        for(const auto& dest_url : page->cross_site_links) {
             auto dest_node_idx = getIfExists(dest_url);
 
             if(dest_node_idx == -1 || source_url == dest_url)
@@ -516,9 +1396,9 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
             in_neighbous[dest_node_idx].push_back(source_node_idx);
         }
     }
-    for(const auto& link : links_to_node) {
-        const auto& source_url = link["source_url"].as<std::string>();
-        const auto& dest_url = link["dest_url"].as<std::string>();
+    for(const auto link : links_to_node) {
+        const auto& source_url = link->source_url;
+        const auto& dest_url = link->dest_url;
         if(source_url == dest_url)
             continue;
 
@@ -530,11 +1410,22 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
         in_neighbous[dest_node_idx].push_back(source_node_idx);
     }
 
+    outcome.trace.root_set_size = root_pages.size();
+    outcome.trace.base_set_size = nodes.size() - root_pages.size();
+    metrics.recordSetSizes(outcome.trace.root_set_size, outcome.trace.base_set_size);
+    auto rank_start = std::chrono::steady_clock::now();
+    metrics.recordStage(SearchStage::GraphBuild, rank_start - graph_start, &outcome.trace);
+
     std::vector<double> score;
+    bool timed_out = false;
     if(ranking_algorithm == RankingAlgorithm::HITS)
-        score = hitsRank(in_neighbous, out_neighbous);
+        score = hitsRank(in_neighbous, out_neighbous, tier.max_iter, deadline, timed_out);
     else
-        score = salsaRank(in_neighbous, out_neighbous);
+        score = salsaRank(in_neighbous, out_neighbous, tier.max_iter, deadline, timed_out);
+    if(timed_out) {
+        LOG_DEBUG << "Search for `" << query_str << "` hit the deadline while ranking";
+        outcome.complete = false;
+    }
 
     float max_score = *std::max_element(score.begin(), score.end());
     if(max_score == 0)
@@ -551,6 +1442,7 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
             rank *= 1/log(std::numbers::e+(node.size - discourage_size)/(1000*3));
         node.score = 2*(boost * rank) / (boost + rank);
     }
+    metrics.recordStage(SearchStage::Ranking, std::chrono::steady_clock::now() - rank_start, &outcome.trace);
 
     // Deduplicate the search results using URL and hash. Currently it merges the results if the hash is the same
     // and one of the following is true:
@@ -585,23 +1477,27 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
         };
         tlgs::Url node_url(node.url);
         node_url.withHost(to_lower(node_url.host()));
+        // Lower tiers skip the string juggling and only merge pages on the same host or path
         std::string str = node.url;
-        drogon::utils::replaceAll(str, "/~", token);
-        drogon::utils::replaceAll(str, "/users", token);
-        drogon::utils::replaceAll(str, "/user", token);
+        if(tier.full_dedup) {
+            drogon::utils::replaceAll(str, "/~", token);
+            drogon::utils::replaceAll(str, "/users", token);
+            drogon::utils::replaceAll(str, "/user", token);
+        }
         bool replaced = false;
         for(auto& [_, stored] : std::ranges::subrange(begin, end)) {
             tlgs::Url stored_url(stored->url);
             stored_url.withHost(to_lower(stored_url.host()));
             std::string str2 = stored->url;
-            drogon::utils::replaceAll(str2, "/~", token);
-            drogon::utils::replaceAll(str2, "/users", token);
-            drogon::utils::replaceAll(str2, "/user", token);
+            if(tier.full_dedup) {
+                drogon::utils::replaceAll(str2, "/~", token);
+                drogon::utils::replaceAll(str2, "/users", token);
+                drogon::utils::replaceAll(str2, "/user", token);
+            }
 
             if(node_url.host() == stored_url.host() ||
                 node_url.path() == stored_url.path() ||
-                stored->url.ends_with(node_url.host()+node_url.path()) ||
-                str == str2) {
+                (tier.full_dedup && (stored->url.ends_with(node_url.host()+node_url.path()) || str == str2))) {
                 if(stored->score < node.score)
                     stored = &node;
                 replaced = true;
@@ -611,7 +1507,7 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
             // Anti-spam/takeover protection. There are some archives on Geminispace. Commonly with the
             // URL gemini://example.com/<hostname>/<path....>/<filename> This prevents replacing the real
             // capsure link with the mirror/archive
-            if(node.url.ends_with(stored_url.host()+stored_url.path())) {
+            if(tier.full_dedup && node.url.ends_with(stored_url.host()+stored_url.path())) {
                 replaced = true;
                 break;
             }
@@ -621,20 +1517,24 @@ Task<std::vector<RankedResult>> SearchController::pageSearch(const std::string&
             result_map.emplace(node.content_hash, &node);
     }
     auto deduplication_end = std::chrono::high_resolution_clock::now();
+    metrics.recordStage(SearchStage::Dedup, deduplication_end - deduplication_start, &outcome.trace);
     auto sql_time = std::chrono::duration_cast<std::chrono::milliseconds>(sql_end - sql_start);
     auto dedup_time = std::chrono::duration_cast<std::chrono::milliseconds>(deduplication_end - deduplication_start);
     LOG_DEBUG << "Deduplication removed " << num_root - result_map.size() << " results for search term `" << query_str <<"`";
     LOG_DEBUG << "SQL query time: " << sql_time.count() << "ms, Deduplication time: " << dedup_time.count() << "ms";;
 
-    std::vector<RankedResult> search_result;
+    auto& search_result = outcome.results;
     search_result.reserve(result_map.size());
     for(auto& [_, item] : result_map)
         search_result.emplace_back(std::move(*item));
 
-    std::sort(search_result.begin(), search_result.end(), [](const auto& a, const auto& b) {
-        return a.score > b.score;
-    });
-    co_return search_result;
+    {
+        StageTimer sort_timer(SearchStage::Sort, &outcome.trace);
+        std::sort(search_result.begin(), search_result.end(), [](const auto& a, const auto& b) {
+            return a.score > b.score;
+        });
+    }
+    co_return outcome;
 }
 
 bool evalFilter(const std::string_view host, const std::string_view content_type, size_t size, const SearchFilter& filter)
@@ -672,131 +1572,561 @@ bool evalFilter(const std::string_view host, const std::string_view content_type
     return true;
 }
 
-Task<HttpResponsePtr> SearchController::tlgs_search(HttpRequestPtr req)
+static size_t estimatedSize(const RankedResults& results)
+{
+    size_t size = sizeof(CachedResult) + sizeof(RankedResults) + results.capacity()*sizeof(RankedResult);
+    for(const auto& result : results)
+        size += result.url.capacity() + result.content_type.capacity();
+    return size;
+}
+
+/**
+ * @brief Hash a query into a cache key
+ */
+static std::string resultCacheKey(const std::string& str)
+{
+    // Random seed so cache keys can't be predicted and collided on purpose
+    static const uint64_t fixed_random = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+    return tlgs::xxHash128(str, fixed_random);
+}
+
+static std::shared_ptr<const RankedResults> applyFilter(const std::shared_ptr<const RankedResults>& ranked_result, const SearchFilter& filter,
+    SearchTrace* trace = nullptr)
+{
+    if(filter.empty())
+        return ranked_result;
+    StageTimer timer(SearchStage::Filter, trace);
+    auto filtered_result = std::make_shared<RankedResults>();
+    for(const auto& item : *ranked_result) {
+        if(evalFilter(tlgs::Url(item.url).host(), item.content_type, item.size, filter))
+            filtered_result->push_back(item);
+    }
+    return filtered_result;
+}
+
+std::shared_ptr<CachedResult> SearchController::cacheResult(const std::string& key, std::shared_ptr<const RankedResults> results,
+    std::chrono::steady_clock::time_point fresh_until, std::chrono::steady_clock::time_point expire_at, std::string query,
+    bool complete, size_t tier, int64_t generation)
 {
     using namespace std::chrono;
-    constexpr size_t cache_time = 600;
-
-    // Hacky implementation of exponential backoff. We ask each request to wait
-    // more and more until we processed something. Since we can't know how sent
-    // which request
-    tlgs::Counter counter(search_in_flight);
-    static std::atomic<size_t> backup_count = 0;
-    if(counter.count() > 64) {
-        size_t count = backup_count++;
-        size_t backoff = count > 9*64 ? 512 : std::pow(2, count/64.0);
-        auto resp = HttpResponse::newHttpResponse();
-        resp->addHeader("Retry-After", std::to_string(backoff));
-        resp->setStatusCode(k429TooManyRequests);
-        co_return resp;
+    auto entry = std::make_shared<CachedResult>();
+    entry->results = std::move(results);
+    entry->fresh_until = fresh_until;
+    entry->expire_at = expire_at;
+    entry->query = std::move(query);
+    entry->complete = complete;
+    entry->tier = tier;
+    entry->generation = generation;
+    double timeout = duration_cast<duration<double>>(expire_at - steady_clock::now()).count();
+    if(timeout > 0)
+        result_cache.insert(key, entry, estimatedSize(*entry->results), timeout);
+    return entry;
+}
+
+std::shared_ptr<CachedResult> SearchController::cacheSearchOutcome(const SearchQuery& query, SearchOutcome outcome, SearchTrace* trace)
+{
+    using namespace std::chrono;
+    if(outcome.gave_up) {
+        // Not cached. So the next request searches again
+        auto entry = std::make_shared<CachedResult>();
+        entry->results = std::make_shared<const RankedResults>();
+        entry->complete = false;
+        entry->tier = outcome.tier;
+        entry->generation = outcome.generation;
+        return entry;
     }
-    backup_count = 0;
+    auto now = steady_clock::now();
+    // Partial results are better than nothing. But they are stale right away so the next request
+    // gets a complete result computed in the background. Degraded results are refreshed sooner
+    double soft_ttl = outcome.tier == 0 ? result_cache_soft_ttl : std::min(result_cache_soft_ttl, 60.0);
+    auto fresh_until = outcome.complete ? now + duration_cast<steady_clock::duration>(duration<double>(soft_ttl)) : now;
+    auto expire_at = now + duration_cast<steady_clock::duration>(duration<double>(result_cache_hard_ttl));
+    auto results = std::make_shared<const RankedResults>(std::move(outcome.results));
+    auto raw = cacheResult(resultCacheKey(query.canonical_text), results, fresh_until, expire_at, query.text, outcome.complete, outcome.tier, outcome.generation);
+    if(query.canonical == query.canonical_text)
+        return raw;
+    return cacheResult(resultCacheKey(query.canonical), applyFilter(results, query.filter, trace), fresh_until, expire_at, "", outcome.complete, outcome.tier, outcome.generation);
+}
 
-    auto t1 = high_resolution_clock::now();
+void SearchController::refreshInBackground(const SearchQuery& query, std::shared_ptr<CachedResult> stale)
+{
+    // Only one refresh per entry
+    if(stale->refreshing.exchange(true))
+        return;
+    // Nobody waits for the refresh. So it only runs while the cold lane has room for it. Otherwise the stale
+    // result is served as is and the next request for it tries again
+    auto admitted = admission_controller.admitIdle(estimatedCost(query), 1.0);
+    if(!admitted.has_value()) {
+        stale->refreshing = false;
+        return;
+    }
+    auto ticket = std::make_shared<AdmissionController::Ticket>(std::move(*admitted));
+    async_run([this, query, stale, ticket]() -> Task<void> {
+        using namespace std::chrono;
+        const auto raw_key = resultCacheKey(query.canonical_text);
+        const auto filtered_key = resultCacheKey(query.canonical);
+        try {
+            // Another request might have refreshed the raw result already. Then only filtering is needed
+            // Nobody is waiting on the refresh. Let it run to completion
+            std::shared_ptr<CachedResult> raw;
+            if(raw_key != filtered_key && result_cache.findAndFetch(raw_key, raw) && raw->fresh(index_generation.load()))
+                cacheResult(filtered_key, applyFilter(raw->results, query.filter), raw->fresh_until, raw->expire_at, "", raw->complete, raw->tier, raw->generation);
+            else
+                cacheSearchOutcome(query, co_await pageSearch(query.text));
+            LOG_DEBUG << "Refreshed cached search result for `" << query.canonical << "`";
+        }
+        catch(std::exception& e) {
+            // The DB is struggling. Keep serving the stale result and try again later instead of hammering it
+            LOG_WARN << "Failed to refresh search result for `" << query.canonical << "`, serving stale result. Reason: " << e.what();
+            // Results of an older index are taken as current until then. Or every request would try again
+            const int64_t generation = index_generation.load();
+            for(const auto& key : {raw_key, filtered_key}) {
+                std::shared_ptr<CachedResult> entry;
+                if(result_cache.findAndFetch(key, entry) && !entry->fresh(generation)) {
+                    auto retry_at = std::min(steady_clock::now() + seconds(30), entry->expire_at);
+                    cacheResult(key, entry->results, retry_at, entry->expire_at, entry->query, entry->complete, entry->tier, generation);
+                }
+            }
+            stale->refreshing = false;
+        }
+        ticket->release();
+    });
+}
 
-    auto input = utils::urlDecode(req->getParameter("query"));
-    auto [query_str, filter] = parseSearchQuery(input);
-    std::transform(query_str.begin(), query_str.end(), query_str.begin(), ::tolower);
+Task<std::shared_ptr<const RankedResults>> SearchController::rankedResults(const SearchQuery& query, ResultInfo& info,
+    std::chrono::steady_clock::time_point deadline)
+{
+    using namespace std::chrono;
+    const auto raw_key = resultCacheKey(query.canonical_text);
+    const auto filtered_key = resultCacheKey(query.canonical);
+    // Stored and precomputed results are of the current generation
+    const int64_t generation = index_generation.load();
+
+    auto& metrics = SearchMetrics::instance();
+    std::shared_ptr<CachedResult> cached;
+    if(result_cache.findAndFetch(filtered_key, cached)) {
+        if(cached->fresh(generation)) {
+            info.cache_status = "(fully cached)";
+            metrics.countResultCache(ResultCacheOutcome::FullyCached);
+        }
+        else {
+            info.cache_status = "(stale)";
+            metrics.countResultCache(ResultCacheOutcome::Stale);
+            refreshInBackground(query, cached);
+        }
+        info.complete = cached->complete;
+        info.tier = cached->tier;
+        co_return cached->results;
+    }
 
-    if(query_str.empty()) {
-        auto resp = HttpResponse::newHttpResponse();
-        resp->addHeader("meta", "Search for something");
-        resp->setStatusCode((HttpStatusCode)10);
-        co_return resp;
+    std::shared_ptr<CachedResult> raw;
+    if(result_cache.findAndFetch(raw_key, raw)) {
+        info.cache_status = "(raw cached)";
+        info.complete = raw->complete;
+        info.tier = raw->tier;
+        if(!raw->fresh(generation)) {
+            // The refresh will cache the filtered result as well. No need to cache a stale copy
+            info.cache_status = "(raw stale)";
+            metrics.countResultCache(ResultCacheOutcome::RawStale);
+            refreshInBackground(query, raw);
+            co_return applyFilter(raw->results, query.filter, &info.trace);
+        }
+        metrics.countResultCache(ResultCacheOutcome::RawCached);
+    }
+    else if(auto stored = persistent_cache.find(query.text); stored != nullptr) {
+        raw = cacheResult(raw_key, std::move(stored), steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_soft_ttl))
+            , steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_hard_ttl)), query.text, true, 0, generation);
+        info.cache_status = "(disk cached)";
+        metrics.countResultCache(ResultCacheOutcome::Disk);
+    }
+    else if(auto precomputed = co_await precomputedResults(query.text); precomputed != nullptr) {
+        raw = cacheResult(raw_key, std::move(precomputed), steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_soft_ttl))
+            , steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_hard_ttl)), query.text, true, 0, generation);
+        info.cache_status = "(precomputed)";
+        metrics.countResultCache(ResultCacheOutcome::Precomputed);
+    }
+    else {
+        metrics.countResultCache(ResultCacheOutcome::Miss);
+        auto outcome = co_await pageSearch(query.text, deadline);
+        info.trace = outcome.trace;
+        auto filtered = cacheSearchOutcome(query, std::move(outcome), &info.trace);
+        info.cache_status = "";
+        info.complete = filtered->complete;
+        info.tier = filtered->tier;
+        co_return filtered->results;
     }
+    // should not happen
+    if(raw->results == nullptr)
+        throw std::runtime_error("search result is nullptr");
+    if(raw_key == filtered_key)
+        co_return raw->results;
+    auto filtered = cacheResult(filtered_key, applyFilter(raw->results, query.filter, &info.trace), raw->fresh_until, raw->expire_at, "", raw->complete, raw->tier, raw->generation);
+    co_return filtered->results;
+}
 
-    using RankedResults = std::vector<RankedResult>;
+Task<void> SearchController::updateIndexGeneration()
+{
+    int64_t generation;
+    try {
+        auto db = app().getDbClient();
+        auto result = co_await db->execSqlCoro("SELECT COALESCE(MAX(id), 0) AS generation FROM crawl_runs WHERE finished_at IS NOT NULL");
+        generation = result[0]["generation"].as<int64_t>();
+    }
+    catch(std::exception& e) {
+        // Likely the crawl_runs table doesn't exist yet. Don't repeat that every minute
+        if(!index_generation_failed.exchange(true))
+            LOG_WARN << "Failed to query index generation: " << e.what();
+        else
+            LOG_DEBUG << "Failed to query index generation: " << e.what();
+        co_return;
+    }
+    if(index_generation_failed.exchange(false))
+        LOG_INFO << "Index generation is available again";
+
+    // Other servers may have precomputed more queries since the last tick
+    if(precompute_head_queries)
+        co_await loadPrecomputedQueries(generation);
+
+    auto old_generation = index_generation.exchange(generation);
+    if(old_generation == generation)
+        co_return;
+    LOG_INFO << "Index generation is now " << generation;
+    // The persistent cache only needs to be loaded at startup. Later changes means the index changed
+    // under it and it is no longer valid
+    if(old_generation == -1) {
+        persistent_cache.load(generation);
+        co_await warmUpResultCache(false);
+    }
+    else {
+        persistent_cache.unload();
+        term_cache.clear();
+        forward_store.clear();
+        co_await warmUpResultCache(true);
+    }
+}
 
-    static CacheMap<std::string, std::shared_ptr<RankedResults>> result_cache(app().getLoop(), 60);
-    auto page = tlgs::try_strtoull(std::filesystem::path(req->path()).filename().generic_string()).value_or(1);
-    const size_t current_page_idx = page - 1;
+Task<void> SearchController::warmUpResultCache(bool recompute)
+{
+    if(query_log == nullptr || warm_up_queries == 0 || warm_up_running.exchange(true))
+        co_return;
 
-    static const size_t fixed_random = std::random_device()();
-    const auto hasher = std::hash<std::string>();
-    const auto filter_hasher = std::hash<SearchFilter>();
-    const auto query_hash = hasher(query_str)^fixed_random;
-    const auto filter_hash = filter_hasher(filter)^fixed_random;
-    const auto raw_result_cache_key = query_str + "|" + std::to_string(query_hash);
-    const auto filtered_result_cache_key = raw_result_cache_key + "|" + std::to_string(filter_hash);
-    std::string cache_status = "(fully cached)";
-
-    std::shared_ptr<RankedResults> filtered_result;
-    if(result_cache.findAndFetch(filtered_result_cache_key, filtered_result) == false) {
-        std::shared_ptr<RankedResults> ranked_result;
-        if(result_cache.findAndFetch(raw_result_cache_key, ranked_result) == false) {
-            ranked_result = std::make_shared<RankedResults>(co_await pageSearch(query_str));
-            result_cache.insert(raw_result_cache_key, ranked_result, cache_time);
-            cache_status = "";
-        }
-        else {
-            cache_status = "(raw cached)";
-        }
-        // should not happen
-        if(ranked_result == nullptr)
-            throw std::runtime_error("search result is nullptr");
-        if(filter.empty() == false) {
-            filtered_result = std::make_shared<RankedResults>();
-            for(const auto& item : *ranked_result) {
-                if(evalFilter(tlgs::Url(item.url).host(), item.content_type, item.size, filter))
-                    filtered_result->push_back(item);
+    using namespace std::chrono;
+    const int64_t generation = index_generation.load();
+    // Reading the log is blocking IO on up to tens of MB. Do it off the event loop
+    auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+    co_await switchThreadCoro(background_thread.getLoop());
+    auto inputs = QueryLog::topQueries(query_log->path(), warm_up_queries);
+    co_await switchThreadCoro(loop);
+    LOG_INFO << "Warming up result cache with " << inputs.size() << " queries";
+    size_t warmed = 0;
+    // One query at a time. Don't compete with users for the DB
+    for(const auto& input : inputs) {
+        auto query = parseSearchQuery(input);
+        if(query.text.empty())
+            continue;
+        try {
+            if(!recompute && isCached(query)) {
+                warmed++;
+                continue;
+            }
+            // Another server might have computed it already
+            if(auto precomputed = co_await precomputedResults(query.text); precomputed != nullptr) {
+                cacheResult(resultCacheKey(query.canonical_text), std::move(precomputed)
+                    , steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_soft_ttl))
+                    , steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(result_cache_hard_ttl)), query.text, true, 0, generation);
+                warmed++;
+                continue;
             }
+            auto outcome = co_await pageSearch(query.text);
+            // Only full quality results are worth keeping until the next crawl
+            if(precompute_head_queries && generation >= 0 && outcome.complete && outcome.tier == 0)
+                co_await storePrecomputedResults(query.text, outcome.results, generation);
+            cacheSearchOutcome(query, std::move(outcome));
+            warmed++;
         }
-        else {
-            filtered_result = ranked_result;
+        catch(std::exception& e) {
+            LOG_WARN << "Failed to warm up result cache for `" << input << "`: " << e.what();
         }
-        result_cache.insert(filtered_result_cache_key, filtered_result, cache_time);
     }
+    LOG_INFO << "Result cache warmed up with " << warmed << " queries";
+    if(recompute && precompute_head_queries && generation >= 0) {
+        try {
+            co_await app().getDbClient()->execSqlCoro("DELETE FROM precomputed_results WHERE generation < $1", generation);
+        }
+        catch(std::exception& e) {
+            LOG_WARN << "Failed to delete outdated precomputed results: " << e.what();
+        }
+    }
+    warm_up_running = false;
+}
 
-    if(filtered_result == nullptr)
-        throw std::runtime_error("filtered search result is nullptr");
+/**
+ * @brief Precomputed results are stored as base64 of the gzip compressed persistent cache encoding
+ */
+static std::string encodePrecomputed(const RankedResults& results)
+{
+    auto encoded = encodeRankedResults(results);
+    auto compressed = utils::gzipCompress(encoded.data(), encoded.size());
+    return utils::base64Encode((const unsigned char*)compressed.data(), compressed.size());
+}
 
-    const size_t item_per_page = 10;
-    auto begin = filtered_result->begin()+item_per_page*current_page_idx;
-    auto end = filtered_result->begin()+std::min(size_t{item_per_page*(current_page_idx+1)}, filtered_result->size());
-    if(begin > end)
-        begin = end;
-    // XXX: Drogon's raw SQL querys does not support arrays/sets 
-    // Preperbally a bad idea to use string concat for SQL. But we do ignore bad strings
-    std::string url_array;
-    for(const auto& item : std::ranges::subrange(begin, end)) {
-        if(item.url.find('\'') == std::string::npos)
-            url_array += "'"+item.url+"', ";
+static std::shared_ptr<RankedResults> decodePrecomputed(const std::string& str)
+{
+    auto compressed = utils::base64Decode(str);
+    auto encoded = utils::gzipDecompress(compressed.data(), compressed.size());
+    if(encoded.empty())
+        return nullptr;
+    return decodeRankedResults(encoded);
+}
+
+Task<std::shared_ptr<RankedResults>> SearchController::precomputedResults(const std::string& query_text)
+{
+    int64_t generation = index_generation.load();
+    if(!precompute_head_queries || generation < 0)
+        co_return nullptr;
+    {
+        std::lock_guard lock(precomputed_mutex);
+        if(precomputed_generation != generation || !precomputed_queries.contains(query_text))
+            co_return nullptr;
     }
-    if(url_array.size() != 0)
-        url_array.resize(url_array.size()-2);
+    try {
+        auto result = co_await app().getDbClient()->execSqlCoro("SELECT results FROM precomputed_results "
+            "WHERE query = $1 AND generation = $2", query_text, generation);
+        if(result.empty())
+            co_return nullptr;
+        auto results = decodePrecomputed(result[0]["results"].as<std::string>());
+        if(results == nullptr)
+            LOG_WARN << "Corrupted precomputed results for `" << query_text << "`";
+        co_return results;
+    }
+    catch(std::exception& e) {
+        LOG_WARN << "Failed to look up precomputed results for `" << query_text << "`: " << e.what();
+        co_return nullptr;
+    }
+}
 
-    std::vector<SearchResult> search_result;
-    if(!url_array.empty()) {
-        // HACK: Use the first 5K characters for highligh search. This is MUCH faster
-        // without loosing too much accuracy
-        auto db = app().getDbClient();
-        auto page_data = co_await db->execSqlCoro("SELECT url, size, title, content_type, "
-            "ts_headline(SUBSTRING(content_body, 0, 5000), plainto_tsquery($1), 'StartSel=\"[\", "
-                "StopSel=\"]\", MinWords=23, MaxWords=37, MaxFragments=1, FragmentDelimiter=\" ... \"') AS preview, "
-            "last_crawl_success_at FROM pages WHERE url IN ("+url_array+");", query_str);
+Task<void> SearchController::storePrecomputedResults(const std::string& query_text, const RankedResults& results, int64_t generation)
+{
+    try {
+        // Never replace results computed against a newer index
+        co_await app().getDbClient()->execSqlCoro("INSERT INTO precomputed_results (query, generation, results, computed_at) "
+            "VALUES ($1, $2, $3, CURRENT_TIMESTAMP) ON CONFLICT (query) DO UPDATE SET generation = EXCLUDED.generation, "
+            "results = EXCLUDED.results, computed_at = EXCLUDED.computed_at "
+            "WHERE precomputed_results.generation <= EXCLUDED.generation", query_text, generation, encodePrecomputed(results));
+    }
+    catch(std::exception& e) {
+        LOG_WARN << "Failed to store precomputed results for `" << query_text << "`: " << e.what();
+        co_return;
+    }
+    std::lock_guard lock(precomputed_mutex);
+    if(precomputed_generation == generation)
+        precomputed_queries.insert(query_text);
+}
+
+Task<void> SearchController::loadPrecomputedQueries(int64_t generation)
+{
+    std::unordered_set<std::string> queries;
+    try {
+        auto result = co_await app().getDbClient()->execSqlCoro("SELECT query FROM precomputed_results WHERE generation = $1", generation);
+        for(const auto& row : result)
+            queries.insert(row["query"].as<std::string>());
+    }
+    catch(std::exception& e) {
+        // Likely the table doesn't exist yet. Then nothing is looked up in it until it does
+        if(!precomputed_failed.exchange(true))
+            LOG_WARN << "Failed to list precomputed queries: " << e.what();
+        else
+            LOG_DEBUG << "Failed to list precomputed queries: " << e.what();
+        co_return;
+    }
+    precomputed_failed = false;
+    std::lock_guard lock(precomputed_mutex);
+    precomputed_queries = std::move(queries);
+    precomputed_generation = generation;
+}
+
+void SearchController::snapshotResultCache()
+{
+    int64_t generation = index_generation.load();
+    if(!persistent_cache.enabled() || generation < 0 || snapshot_running.exchange(true))
+        return;
+
+    PersistentResultCache::Entries entries;
+    size_t total_size = 0;
+    result_cache.forEach([&](const std::string&, const std::shared_ptr<CachedResult>& entry) {
+        // Results computed against an older index stay in memory for a while. They must not be stored as
+        // if they were current
+        if(entry->query.empty() || !entry->complete || entry->tier != 0 || entry->generation != generation)
+            return true;
+        total_size += estimatedSize(*entry->results);
+        if(total_size > persistent_cache_size)
+            return false;
+        entries.emplace_back(entry->query, entry->results);
+        return true;
+    });
+    if(entries.empty()) {
+        snapshot_running = false;
+        return;
+    }
 
-        std::unordered_map<std::string, size_t> result_idx;
-        for(size_t i=0;i<page_data.size();i++) {
-            const auto& page = page_data[i];
-            result_idx[page["url"].as<std::string>()] = i;
+    // Serializing and writing could take a while. Don't block the event loop
+    std::thread([this, generation, entries = std::move(entries)]() {
+        persistent_cache.snapshot(generation, entries);
+        snapshot_running = false;
+    }).detach();
+}
+
+size_t SearchController::currentSearchTier() const
+{
+    // Degrade before the cold lane is full. So requests keep finishing quickly instead of piling up
+    // in the queue
+    double load = admission_controller.coldLoad();
+    if(load >= 0.9)
+        return 2;
+    if(load >= 0.6)
+        return 1;
+    return 0;
+}
+
+bool SearchController::isCached(const SearchQuery& query)
+{
+    std::shared_ptr<CachedResult> entry;
+    return result_cache.findAndFetch(resultCacheKey(query.canonical), entry)
+        || result_cache.findAndFetch(resultCacheKey(query.canonical_text), entry)
+        || persistent_cache.contains(query.text);
+}
+
+double SearchController::estimatedCost(const SearchQuery& query)
+{
+    size_t root_set_size;
+    if(!root_set_sizes.findAndFetch(query.text, root_set_size))
+        root_set_size = average_root_set_size.load();
+    // Ranking is roughly linear to the size of the root (and base) set
+    return 1 + root_set_size / 1000.0;
+}
+
+void SearchController::explainSlowQuery(const SlowQuery& query, size_t tier)
+{
+    const auto& term_sql_us = query.trace.term_sql_us;
+    auto slowest = std::max_element(term_sql_us.begin(), term_sql_us.end(), [](const auto& a, const auto& b) {
+        return a.second < b.second;
+    });
+    // Nothing to explain if the time wasn't spent on term lookups
+    if(slowest == term_sql_us.end() || !slow_query_log->tryStartExplain())
+        return;
+
+    async_run([this, timestamp = query.timestamp, input = query.input, term = slowest->first, tier]() -> Task<void> {
+        // EXPLAIN ANALYZE runs the statement for real. Don't let a pathological one hold a connection forever
+        constexpr int explain_timeout_ms = 60*1000;
+        const std::array<std::pair<std::string_view, std::string>, 2> statements = {{
+            {"root set", rootSetSql(tier)},
+            {"base set", baseSetSql(tier)},
+        }};
+        try {
+            auto transaction = co_await app().getDbClient()->newTransactionCoro();
+            co_await transaction->execSqlCoro(fmt::format("SET LOCAL statement_timeout = {}", explain_timeout_ms));
+            for(const auto& [name, sql] : statements) {
+                auto result = co_await transaction->execSqlCoro("EXPLAIN (ANALYZE, BUFFERS) " + sql, term);
+                std::string plan;
+                for(const auto& row : result)
+                    plan += row["QUERY PLAN"].as<std::string>() + "\n";
+                slow_query_log->recordPlan(timestamp, input, term, name, plan);
+            }
+        }
+        catch(std::exception& e) {
+            LOG_WARN << "Failed to capture the plan of slow query `" << input << "`: " << e.what();
         }
+        slow_query_log->finishExplain();
+    });
+}
 
-        for(const auto& item : std::ranges::subrange(begin, end)) {
-            auto it = result_idx.find(item.url);
-            if(it == result_idx.end()) {
+static std::string pageCacheKey(const SearchQuery& query, const std::string& input, size_t page_idx)
+{
+    return resultCacheKey(fmt::format("{}|input:{}:{}|page:{}", query.canonical, input.size(), input, page_idx));
+}
+
+void SearchController::prefetchNextPage(const SearchQuery& query, const std::string& input, size_t page_idx, bool verbose,
+    std::shared_ptr<const RankedResults> results, const ResultInfo& info)
+{
+    size_t next_page_idx = page_idx + 1;
+    // Verbose pages show the trace of the request that asks for them. There is nothing to prepare
+    if(verbose || prefetch_max_load <= 0 || next_page_idx*item_per_page >= results->size())
+        return;
+    std::shared_ptr<const RenderedPage> cached;
+    if(page_cache.findAndFetch(pageCacheKey(query, input, next_page_idx), cached) && cached->results.lock() == results)
+        return;
+    // Only when the DB isn't busy with user requests. Prefetching is a guess, users come first
+    auto admitted = admission_controller.admitIdle(1, prefetch_max_load);
+    if(!admitted.has_value())
+        return;
+
+    auto ticket = std::make_shared<AdmissionController::Ticket>(std::move(*admitted));
+    ResultInfo prefetch_info;
+    prefetch_info.cache_status = info.cache_status;
+    prefetch_info.complete = info.complete;
+    prefetch_info.tier = info.tier;
+    // After the current response is sent
+    trantor::EventLoop::getEventLoopOfCurrentThread()->queueInLoop(async_func([this, query, input, next_page_idx, results
+        , prefetch_info, ticket]() mutable -> Task<void> {
+        try {
+            co_await renderedPage(query, input, next_page_idx, false, results, prefetch_info);
+        }
+        catch(std::exception& e) {
+            LOG_DEBUG << "Failed to prefetch page " << next_page_idx + 1 << " of `" << query.canonical << "`: " << e.what();
+        }
+        ticket->release();
+    }));
+}
+
+Task<std::shared_ptr<const RenderedPage>> SearchController::renderedPage(const SearchQuery& query, const std::string& input,
+    size_t page_idx, bool verbose, std::shared_ptr<const RankedResults> results, ResultInfo& info)
+{
+    // The result cache hands out a new results object whenever the result is recomputed. Pages rendered from
+    // the old one are stale
+    const auto key = pageCacheKey(query, input, page_idx);
+    std::shared_ptr<const RenderedPage> cached;
+    if(!verbose && page_cache.findAndFetch(key, cached) && cached->results.lock() == results) {
+        SearchMetrics::instance().countPageCache(true);
+        co_return cached;
+    }
+    SearchMetrics::instance().countPageCache(false);
+
+    auto begin = results->begin()+item_per_page*page_idx;
+    auto end = results->begin()+std::min(size_t{item_per_page*(page_idx+1)}, results->size());
+    if(begin > end)
+        begin = end;
+    std::vector<std::string> urls;
+    for(const auto& item : std::ranges::subrange(begin, end))
+        urls.push_back(item.url);
+    auto stored_pages = co_await forward_store.pages(urls, &info.trace);
+
+    // Previews are generated here instead of by ts_headline(). Much cheaper than making the DB do it
+    std::vector<std::string> lexemes;
+    try {
+        lexemes = splitTsQuery(co_await tsQuery(query.text, &info.trace));
+    }
+    catch(std::exception& e) {
+        LOG_DEBUG << "Failed to get the lexemes of `" << query.text << "`. Highlighting the words as typed: " << e.what();
+    }
+    std::vector<SearchResult> search_result;
+    {
+        StageTimer snippet_timer(SearchStage::Snippet, &info.trace);
+        auto terms = highlightTerms(query.text, lexemes);
+        for(size_t i = 0; i < urls.size(); i++) {
+            const auto& item = *(begin + i);
+            const auto& page = stored_pages[i];
+            if(page == nullptr) {
                 LOG_WARN << "Somehow found " << item.url << " in search. But that URL does not exist in DB";
                 continue;
             }
 
-            const auto& page = page_data[it->second];
             SearchResult res {
                 .url = item.url,
-                .title = page["title"].as<std::string>(),
-                .content_type = page["content_type"].as<std::string>(),
-                .preview = page["preview"].as<std::string>(),
-                .last_crawled_at = trantor::Date::fromDbStringLocal(page["last_crawl_success_at"].as<std::string>())
-                    .toCustomedFormattedString("%Y-%m-%d %H:%M:%S", false),
-                .size = page["size"].as<uint64_t>(),
+                .title = page->title,
+                .content_type = page->content_type,
+                .preview = tlgs::highlightSnippet(page->text(), terms),
+                .last_crawled_at = page->last_crawled_at,
+                .size = page->size,
                 .score = item.score
             };
             if(res.preview.empty())
@@ -805,24 +2135,118 @@ Task<HttpResponsePtr> SearchController::tlgs_search(HttpRequestPtr req)
         }
     }
 
+    StageTimer render_timer(SearchStage::Render, &info.trace);
     HttpViewData data;
     std::string encoded_search_term = tlgs::urlEncode(input);
     data["search_result"] = std::move(search_result);
     data["title"] = sanitizeGemini(input) + " - TLGS Search";
-    data["verbose"] = req->path().starts_with("/v/search");
+    data["verbose"] = verbose;
     data["encoded_search_term"] = encoded_search_term;
-    data["total_results"] = filtered_result->size();
-    data["current_page_idx"] = current_page_idx;
+    data["total_results"] = results->size();
+    data["current_page_idx"] = page_idx;
     data["item_per_page"] = item_per_page;
     data["search_query"] = input; 
+    data["search_complete"] = info.complete;
+    data["search_tier"] = std::string(search_tiers[info.tier].name);
+    data["search_trace"] = info.trace;
 
     auto resp = HttpResponse::newHttpViewResponse("search_result", data);
+    auto rendered = std::make_shared<RenderedPage>();
+    rendered->body = std::string(resp->getBody());
+    rendered->results = results;
+    if(!verbose)
+        page_cache.insert(key, rendered, sizeof(RenderedPage) + rendered->body.capacity() + key.size());
+    co_return rendered;
+}
+
+Task<HttpResponsePtr> SearchController::tlgs_search(HttpRequestPtr req)
+{
+    using namespace std::chrono;
+
+    auto t1 = high_resolution_clock::now();
+
+    auto input = utils::urlDecode(req->getParameter("query"));
+    auto query = parseSearchQuery(input);
+    const auto& query_str = query.text;
+    auto t_parsed = high_resolution_clock::now();
+
+    if(query_str.empty()) {
+        auto resp = HttpResponse::newHttpResponse();
+        resp->addHeader("meta", "Search for something");
+        resp->setStatusCode((HttpStatusCode)10);
+        co_return resp;
+    }
+
+    auto page = tlgs::try_strtoull(std::filesystem::path(req->path()).filename().generic_string()).value_or(1);
+    const size_t current_page_idx = page - 1;
+    // Cache hits and searches that hit the DB are admitted separately. So expensive queries can't starve
+    // cheap ones
+    auto lane = isCached(query) ? AdmissionController::Lane::Cached : AdmissionController::Lane::Cold;
+    auto admission = co_await admission_controller.admit(lane, req->getPeerAddr().toIp(), estimatedCost(query));
+    if(!admission.admitted) {
+        SearchMetrics::instance().countRejected(lane == AdmissionController::Lane::Cold);
+        auto resp = HttpResponse::newHttpResponse();
+        // Infinite if the bucket never refills. Which can't be converted to an integer
+        constexpr double max_retry_after = 3600;
+        double retry_after = std::isfinite(admission.retry_after) ? std::ceil(admission.retry_after) : max_retry_after;
+        retry_after = std::clamp(retry_after, 1.0, max_retry_after);
+        resp->addHeader("Retry-After", std::to_string(size_t(retry_after)));
+        resp->setStatusCode(k429TooManyRequests);
+        co_return resp;
+    }
+
+    auto deadline = search_deadline > 0
+        ? steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(search_deadline))
+        : steady_clock::time_point::max();
+    ResultInfo info;
+    auto filtered_result = co_await rankedResults(query, info, deadline);
+    if(filtered_result == nullptr)
+        throw std::runtime_error("filtered search result is nullptr");
+    auto t_ranked = high_resolution_clock::now();
+
+    bool verbose = req->path().starts_with("/v/search");
+    auto rendered = co_await renderedPage(query, input, current_page_idx, verbose, filtered_result, info);
+    prefetchNextPage(query, input, current_page_idx, verbose, filtered_result, info);
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setBody(rendered->body);
     resp->setContentTypeCodeAndCustomString(CT_CUSTOM, "text/gemini");
 
     auto t2 = high_resolution_clock::now();
+    SearchMetrics::instance().recordStage(SearchStage::Total, t2 - t1);
     double processing_time = duration_cast<duration<double>>(t2 - t1).count();
     LOG_DEBUG << fmt::format("Searching for '{}' took {} {} seconds."
-        , input, cache_status, processing_time);
+        , input, info.cache_status, processing_time);
+    auto timestamp = trantor::Date::now().microSecondsSinceEpoch();
+    if(slow_query_log != nullptr && processing_time >= slow_query_threshold) {
+        SlowQuery slow_query{
+            .timestamp = timestamp,
+            .input = input,
+            .cache_status = info.cache_status,
+            .tier = search_tiers[info.tier].name,
+            .complete = info.complete,
+            .total_us = (uint64_t)duration_cast<microseconds>(t2 - t1).count(),
+            .trace = info.trace
+        };
+        slow_query_log->record(slow_query);
+        explainSlowQuery(slow_query, info.tier);
+    }
+    if(query_log != nullptr) {
+        auto us = [](auto d) { return (uint32_t)duration_cast<microseconds>(d).count(); };
+        query_log->record(QueryLogEntry{
+            .timestamp = timestamp,
+            .input = input,
+            .query = query.text,
+            .filters = query.canonical.substr(query.canonical_text.size()),
+            .page = page,
+            .cache_status = info.cache_status,
+            .complete = info.complete,
+            .parse_us = us(t_parsed - t1),
+            .rank_us = us(t_ranked - t_parsed),
+            .preview_us = uint32_t(info.trace.stage_us[size_t(SearchStage::PreviewSql)] + info.trace.stage_us[size_t(SearchStage::Snippet)]),
+            .render_us = uint32_t(info.trace.stage_us[size_t(SearchStage::Render)]),
+            .total_us = us(t2 - t1)
+        });
+    }
     co_return resp;
 }
 
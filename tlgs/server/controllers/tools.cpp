@@ -3,6 +3,7 @@
 #include <drogon/HttpAppFramework.h>
 #include <tlgsutils/url_parser.hpp>
 #include "search_result.hpp"
+#include "metrics.hpp"
 
 using namespace drogon;
 
@@ -12,11 +13,13 @@ public:
 	Task<HttpResponsePtr> statistics(HttpRequestPtr req);
 	Task<HttpResponsePtr> known_hosts(HttpRequestPtr req);
 	Task<HttpResponsePtr> add_seed(HttpRequestPtr req);
+	Task<HttpResponsePtr> metrics(HttpRequestPtr req);
 
 	METHOD_LIST_BEGIN
     ADD_METHOD_TO(ToolsController::statistics, "/statistics", {Get});
     ADD_METHOD_TO(ToolsController::known_hosts, "/known-hosts", {Get});
 	ADD_METHOD_TO(ToolsController::add_seed, "/add_seed", {Get});
+    ADD_METHOD_TO(ToolsController::metrics, "/metrics", {Get});
     METHOD_LIST_END
 };
 
@@ -128,4 +131,12 @@ Task<HttpResponsePtr> ToolsController::add_seed(HttpRequestPtr req)
     resp->setBody("# Adding Capsule\nAdded " + input);
     resp->setContentTypeCodeAndCustomString(CT_CUSTOM, "text/gemini");
     co_return resp;
-}
\ No newline at end of file
+}
+
+Task<HttpResponsePtr> ToolsController::metrics(HttpRequestPtr req)
+{
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setBody(SearchMetrics::instance().prometheusText());
+    resp->setContentTypeCodeAndCustomString(CT_CUSTOM, "text/plain; version=0.0.4");
+    co_return resp;
+}
@@ -0,0 +1,93 @@
+#include "forward_store.hpp"
+
+#include <drogon/HttpAppFramework.h>
+#include <drogon/utils/Utilities.h>
+#include <tlgsutils/utils.hpp>
+
+using namespace drogon;
+
+std::string StoredPage::text() const
+{
+    if(compressed_text.empty())
+        return "";
+    return utils::gzipDecompress(compressed_text.data(), compressed_text.size());
+}
+
+size_t StoredPage::estimatedSize() const
+{
+    return sizeof(StoredPage) + title.capacity() + content_type.capacity() + last_crawled_at.capacity()
+        + compressed_text.capacity();
+}
+
+ForwardStore::ForwardStore(size_t max_bytes, size_t text_length)
+    : store_(max_bytes)
+    , text_length_(text_length)
+{
+}
+
+Task<std::vector<std::shared_ptr<const StoredPage>>> ForwardStore::pages(const std::vector<std::string>& urls, SearchTrace* trace)
+{
+    std::vector<std::shared_ptr<const StoredPage>> result(urls.size());
+    // Index into urls of the pages to fetch
+    std::vector<size_t> missing;
+    std::vector<std::string> missing_urls;
+    for(size_t i = 0; i < urls.size(); i++) {
+        if(store_.findAndFetch(urls[i], result[i]))
+            continue;
+        missing.push_back(i);
+        missing_urls.push_back(urls[i]);
+    }
+    if(missing.empty())
+        co_return result;
+
+    // The statement text never changes. So it is prepared once per connection. `= ANY` lets Postgres use the
+    // index on url and the ordinality maps each row back to where it is asked for
+    auto sql_start = std::chrono::steady_clock::now();
+    auto db = app().getDbClient();
+    auto page_data = co_await db->execSqlCoro("SELECT requested.idx, size, title, content_type, "
+        "LEFT(content_body, $2::int) AS body, last_crawl_success_at "
+        "FROM pages JOIN unnest($1::text[]) WITH ORDINALITY AS requested(url, idx) ON pages.url = requested.url "
+        "WHERE pages.url = ANY($1::text[]) ORDER BY requested.idx", tlgs::pgTextArray(missing_urls), std::to_string(text_length_));
+    SearchMetrics::instance().recordStage(SearchStage::PreviewSql, std::chrono::steady_clock::now() - sql_start, trace);
+
+    for(const auto& row : page_data) {
+        auto idx = row["idx"].as<int64_t>() - 1;
+        if(idx < 0 || size_t(idx) >= missing.size())
+            continue;
+        auto page = std::make_shared<StoredPage>();
+        page->title = row["title"].as<std::string>();
+        page->content_type = row["content_type"].as<std::string>();
+        page->size = row["size"].as<uint64_t>();
+        page->last_crawled_at = trantor::Date::fromDbStringLocal(row["last_crawl_success_at"].as<std::string>())
+            .toCustomedFormattedString("%Y-%m-%d %H:%M:%S", false);
+        if(!row["body"].isNull()) {
+            auto body = row["body"].as<std::string>();
+            if(!body.empty())
+                page->compressed_text = utils::gzipCompress(body.data(), body.size());
+        }
+        page->compressed_text.shrink_to_fit();
+        store_.insert(missing_urls[idx], page, page->estimatedSize());
+        result[missing[idx]] = std::move(page);
+    }
+    co_return result;
+}
+
+void ForwardStore::setMaxBytes(size_t max_bytes)
+{
+    store_.setMaxCost(max_bytes);
+}
+
+void ForwardStore::setTextLength(size_t text_length)
+{
+    text_length_ = text_length;
+}
+
+void ForwardStore::clear()
+{
+    store_.clear();
+}
+
+size_t ForwardStore::bytes() const
+{
+    return store_.cost();
+}
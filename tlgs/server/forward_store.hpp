@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include <drogon/utils/coroutine.h>
+#include <tlgsutils/lru_cache.hpp>
+
+#include "metrics.hpp"
+
+/**
+ * @brief What a search result page needs to show a page. The leading text of the page is kept
+ * gzip compressed
+ */
+struct StoredPage
+{
+    std::string title;
+    std::string content_type;
+    uint64_t size;
+    std::string last_crawled_at;
+    std::string compressed_text;
+
+    std::string text() const;
+    size_t estimatedSize() const;
+};
+
+/**
+ * @brief Compact in-memory forward index. Maps URLs to their title, metadata and compressed leading
+ * text. So previews can be generated without asking the DB to do it. Filled lazily, one batch query
+ * for all pages of a result page not in the store yet.
+ */
+class ForwardStore
+{
+public:
+    ForwardStore(size_t max_bytes = 256*1024*1024, size_t text_length = 16*1024);
+
+    /**
+     * @brief Get the stored pages of the URLs. Pages not stored yet are fetched from the DB
+     *
+     * @return stored pages in the same order as urls. nullptr if the page is not in the DB
+     */
+    drogon::Task<std::vector<std::shared_ptr<const StoredPage>>> pages(const std::vector<std::string>& urls,
+        SearchTrace* trace = nullptr);
+    void setMaxBytes(size_t max_bytes);
+    void setTextLength(size_t text_length);
+    /**
+     * @brief Drop all stored pages. i.e. after the pages are recrawled
+     */
+    void clear();
+    size_t bytes() const;
+
+protected:
+    tlgs::LruCache<std::string, std::shared_ptr<const StoredPage>> store_;
+    // Number of characters of the page text to store
+    size_t text_length_;
+};
@@ -2,6 +2,7 @@
 #include <dremini/GeminiServerPlugin.hpp>
 #include <spartoi/SpartanServerPlugin.hpp>
 #include <tlgsutils/url_parser.hpp>
+#include <filesystem>
 
 #ifdef __linux__
 #define LLUNVEIL_USE_UNVEIL
@@ -95,6 +96,14 @@ int main(int argc, char** argv)
         // Lockdown the server to only access the files in the document directory
         unveil(drogon::app().getDocumentRoot().c_str(), "r");
         unveil(drogon::app().getUploadPath().c_str(), "rwc");
+        // The persistent result cache is written to a temporary file and renamed. Needs the whole directory
+        for(const auto& key : {"persistent_cache_path", "query_log_path", "slow_query_log_path"}) {
+            auto path = drogon::app().getCustomConfig()["tlgs"][key];
+            if(path.isNull() || path.asString().empty())
+                continue;
+            auto dir = std::filesystem::path(path.asString()).parent_path();
+            unveil(dir.empty() ? "." : dir.c_str(), "rwc");
+        }
         unveil(nullptr, nullptr);
         #endif
     });
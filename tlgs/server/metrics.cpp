@@ -0,0 +1,114 @@
+#include "metrics.hpp"
+
+#include <fmt/core.h>
+
+static constexpr std::array<std::string_view, size_t(ResultCacheOutcome::Count)> result_cache_outcome_names = {
+    "fully_cached", "stale", "raw_cached", "raw_stale", "disk", "precomputed", "miss"
+};
+static constexpr double exported_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+SearchMetrics& SearchMetrics::instance()
+{
+    static SearchMetrics metrics;
+    return metrics;
+}
+
+void SearchMetrics::recordStage(SearchStage stage, std::chrono::nanoseconds duration, SearchTrace* trace)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    stage_us_[size_t(stage)].record(us);
+    if(trace != nullptr)
+        trace->stage_us[size_t(stage)] += us;
+}
+
+void SearchMetrics::recordSetSizes(size_t root_set_size, size_t base_set_size)
+{
+    root_set_size_.record(root_set_size);
+    base_set_size_.record(base_set_size);
+}
+
+void SearchMetrics::countResultCache(ResultCacheOutcome outcome)
+{
+    result_cache_[size_t(outcome)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void SearchMetrics::countTermCache(bool hit)
+{
+    (hit ? term_cache_hits_ : term_cache_misses_).fetch_add(1, std::memory_order_relaxed);
+}
+
+void SearchMetrics::countPageCache(bool hit)
+{
+    (hit ? page_cache_hits_ : page_cache_misses_).fetch_add(1, std::memory_order_relaxed);
+}
+
+void SearchMetrics::countRejected(bool cold_lane)
+{
+    (cold_lane ? rejected_cold_ : rejected_cached_).fetch_add(1, std::memory_order_relaxed);
+}
+
+void SearchMetrics::addGauge(std::string name, std::string help, std::function<double()> func)
+{
+    std::lock_guard lock(gauge_mutex_);
+    gauges_.push_back({std::move(name), std::move(help), std::move(func)});
+}
+
+/**
+ * @brief Write a histogram as a Prometheus summary
+ *
+ * @param scale multiplied to the recorded values. i.e. to convert microseconds into seconds
+ */
+static void appendSummary(std::string& out, std::string_view name, std::string_view labels, const tlgs::Histogram::Snapshot& snapshot, double scale)
+{
+    std::string label_prefix = labels.empty() ? "" : std::string(labels) + ",";
+    for(auto q : exported_quantiles)
+        out += fmt::format("{}{{{}quantile=\"{}\"}} {}\n", name, label_prefix, q, snapshot.valueAtQuantile(q) * scale);
+    std::string label_set = labels.empty() ? "" : fmt::format("{{{}}}", labels);
+    out += fmt::format("{}_sum{} {}\n", name, label_set, snapshot.sum * scale);
+    out += fmt::format("{}_count{} {}\n", name, label_set, snapshot.count);
+}
+
+std::string SearchMetrics::prometheusText() const
+{
+    std::string out;
+    out += "# HELP tlgs_search_stage_seconds Time spent in each stage of search requests\n";
+    out += "# TYPE tlgs_search_stage_seconds summary\n";
+    for(size_t i = 0; i < search_stage_count; i++) {
+        appendSummary(out, "tlgs_search_stage_seconds", fmt::format("stage=\"{}\"", search_stage_names[i])
+            , stage_us_[i].snapshot(), 1e-6);
+    }
+
+    out += "# HELP tlgs_search_root_set_size Number of pages matching the search terms\n";
+    out += "# TYPE tlgs_search_root_set_size summary\n";
+    appendSummary(out, "tlgs_search_root_set_size", "", root_set_size_.snapshot(), 1);
+    out += "# HELP tlgs_search_base_set_size Number of pages linking into the root set\n";
+    out += "# TYPE tlgs_search_base_set_size summary\n";
+    appendSummary(out, "tlgs_search_base_set_size", "", base_set_size_.snapshot(), 1);
+
+    out += "# HELP tlgs_search_result_cache_total Search requests by where the result comes from\n";
+    out += "# TYPE tlgs_search_result_cache_total counter\n";
+    for(size_t i = 0; i < result_cache_.size(); i++) {
+        out += fmt::format("tlgs_search_result_cache_total{{outcome=\"{}\"}} {}\n", result_cache_outcome_names[i]
+            , result_cache_[i].load(std::memory_order_relaxed));
+    }
+    out += "# HELP tlgs_search_term_cache_total Term candidate set lookups\n";
+    out += "# TYPE tlgs_search_term_cache_total counter\n";
+    out += fmt::format("tlgs_search_term_cache_total{{result=\"hit\"}} {}\n", term_cache_hits_.load(std::memory_order_relaxed));
+    out += fmt::format("tlgs_search_term_cache_total{{result=\"miss\"}} {}\n", term_cache_misses_.load(std::memory_order_relaxed));
+    out += "# HELP tlgs_search_page_cache_total Rendered result page lookups\n";
+    out += "# TYPE tlgs_search_page_cache_total counter\n";
+    out += fmt::format("tlgs_search_page_cache_total{{result=\"hit\"}} {}\n", page_cache_hits_.load(std::memory_order_relaxed));
+    out += fmt::format("tlgs_search_page_cache_total{{result=\"miss\"}} {}\n", page_cache_misses_.load(std::memory_order_relaxed));
+    out += "# HELP tlgs_search_rejected_total Search requests rejected by admission control\n";
+    out += "# TYPE tlgs_search_rejected_total counter\n";
+    out += fmt::format("tlgs_search_rejected_total{{lane=\"cached\"}} {}\n", rejected_cached_.load(std::memory_order_relaxed));
+    out += fmt::format("tlgs_search_rejected_total{{lane=\"cold\"}} {}\n", rejected_cold_.load(std::memory_order_relaxed));
+
+    std::lock_guard lock(gauge_mutex_);
+    for(const auto& gauge : gauges_) {
+        out += fmt::format("# HELP tlgs_{} {}\n", gauge.name, gauge.help);
+        out += fmt::format("# TYPE tlgs_{} gauge\n", gauge.name);
+        out += fmt::format("tlgs_{} {}\n", gauge.name, gauge.func());
+    }
+    return out;
+}
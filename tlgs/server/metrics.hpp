@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <utility>
+
+#include <tlgsutils/histogram.hpp>
+
+/**
+ * @brief Stages of a search request. Timed separately
+ */
+enum class SearchStage : size_t
+{
+    TsQuerySql = 0,
+    TermSql,
+    LinkDecode,
+    GraphBuild,
+    Ranking,
+    Dedup,
+    Sort,
+    Filter,
+    PreviewSql,
+    Snippet,
+    Render,
+    Total,
+    Count
+};
+
+constexpr size_t search_stage_count = size_t(SearchStage::Count);
+constexpr std::array<std::string_view, search_stage_count> search_stage_names = {
+    "tsquery_sql", "term_sql", "link_decode", "graph_build", "ranking", "dedup", "sort", "filter",
+    "preview_sql", "snippet", "render", "total"
+};
+
+enum class ResultCacheOutcome : size_t
+{
+    FullyCached = 0,
+    Stale,
+    RawCached,
+    RawStale,
+    Disk,
+    Precomputed,
+    Miss,
+    Count
+};
+
+/**
+ * @brief Where the time of a single search request went. Shown in verbose search
+ */
+struct SearchTrace
+{
+    // Microseconds spent in each stage
+    std::array<uint64_t, search_stage_count> stage_us{};
+    size_t root_set_size = 0;
+    size_t base_set_size = 0;
+    // pageSearch() ran for this request. Otherwise the DB/ranking stages are empty
+    bool searched = false;
+    // Terms looked up in the DB (not the term cache) and the microseconds their SQL took
+    std::vector<std::pair<std::string, uint64_t>> term_sql_us;
+};
+
+/**
+ * @brief Process wide search metrics. Recording is lock free. Exported in the Prometheus text format
+ */
+class SearchMetrics
+{
+public:
+    static SearchMetrics& instance();
+
+    /**
+     * @brief Record the time spent in a stage. Into the trace too if not null
+     */
+    void recordStage(SearchStage stage, std::chrono::nanoseconds duration, SearchTrace* trace = nullptr);
+    void recordSetSizes(size_t root_set_size, size_t base_set_size);
+    void countResultCache(ResultCacheOutcome outcome);
+    void countTermCache(bool hit);
+    void countPageCache(bool hit);
+    void countRejected(bool cold_lane);
+    /**
+     * @brief Export a value that is read when the metrics are scraped
+     */
+    void addGauge(std::string name, std::string help, std::function<double()> func);
+
+    std::string prometheusText() const;
+
+protected:
+    std::array<tlgs::ShardedHistogram, search_stage_count> stage_us_;
+    tlgs::ShardedHistogram root_set_size_;
+    tlgs::ShardedHistogram base_set_size_;
+    std::array<std::atomic<uint64_t>, size_t(ResultCacheOutcome::Count)> result_cache_{};
+    std::atomic<uint64_t> term_cache_hits_{0};
+    std::atomic<uint64_t> term_cache_misses_{0};
+    std::atomic<uint64_t> page_cache_hits_{0};
+    std::atomic<uint64_t> page_cache_misses_{0};
+    std::atomic<uint64_t> rejected_cached_{0};
+    std::atomic<uint64_t> rejected_cold_{0};
+
+    struct Gauge
+    {
+        std::string name;
+        std::string help;
+        std::function<double()> func;
+    };
+    mutable std::mutex gauge_mutex_;
+    std::vector<Gauge> gauges_;
+};
+
+/**
+ * @brief Times a scope as a search stage
+ */
+class StageTimer
+{
+public:
+    StageTimer(SearchStage stage, SearchTrace* trace = nullptr)
+        : stage_(stage)
+        , trace_(trace)
+        , start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~StageTimer()
+    {
+        SearchMetrics::instance().recordStage(stage_, std::chrono::steady_clock::now() - start_, trace_);
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+protected:
+    SearchStage stage_;
+    SearchTrace* trace_;
+    std::chrono::steady_clock::time_point start_;
+};
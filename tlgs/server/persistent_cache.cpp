@@ -0,0 +1,309 @@
+#include "persistent_cache.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <string_view>
+#include <xxhash.h>
+#include <trantor/utils/Logger.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static constexpr std::string_view file_magic = "TLGSRC01";
+static constexpr uint32_t format_version = 1;
+static constexpr size_t header_size = 8 + 4 + 4 + 8 + 8;
+static constexpr size_t index_entry_size = 16 + 8 + 8;
+
+static std::string queryKey(const std::string_view query)
+{
+    auto hash = XXH3_128bits(query.data(), query.size());
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash(&canonical, hash);
+    return std::string((const char*)canonical.digest, sizeof(canonical.digest));
+}
+
+namespace
+{
+/**
+ * @brief Bounds checked reader over a memory region
+ */
+struct Reader
+{
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+
+    template <typename T>
+    bool read(T& value)
+    {
+        if(size - pos < sizeof(T))
+            return false;
+        memcpy(&value, data+pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool read(std::string& value)
+    {
+        uint32_t len;
+        if(!read(len) || size - pos < len)
+            return false;
+        value.assign(data+pos, len);
+        pos += len;
+        return true;
+    }
+};
+
+struct Writer
+{
+    std::string buffer;
+
+    template <typename T>
+    void write(const T& value)
+    {
+        buffer.append((const char*)&value, sizeof(T));
+    }
+
+    void write(const std::string_view value)
+    {
+        write(uint32_t(value.size()));
+        buffer.append(value);
+    }
+};
+
+void writeResults(Writer& writer, const RankedResults& results)
+{
+    writer.write(uint32_t(results.size()));
+    for(const auto& result : results) {
+        writer.write(result.url);
+        writer.write(result.content_type);
+        writer.write(uint64_t(result.size));
+        writer.write(result.content_hash);
+        writer.write(result.score);
+    }
+}
+
+std::shared_ptr<RankedResults> readResults(Reader& reader)
+{
+    uint32_t count;
+    if(!reader.read(count))
+        return nullptr;
+    auto results = std::make_shared<RankedResults>();
+    results->reserve(std::min<size_t>(count, reader.size));
+    for(uint32_t i = 0; i < count; i++) {
+        RankedResult result;
+        uint64_t size;
+        bool good = reader.read(result.url) && reader.read(result.content_type) && reader.read(size)
+            && reader.read(result.content_hash) && reader.read(result.score);
+        if(!good)
+            return nullptr;
+        result.size = size;
+        results->emplace_back(std::move(result));
+    }
+    return results;
+}
+}
+
+std::string encodeRankedResults(const RankedResults& results)
+{
+    Writer writer;
+    writeResults(writer, results);
+    return std::move(writer.buffer);
+}
+
+std::shared_ptr<RankedResults> decodeRankedResults(std::string_view data)
+{
+    Reader reader{data.data(), data.size()};
+    return readResults(reader);
+}
+
+struct PersistentResultCache::Segment
+{
+    ~Segment()
+    {
+#ifndef _WIN32
+        if(data != nullptr)
+            munmap((void*)data, size);
+#endif
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> index;
+};
+
+bool PersistentResultCache::load(int64_t generation)
+{
+    if(!enabled())
+        return false;
+#ifdef _WIN32
+    LOG_WARN << "Persistent result cache is not supported on Windows";
+    return false;
+#else
+    int fd = open(path_.c_str(), O_RDONLY);
+    if(fd < 0) {
+        LOG_INFO << "No persistent result cache found at " << path_;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || size_t(st.st_size) < header_size) {
+        close(fd);
+        return false;
+    }
+    auto segment = std::make_shared<Segment>();
+    segment->size = st.st_size;
+    void* addr = mmap(nullptr, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        LOG_ERROR << "Failed to mmap persistent result cache " << path_;
+        return false;
+    }
+    segment->data = (const char*)addr;
+
+    Reader reader{segment->data, segment->size};
+    std::string_view magic(segment->data, file_magic.size());
+    reader.pos = file_magic.size();
+    uint32_t version;
+    uint32_t entry_count;
+    int64_t file_generation;
+    uint64_t index_offset;
+    reader.read(version);
+    reader.read(entry_count);
+    reader.read(file_generation);
+    reader.read(index_offset);
+    if(magic != file_magic || version != format_version) {
+        LOG_WARN << path_ << " is not a persistent result cache of a supported version. Ignoring it";
+        return false;
+    }
+    if(file_generation != generation) {
+        LOG_INFO << "Persistent result cache is computed against index generation " << file_generation
+            << " but the index is at " << generation << ". Ignoring it";
+        return false;
+    }
+    if(index_offset > segment->size || (segment->size - index_offset) / index_entry_size < entry_count) {
+        LOG_WARN << "Persistent result cache " << path_ << " is corrupted. Ignoring it";
+        return false;
+    }
+
+    reader.pos = index_offset;
+    segment->index.reserve(entry_count);
+    for(uint32_t i = 0; i < entry_count; i++) {
+        std::string key(segment->data+reader.pos, 16);
+        reader.pos += 16;
+        uint64_t offset;
+        uint64_t length;
+        reader.read(offset);
+        reader.read(length);
+        if(offset > index_offset || index_offset - offset < length)
+            continue;
+        segment->index.emplace(std::move(key), std::make_pair(offset, length));
+    }
+
+    LOG_INFO << "Mapped persistent result cache with " << segment->index.size() << " entries";
+    std::lock_guard lock(mutex_);
+    segment_ = std::move(segment);
+    return true;
+#endif
+}
+
+void PersistentResultCache::unload()
+{
+    std::lock_guard lock(mutex_);
+    segment_ = nullptr;
+}
+
+bool PersistentResultCache::contains(const std::string& query) const
+{
+    std::shared_ptr<const Segment> segment;
+    {
+        std::lock_guard lock(mutex_);
+        segment = segment_;
+    }
+    return segment != nullptr && segment->index.contains(queryKey(query));
+}
+
+std::shared_ptr<RankedResults> PersistentResultCache::find(const std::string& query) const
+{
+    std::shared_ptr<const Segment> segment;
+    {
+        std::lock_guard lock(mutex_);
+        segment = segment_;
+    }
+    if(segment == nullptr)
+        return nullptr;
+
+    auto it = segment->index.find(queryKey(query));
+    if(it == segment->index.end())
+        return nullptr;
+
+    auto [offset, length] = it->second;
+    Reader reader{segment->data+offset, length};
+    std::string stored_query;
+    // Guard against hash collisions
+    if(!reader.read(stored_query) || stored_query != query)
+        return nullptr;
+
+    auto results = readResults(reader);
+    if(results == nullptr)
+        LOG_WARN << "Corrupted entry in persistent result cache for `" << query << "`";
+    return results;
+}
+
+bool PersistentResultCache::snapshot(int64_t generation, const Entries& entries) const
+{
+    if(!enabled())
+        return false;
+
+    Writer writer;
+    writer.buffer.append(file_magic);
+    writer.write(format_version);
+    writer.write(uint32_t(entries.size()));
+    writer.write(generation);
+    writer.write(uint64_t{0}); // index offset. Filled in later
+
+    std::vector<std::tuple<std::string, uint64_t, uint64_t>> index;
+    index.reserve(entries.size());
+    for(const auto& [query, results] : entries) {
+        uint64_t offset = writer.buffer.size();
+        writer.write(query);
+        writeResults(writer, *results);
+        index.emplace_back(queryKey(query), offset, writer.buffer.size() - offset);
+    }
+
+    uint64_t index_offset = writer.buffer.size();
+    memcpy(writer.buffer.data() + header_size - sizeof(uint64_t), &index_offset, sizeof(index_offset));
+    for(const auto& [key, offset, length] : index) {
+        writer.buffer.append(key);
+        writer.write(offset);
+        writer.write(length);
+    }
+
+    const std::string tmp_path = path_ + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if(!out.is_open()) {
+            LOG_ERROR << "Cannot open " << tmp_path << " for writing";
+            return false;
+        }
+        out.write(writer.buffer.data(), writer.buffer.size());
+        if(!out.good()) {
+            LOG_ERROR << "Failed to write persistent result cache " << tmp_path;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path_, ec);
+    if(ec) {
+        LOG_ERROR << "Failed to replace " << path_ << ": " << ec.message();
+        return false;
+    }
+    LOG_DEBUG << "Wrote " << entries.size() << " entries (" << writer.buffer.size() << " bytes) to persistent result cache";
+    return true;
+}
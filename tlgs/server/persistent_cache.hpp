@@ -0,0 +1,97 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <string_view>
+
+#include "search_result.hpp"
+
+/**
+ * @brief On-disk copy of the search result cache. So the server does not start cold after a restart.
+ *
+ * The cache is a single file written as a whole by snapshot(). It holds the raw (unfiltered) ranked
+ * results of a set of queries and is tagged with the index generation it was computed against. load()
+ * memory maps the file and only reads the index. Entries are decoded when they are looked up.
+ *
+ * File layout (native endian, not meant to be portable between machines):
+ *   Header: magic "TLGSRC01", u32 format version, u32 entry count, i64 generation, u64 index offset
+ *   Entries: u32 query length, query, u32 result count, then for each result:
+ *            u32 url length, url, u32 content type length, content type, u64 size, u64 content hash, f32 score
+ *   Index: for each entry, 16 bytes XXH3-128 of the query, u64 offset and u64 length of the entry
+ */
+class PersistentResultCache
+{
+public:
+    using Entries = std::vector<std::pair<std::string, std::shared_ptr<const RankedResults>>>;
+
+    PersistentResultCache() = default;
+    PersistentResultCache(const PersistentResultCache&) = delete;
+    PersistentResultCache& operator=(const PersistentResultCache&) = delete;
+
+    void setPath(std::string path)
+    {
+        path_ = std::move(path);
+    }
+
+    const std::string& path() const
+    {
+        return path_;
+    }
+
+    bool enabled() const
+    {
+        return !path_.empty();
+    }
+
+    /**
+     * @brief Map the cache file. Does nothing if the file is missing, corrupted or computed against
+     * another index generation.
+     *
+     * @return true if the file is mapped
+     */
+    bool load(int64_t generation);
+    /**
+     * @brief Forget the mapped file. i.e. after the index changed
+     */
+    void unload();
+    /**
+     * @brief Look up the ranked results of a query
+     *
+     * @param query the search text (SearchQuery::text)
+     * @return nullptr if not found
+     */
+    std::shared_ptr<RankedResults> find(const std::string& query) const;
+    /**
+     * @brief Check if the cache might have the query. Without decoding the entry
+     */
+    bool contains(const std::string& query) const;
+    /**
+     * @brief Write the given results as the new cache file. Writes into a temporary file and renames it
+     * over the old one. So readers never see a partial file
+     *
+     * @note This function does blocking IO. Do not call it on the IO threads
+     */
+    bool snapshot(int64_t generation, const Entries& entries) const;
+
+protected:
+    struct Segment;
+    std::string path_;
+    mutable std::mutex mutex_;
+    std::shared_ptr<const Segment> segment_;
+};
+
+/**
+ * @brief Encode ranked results the same way entries of the persistent cache store them. For storing
+ * results elsewhere
+ */
+std::string encodeRankedResults(const RankedResults& results);
+/**
+ * @brief Decode results encoded by encodeRankedResults()
+ *
+ * @return nullptr if the data is corrupted
+ */
+std::shared_ptr<RankedResults> decodeRankedResults(std::string_view data);
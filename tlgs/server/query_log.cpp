@@ -0,0 +1,176 @@
+#include "query_log.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <unordered_map>
+#include <fmt/core.h>
+#include <trantor/utils/Logger.h>
+
+static constexpr std::string_view log_header = "timestamp\tinput\tquery\tfilters\tpage\tcache_status\tcomplete"
+    "\tparse_us\trank_us\tpreview_us\trender_us\ttotal_us\n";
+
+/**
+ * @brief Escape characters that would break a TSV line
+ */
+static std::string escapeTsv(const std::string_view str)
+{
+    std::string result;
+    result.reserve(str.size());
+    for(char ch : str) {
+        if(ch == '\\')
+            result += "\\\\";
+        else if(ch == '\t')
+            result += "\\t";
+        else if(ch == '\n')
+            result += "\\n";
+        else if(ch == '\r')
+            result += "\\r";
+        else
+            result += ch;
+    }
+    return result;
+}
+
+static std::string unescapeTsv(const std::string_view str)
+{
+    std::string result;
+    result.reserve(str.size());
+    for(size_t i = 0; i < str.size(); i++) {
+        if(str[i] != '\\' || i+1 == str.size()) {
+            result += str[i];
+            continue;
+        }
+        char ch = str[++i];
+        if(ch == 't')
+            result += '\t';
+        else if(ch == 'n')
+            result += '\n';
+        else if(ch == 'r')
+            result += '\r';
+        else
+            result += ch;
+    }
+    return result;
+}
+
+QueryLog::QueryLog(std::string path, size_t buffer_size)
+    : path_(std::move(path))
+    , buffer_(buffer_size)
+{
+    writer_ = std::thread([this]() {
+        writerLoop();
+    });
+}
+
+QueryLog::~QueryLog()
+{
+    {
+        std::lock_guard lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_one();
+    writer_.join();
+}
+
+void QueryLog::record(QueryLogEntry&& entry)
+{
+    if(!buffer_.tryPush(std::move(entry)))
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void QueryLog::writerLoop()
+{
+    std::error_code ec;
+    bool new_file = !std::filesystem::exists(path_, ec) || std::filesystem::file_size(path_, ec) == 0;
+    std::ofstream out(path_, std::ios::app);
+    if(!out.is_open())
+        LOG_ERROR << "Cannot open query log " << path_ << ". Queries will not be logged";
+    else if(new_file)
+        out << log_header;
+
+    size_t reported_dropped = 0;
+    bool running = true;
+    while(running) {
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return !running_; });
+            running = running_;
+        }
+
+        std::string lines;
+        QueryLogEntry entry;
+        while(buffer_.tryPop(entry)) {
+            lines += fmt::format("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\n", entry.timestamp, escapeTsv(entry.input)
+                , escapeTsv(entry.query), escapeTsv(entry.filters), entry.page, escapeTsv(entry.cache_status), int(entry.complete)
+                , entry.parse_us, entry.rank_us, entry.preview_us, entry.render_us, entry.total_us);
+        }
+        if(!lines.empty() && out.is_open()) {
+            out << lines;
+            out.flush();
+        }
+
+        size_t dropped = droppedCount();
+        if(dropped != reported_dropped) {
+            LOG_WARN << "Query log can't keep up. " << dropped - reported_dropped << " entries dropped";
+            reported_dropped = dropped;
+        }
+    }
+}
+
+std::vector<std::string> QueryLog::topQueries(const std::string& path, size_t n, size_t max_bytes)
+{
+    std::ifstream in(path);
+    if(!in.is_open() || n == 0)
+        return {};
+
+    in.seekg(0, std::ios::end);
+    size_t size = in.tellg();
+    in.seekg(size > max_bytes ? size - max_bytes : 0);
+    std::string line;
+    // We likely landed in the middle of a line
+    if(size > max_bytes)
+        std::getline(in, line);
+
+    // Counted by the canonical query. The parsed columns of the log. So equivalent spellings are counted as
+    // one query. The first input seen represents it
+    struct Count
+    {
+        std::string input;
+        size_t count = 0;
+    };
+    std::unordered_map<std::string, Count> counts;
+    while(std::getline(in, line)) {
+        if(line.empty() || line.starts_with("timestamp\t"))
+            continue;
+        std::string_view columns[4];
+        size_t begin = 0;
+        size_t num_columns = 0;
+        for(; num_columns < 4 && begin <= line.size(); num_columns++) {
+            auto end = std::min(line.find('\t', begin), line.size());
+            columns[num_columns] = std::string_view(line).substr(begin, end - begin);
+            begin = end + 1;
+        }
+        if(num_columns < 4 || columns[1].empty() || columns[2].empty())
+            continue;
+        auto& count = counts[fmt::format("{}\t{}", columns[2], columns[3])];
+        if(count.count++ == 0)
+            count.input = unescapeTsv(columns[1]);
+    }
+
+    std::vector<Count> sorted;
+    sorted.reserve(counts.size());
+    for(auto& [_, count] : counts)
+        sorted.emplace_back(std::move(count));
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.count != b.count ? a.count > b.count : a.input < b.input;
+    });
+    if(sorted.size() > n)
+        sorted.resize(n);
+
+    std::vector<std::string> result;
+    result.reserve(sorted.size());
+    for(auto& count : sorted)
+        result.emplace_back(std::move(count.input));
+    return result;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+
+#include <tlgsutils/ring_buffer.hpp>
+
+/**
+ * @brief A search request as recorded in the query log. Latencies are in microseconds
+ */
+struct QueryLogEntry
+{
+    int64_t timestamp; // microseconds since epoch
+    std::string input; // what the user typed
+    std::string query; // SearchQuery::text
+    std::string filters; // canonical filters. The part of SearchQuery::canonical after the text
+    size_t page;
+    std::string cache_status;
+    bool complete;
+    uint32_t parse_us;
+    uint32_t rank_us;
+    uint32_t preview_us;
+    uint32_t render_us;
+    uint32_t total_us;
+};
+
+/**
+ * @brief Asynchronous query log. Request handlers push entries into a lock-free ring buffer and a
+ * background thread appends them to a TSV file. Entries are dropped (and counted) when the writer
+ * can't keep up. Logging never blocks a request.
+ */
+class QueryLog
+{
+public:
+    QueryLog(std::string path, size_t buffer_size);
+    ~QueryLog();
+    QueryLog(const QueryLog&) = delete;
+    QueryLog& operator=(const QueryLog&) = delete;
+
+    void record(QueryLogEntry&& entry);
+
+    const std::string& path() const
+    {
+        return path_;
+    }
+
+    size_t droppedCount() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief The most frequent search queries in a query log. Most frequent first. Inputs parsed into the
+     * same query (and filters) count as one
+     *
+     * @param path the log file
+     * @param n max number of inputs to return
+     * @param max_bytes only the last max_bytes of the log are read
+     * @note This function does blocking IO
+     */
+    static std::vector<std::string> topQueries(const std::string& path, size_t n, size_t max_bytes = 64*1024*1024);
+
+protected:
+    void writerLoop();
+
+    std::string path_;
+    tlgs::RingBuffer<QueryLogEntry> buffer_;
+    std::atomic<size_t> dropped_{0};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = true;
+    std::thread writer_;
+};
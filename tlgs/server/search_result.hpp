@@ -1,6 +1,20 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdint>
+
+struct RankedResult
+{
+    std::string url;
+    std::string content_type;
+    size_t size;
+    uint64_t content_hash;
+    float score;
+};
+
+using RankedResults = std::vector<RankedResult>;
+
 struct SearchResult
 {
     std::string url;
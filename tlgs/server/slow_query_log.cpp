@@ -0,0 +1,116 @@
+#include "slow_query_log.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <fmt/core.h>
+#include <trantor/utils/Date.h>
+#include <trantor/utils/Logger.h>
+
+// Blocks not yet written when the disk falls this far behind are dropped
+static constexpr size_t max_pending_blocks = 1024;
+
+static std::string formatTimestamp(int64_t timestamp)
+{
+    return trantor::Date(timestamp).toCustomedFormattedString("%Y-%m-%d %H:%M:%S", true);
+}
+
+SlowQueryLog::SlowQueryLog(std::string path, double explain_interval)
+    : path_(std::move(path))
+    , explain_bucket_(1.0 / std::max(explain_interval, 1.0), 1)
+{
+    writer_ = std::thread([this]() {
+        writerLoop();
+    });
+}
+
+SlowQueryLog::~SlowQueryLog()
+{
+    {
+        std::lock_guard lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_one();
+    writer_.join();
+}
+
+void SlowQueryLog::record(const SlowQuery& query)
+{
+    const auto& trace = query.trace;
+    std::string block = fmt::format("[{}] {:.3f}s `{}` cache: {} tier: {} complete: {}\n", formatTimestamp(query.timestamp)
+        , query.total_us / 1e6, query.input, query.cache_status.empty() ? "(miss)" : query.cache_status, query.tier
+        , query.complete);
+    if(trace.searched)
+        block += fmt::format("  root set: {} pages, base set: {} pages\n", trace.root_set_size, trace.base_set_size);
+    for(size_t i = 0; i < search_stage_count; i++) {
+        if(trace.stage_us[i] != 0)
+            block += fmt::format("  {}: {:.3f}ms\n", search_stage_names[i], trace.stage_us[i] / 1000.0);
+    }
+    for(const auto& [term, us] : trace.term_sql_us)
+        block += fmt::format("  term_sql {}: {:.3f}ms\n", term, us / 1000.0);
+    write(std::move(block));
+}
+
+void SlowQueryLog::recordPlan(int64_t timestamp, std::string_view input, std::string_view term, std::string_view statement,
+    std::string_view plan)
+{
+    std::string block = fmt::format("[{}] plan of the {} statement of `{}` for term {}\n", formatTimestamp(timestamp)
+        , statement, input, term);
+    size_t begin = 0;
+    while(begin < plan.size()) {
+        auto end = std::min(plan.find('\n', begin), plan.size());
+        block += fmt::format("  | {}\n", plan.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    write(std::move(block));
+}
+
+bool SlowQueryLog::tryStartExplain()
+{
+    std::lock_guard lock(mutex_);
+    if(explaining_ || !explain_bucket_.tryConsume(1))
+        return false;
+    explaining_ = true;
+    return true;
+}
+
+void SlowQueryLog::finishExplain()
+{
+    std::lock_guard lock(mutex_);
+    explaining_ = false;
+}
+
+void SlowQueryLog::write(std::string block)
+{
+    {
+        std::lock_guard lock(mutex_);
+        if(pending_.size() >= max_pending_blocks)
+            return;
+        pending_.push_back(std::move(block));
+    }
+    cv_.notify_one();
+}
+
+void SlowQueryLog::writerLoop()
+{
+    std::ofstream out(path_, std::ios::app);
+    if(!out.is_open())
+        LOG_ERROR << "Cannot open slow query log " << path_ << ". Slow queries will not be logged";
+
+    while(true) {
+        std::deque<std::string> blocks;
+        bool running;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this]() { return !running_ || !pending_.empty(); });
+            blocks.swap(pending_);
+            running = running_;
+        }
+        if(out.is_open()) {
+            for(const auto& block : blocks)
+                out << block << '\n';
+            out.flush();
+        }
+        if(!running)
+            break;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <string_view>
+#include <condition_variable>
+
+#include <tlgsutils/token_bucket.hpp>
+
+#include "metrics.hpp"
+
+/**
+ * @brief A search request that took longer than the slow query threshold
+ */
+struct SlowQuery
+{
+    int64_t timestamp; // microseconds since epoch
+    std::string input;
+    std::string cache_status;
+    std::string_view tier;
+    bool complete;
+    uint64_t total_us;
+    SearchTrace trace;
+};
+
+/**
+ * @brief Log of slow search requests and the query plans of their SQL statements. Entries are written
+ * by a background thread. Plans are captured at most once per `explain_interval` seconds since EXPLAIN
+ * ANALYZE runs the (slow) statement again.
+ */
+class SlowQueryLog
+{
+public:
+    SlowQueryLog(std::string path, double explain_interval);
+    ~SlowQueryLog();
+    SlowQueryLog(const SlowQueryLog&) = delete;
+    SlowQueryLog& operator=(const SlowQueryLog&) = delete;
+
+    void record(const SlowQuery& query);
+    /**
+     * @brief Record the plan of a statement of a slow query. `timestamp` identifies the query
+     */
+    void recordPlan(int64_t timestamp, std::string_view input, std::string_view term, std::string_view statement,
+        std::string_view plan);
+
+    /**
+     * @brief Whether a plan may be captured now. Only one capture runs at a time. Call finishExplain() after
+     * the capture if this returns true
+     */
+    bool tryStartExplain();
+    void finishExplain();
+
+protected:
+    void write(std::string block);
+    void writerLoop();
+
+    std::string path_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::string> pending_;
+    bool running_ = true;
+    tlgs::TokenBucket explain_bucket_;
+    bool explaining_ = false;
+    std::thread writer_;
+};
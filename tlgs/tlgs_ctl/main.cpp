@@ -37,6 +37,9 @@ Task<> createDb()
 			PRIMARY KEY (url)
 		);
 	)");
+	// How often the content changed since it is first seen. For adapting the recrawl interval
+	co_await db->execSqlCoro("ALTER TABLE public.pages ADD COLUMN IF NOT EXISTS change_count integer DEFAULT 0 NOT NULL;");
+	co_await db->execSqlCoro("ALTER TABLE public.pages ADD COLUMN IF NOT EXISTS observed_since timestamp without time zone;");
 	co_await db->execSqlCoro("CREATE INDEX IF NOT EXISTS last_crawled_index ON public.pages USING btree (last_crawled_at DESC);");
 	co_await db->execSqlCoro("CREATE INDEX IF NOT EXISTS search_vector_index ON public.pages USING gin (search_vector);");
 
@@ -73,6 +76,64 @@ Task<> createDb()
 			PRIMARY KEY (host, port)
 		);
 	)");
+	co_await db->execSqlCoro("ALTER TABLE public.robot_policies_status ADD COLUMN IF NOT EXISTS crawl_delay real;");
+
+	co_await db->execSqlCoro(R"(
+		CREATE TABLE IF NOT EXISTS public.host_health (
+			host text NOT NULL,
+			port integer NOT NULL,
+			failure_score real DEFAULT 0 NOT NULL,
+			scored_at timestamp without time zone NOT NULL,
+			latency real DEFAULT 0 NOT NULL,
+			open_until timestamp without time zone,
+			backoff real DEFAULT 0 NOT NULL,
+			PRIMARY KEY (host, port)
+		);
+	)");
+
+	co_await db->execSqlCoro(R"(
+		CREATE TABLE IF NOT EXISTS public.crawl_queue (
+			url text NOT NULL REFERENCES public.pages (url) ON DELETE CASCADE,
+			due_at timestamp without time zone NOT NULL,
+			priority real DEFAULT 0 NOT NULL,
+			PRIMARY KEY (url)
+		);
+	)");
+	co_await db->execSqlCoro("CREATE INDEX IF NOT EXISTS crawl_queue_due_index ON public.crawl_queue USING btree (due_at, priority DESC);");
+	// Page importance (OPIC). Queues created before it start every page with 1 cash
+	co_await db->execSqlCoro("ALTER TABLE public.crawl_queue ADD COLUMN IF NOT EXISTS cash double precision DEFAULT 1 NOT NULL, "
+		"ADD COLUMN IF NOT EXISTS history double precision DEFAULT 0 NOT NULL, ALTER COLUMN priority SET DEFAULT 1;");
+	co_await db->execSqlCoro("UPDATE public.crawl_queue SET priority = history + cash WHERE priority = 0;");
+	// Crawlers claim the due pages of their shard by this hash of the host
+	co_await db->execSqlCoro("ALTER TABLE public.crawl_queue ADD COLUMN IF NOT EXISTS host_hash integer;");
+	co_await db->execSqlCoro("UPDATE public.crawl_queue SET host_hash = hashtext(pages.domain_name || ':' || pages.port) "
+		"FROM public.pages WHERE pages.url = crawl_queue.url AND crawl_queue.host_hash IS NULL;");
+	co_await db->execSqlCoro("ALTER TABLE public.crawl_queue ALTER COLUMN host_hash SET NOT NULL;");
+	// Claims read due pages in due order and sort them by priority. This index is no longer used
+	co_await db->execSqlCoro("DROP INDEX IF EXISTS public.crawl_queue_priority_index;");
+	// Queue pages crawled before the queue existed
+	co_await db->execSqlCoro("INSERT INTO public.crawl_queue (url, due_at, host_hash) SELECT url, "
+		"COALESCE(last_crawled_at + INTERVAL '3' DAY, CURRENT_TIMESTAMP), hashtext(domain_name || ':' || port) "
+		"FROM public.pages ON CONFLICT DO NOTHING;");
+
+	co_await db->execSqlCoro(R"(
+		CREATE TABLE IF NOT EXISTS public.crawl_runs (
+			id bigserial NOT NULL,
+			started_at timestamp without time zone NOT NULL,
+			finished_at timestamp without time zone,
+			PRIMARY KEY (id)
+		);
+	)");
+
+	co_await db->execSqlCoro(R"(
+		CREATE TABLE IF NOT EXISTS public.precomputed_results (
+			query text NOT NULL,
+			generation bigint NOT NULL,
+			results text NOT NULL,
+			computed_at timestamp without time zone NOT NULL,
+			PRIMARY KEY (query)
+		);
+	)");
 	app().quit();
 }
 
@@ -91,8 +152,8 @@ Task<> indexStatus()
 	auto db = app().getDbClient();
 	auto domain_pages = co_await db->execSqlCoro("SELECT COUNT(DISTINCT LOWER(domain_name)) AS domain_count, COUNT(*) AS count "
 		"FROM pages WHERE content_body IS NOT NULL");
-	auto pages_need_update = co_await db->execSqlCoro("SELECT COUNT(*) AS count FROM pages WHERE "
-		"last_crawled_at < CURRENT_TIMESTAMP - INTERVAL '3' DAY OR last_crawled_at IS NULL");
+	auto pages_need_update = co_await db->execSqlCoro("SELECT COUNT(*) AS count FROM crawl_queue WHERE "
+		"due_at <= CURRENT_TIMESTAMP");
 	std::cout << domain_pages[0]["domain_count"].as<size_t>() << " domains in index\n";
 	std::cout << domain_pages[0]["count"].as<size_t>() << " pages in index\n";
 	std::cout << pages_need_update[0]["count"].as<size_t>() << " pages need update\n";
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+namespace tlgs
+{
+
+/**
+ * @brief Additive-increase/multiplicative-decrease controller of the number of concurrent fetches. Decides
+ * once per window. The window is congested if the DB write backlog is over its limit, too many fetches time
+ * out, or fetches take much longer than usual (the baseline latency). A congested window cuts the limit by
+ * the decrease factor, then the next window is skipped so fetches started under the old limit drain. A
+ * window that wanted more slots than the limit allowed raises it by one. Before the first congestion the
+ * limit doubles instead (slow start).
+ *
+ * The backlog is sampled by the caller when a window ends. It should count work the DB has not finished
+ * yet, not fetches that will write later. Otherwise it grows with the limit itself and caps it.
+ *
+ * @note There is no locking. Slots are taken and released on the crawler's event loop only
+ */
+class AimdController
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @param min_limit the limit never goes below this. It is also where the limit starts
+     * @param max_limit the limit never goes above this
+     */
+    AimdController(size_t min_limit = 1, size_t max_limit = 1, Clock::duration window = std::chrono::seconds(5),
+        Clock::time_point now = Clock::now())
+        : window_(window)
+        , window_start_(now)
+    {
+        setLimits(min_limit, max_limit);
+        limit_ = min_;
+    }
+
+    /**
+     * @brief Take a slot to fetch with. Refused if all slots are taken. Which counts as wanting more slots
+     */
+    bool tryAcquire()
+    {
+        if(active_ >= limit_) {
+            limited_ = true;
+            return false;
+        }
+        active_++;
+        return true;
+    }
+
+    void release()
+    {
+        if(active_ != 0)
+            active_--;
+    }
+
+    /**
+     * @brief Record a finished fetch
+     *
+     * @param latency seconds the fetch took. Ignored if it timed out
+     */
+    void recordFetch(double latency, bool timed_out)
+    {
+        fetches_++;
+        if(timed_out) {
+            timeouts_++;
+            return;
+        }
+        latency_sum_ += latency;
+    }
+
+    /**
+     * @brief Adjust the limit if the window is over
+     *
+     * @param backlog number of DB statements queued or running now
+     * @return true if the limit changed
+     */
+    bool update(size_t backlog, Clock::time_point now = Clock::now())
+    {
+        if(now - window_start_ < window_)
+            return false;
+        window_start_ = now;
+        size_t old_limit = limit_;
+
+        bool congested = backlog > max_backlog_;
+        size_t completed = fetches_ - timeouts_;
+        if(fetches_ >= min_samples_ && double(timeouts_) / fetches_ > max_timeout_rate_)
+            congested = true;
+        if(completed >= min_samples_) {
+            double latency = latency_sum_ / completed;
+            if(baseline_latency_ > 0 && latency > baseline_latency_ * latency_tolerance_)
+                congested = true;
+            // The baseline follows the fastest windows at once and slower ones slowly. So it adapts to the hosts
+            // being crawled but not to the crawler overloading itself
+            if(baseline_latency_ == 0 || latency < baseline_latency_)
+                baseline_latency_ = latency;
+            else if(!congested)
+                baseline_latency_ += (latency - baseline_latency_) * 0.1;
+        }
+
+        if(cooling_down_)
+            cooling_down_ = false;
+        else if(congested) {
+            limit_ = std::max(min_, size_t(limit_ * decrease_factor_));
+            slow_start_ = false;
+            cooling_down_ = true;
+        }
+        else if(limited_)
+            limit_ = std::min(max_, slow_start_ ? limit_ * 2 : limit_ + 1);
+
+        fetches_ = 0;
+        timeouts_ = 0;
+        latency_sum_ = 0;
+        limited_ = false;
+        return limit_ != old_limit;
+    }
+
+    size_t limit() const
+    {
+        return limit_;
+    }
+
+    /**
+     * @brief Number of slots taken
+     */
+    size_t active() const
+    {
+        return active_;
+    }
+
+    /**
+     * @brief Usual seconds a fetch takes. 0 if not known yet
+     */
+    double baselineLatency() const
+    {
+        return baseline_latency_;
+    }
+
+    void setLimits(size_t min_limit, size_t max_limit)
+    {
+        min_ = std::max<size_t>(min_limit, 1);
+        max_ = std::max(min_, max_limit);
+        limit_ = std::clamp(limit_, min_, max_);
+    }
+
+    /**
+     * @brief The window is congested if the DB write backlog is larger than this
+     */
+    void setMaxBacklog(size_t backlog)
+    {
+        max_backlog_ = backlog;
+    }
+
+    /**
+     * @brief The window is congested if more than this fraction of fetches time out
+     */
+    void setMaxTimeoutRate(double rate)
+    {
+        max_timeout_rate_ = rate;
+    }
+
+    /**
+     * @brief The window is congested if fetches take longer than this times the baseline latency
+     */
+    void setLatencyTolerance(double tolerance)
+    {
+        latency_tolerance_ = tolerance;
+    }
+
+    /**
+     * @brief The limit is multiplied by this when the window is congested
+     */
+    void setDecreaseFactor(double factor)
+    {
+        decrease_factor_ = factor;
+    }
+
+    /**
+     * @brief Windows with fewer fetches than this don't judge timeouts and latency
+     */
+    void setMinSamples(size_t n)
+    {
+        min_samples_ = std::max<size_t>(n, 1);
+    }
+
+protected:
+    size_t min_ = 1;
+    size_t max_ = 1;
+    size_t limit_ = 1;
+    size_t active_ = 0;
+    Clock::duration window_;
+    Clock::time_point window_start_;
+
+    // The current window
+    size_t fetches_ = 0;
+    size_t timeouts_ = 0;
+    double latency_sum_ = 0;
+    bool limited_ = false;
+
+    double baseline_latency_ = 0;
+    bool slow_start_ = true;
+    bool cooling_down_ = false;
+
+    size_t max_backlog_ = 32;
+    double max_timeout_rate_ = 0.25;
+    double latency_tolerance_ = 2;
+    double decrease_factor_ = 0.5;
+    size_t min_samples_ = 10;
+};
+
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+namespace tlgs
+{
+
+/**
+ * @brief HDR style log-linear histogram of non-negative integers. Each power of 2 is split into
+ * `sub_buckets` linear buckets. So the relative error of any recorded value is below 1/sub_buckets.
+ * Recording is a single relaxed atomic increment. Lock free and safe from any thread.
+ */
+class Histogram
+{
+public:
+    static constexpr size_t sub_bucket_bits = 3;
+    static constexpr size_t sub_buckets = 1 << sub_bucket_bits;
+    // Values >= 2^max_exponent are clamped into the last bucket
+    static constexpr size_t max_exponent = 40;
+    static constexpr size_t bucket_count = (max_exponent - sub_bucket_bits + 1) * sub_buckets;
+
+    /**
+     * @brief A point in time copy of the histogram. Can be merged and queried
+     */
+    struct Snapshot
+    {
+        std::array<uint64_t, bucket_count> counts{};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        void merge(const Snapshot& other)
+        {
+            for(size_t i = 0; i < bucket_count; i++)
+                counts[i] += other.counts[i];
+            count += other.count;
+            sum += other.sum;
+        }
+
+        /**
+         * @brief The (upper bound of the bucket of the) value at quantile q. 0 if empty
+         */
+        uint64_t valueAtQuantile(double q) const
+        {
+            if(count == 0)
+                return 0;
+            uint64_t rank = std::max<uint64_t>(1, uint64_t(std::clamp(q, 0.0, 1.0) * count + 0.5));
+            uint64_t seen = 0;
+            for(size_t i = 0; i < bucket_count; i++) {
+                seen += counts[i];
+                if(seen >= rank)
+                    return bucketUpperBound(i);
+            }
+            return bucketUpperBound(bucket_count - 1);
+        }
+    };
+
+    void record(uint64_t value)
+    {
+        counts_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot result;
+        for(size_t i = 0; i < bucket_count; i++)
+            result.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        result.count = count_.load(std::memory_order_relaxed);
+        result.sum = sum_.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    static size_t bucketIndex(uint64_t value)
+    {
+        if(value < sub_buckets)
+            return value;
+        size_t exponent = std::bit_width(value) - 1;
+        if(exponent >= max_exponent)
+            return bucket_count - 1;
+        size_t sub_bucket = (value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+        return (exponent - sub_bucket_bits + 1) * sub_buckets + sub_bucket;
+    }
+
+    /**
+     * @brief The largest value that goes into the bucket
+     */
+    static uint64_t bucketUpperBound(size_t index)
+    {
+        if(index < sub_buckets)
+            return index;
+        size_t exponent = index / sub_buckets + sub_bucket_bits - 1;
+        size_t sub_bucket = index % sub_buckets;
+        uint64_t lower = (uint64_t{1} << exponent) + (uint64_t(sub_bucket) << (exponent - sub_bucket_bits));
+        return lower + (uint64_t{1} << (exponent - sub_bucket_bits)) - 1;
+    }
+
+protected:
+    std::array<std::atomic<uint64_t>, bucket_count> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+};
+
+/**
+ * @brief A histogram split into shards. Each thread records into its own shard so threads don't fight
+ * over the same cache lines. Shards are merged when reading.
+ */
+class ShardedHistogram
+{
+public:
+    static constexpr size_t shard_count = 16;
+
+    ShardedHistogram()
+        : shards_(std::make_unique<Shard[]>(shard_count))
+    {
+    }
+
+    void record(uint64_t value)
+    {
+        shards_[threadSlot() % shard_count].histogram.record(value);
+    }
+
+    Histogram::Snapshot snapshot() const
+    {
+        Histogram::Snapshot result;
+        for(size_t i = 0; i < shard_count; i++)
+            result.merge(shards_[i].histogram.snapshot());
+        return result;
+    }
+
+protected:
+    struct alignas(64) Shard
+    {
+        Histogram histogram;
+    };
+
+    static size_t threadSlot()
+    {
+        static std::atomic<size_t> next_slot{0};
+        thread_local size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+        return slot;
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+};
+
+}
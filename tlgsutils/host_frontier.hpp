@@ -0,0 +1,291 @@
+#pragma once
+
+#include <queue>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <utility>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace tlgs
+{
+
+/**
+ * @brief Crawl frontier that keeps the crawler polite. URLs are queued per host, the most important
+ * first (FIFO among equally important ones). A host is handed out by pop() and is busy until release()
+ * is called, then it waits for its delay before it is handed out again. So each host sees at most one
+ * request at a time and hosts that became ready first go first.
+ *
+ * The number of queued URLs is bounded, in total and per host. push() refuses URLs past that and the
+ * caller keeps them elsewhere (i.e. the DB). Hosts with nothing queued are forgotten once their delay
+ * passed, so memory follows the queued URLs and not every host ever seen. A URL already queued or being
+ * fetched is not queued again. i.e. when the caller hands out the same URL twice.
+ *
+ * Hosts can be marked slow. Slow hosts wait in their own lane, so the caller can cap how many of them are
+ * busy at once by leaving them out of pop().
+ *
+ * @note There is no locking. The crawler owns one per event loop and only touches it from that loop
+ */
+class HostFrontier
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    HostFrontier(size_t max_size = 10000, size_t max_per_host = 200,
+        Clock::duration default_delay = std::chrono::seconds(1))
+        : max_size_(max_size)
+        , max_per_host_(max_per_host)
+        , default_delay_(default_delay)
+    {
+    }
+
+    /**
+     * @brief Queue a URL of a host
+     *
+     * @param priority importance of the URL. URLs of the same host with higher priority are handed out first
+     * @return false if the frontier or the queue of the host is full. The URL is not queued. true if the URL
+     * is queued or already was (or is being fetched)
+     */
+    bool push(const std::string& host, std::string url, double priority = 0, Clock::time_point now = Clock::now())
+    {
+        collectIdle(now);
+        if(size_ >= max_size_)
+            return false;
+        auto it = hosts_.find(host);
+        if(it == hosts_.end())
+            it = hosts_.emplace(host, HostState{{}, now, default_delay_}).first;
+        auto& state = it->second;
+        if(state.known.contains(url))
+            return true;
+        if(state.urls.size() >= max_per_host_)
+            return false;
+        state.known.insert(url);
+        state.urls.push(QueuedUrl{priority, next_seq_++, std::move(url)});
+        size_++;
+        schedule(it->first, state);
+        return true;
+    }
+
+    /**
+     * @brief Take the next URL of the host that became ready first. The host is busy until release()
+     *
+     * @param allow_slow whether slow hosts can be taken
+     * @return the host and the URL. std::nullopt if no host is ready
+     */
+    std::optional<std::pair<std::string, std::string>> pop(Clock::time_point now = Clock::now(), bool allow_slow = true)
+    {
+        collectIdle(now);
+        MinHeap* ready = nullptr;
+        for(size_t lane = 0; lane < (allow_slow ? 2 : 1); lane++) {
+            if(!ready_[lane].empty() && (ready == nullptr || ready_[lane].top() < ready->top()))
+                ready = &ready_[lane];
+        }
+        if(ready == nullptr || ready->top().first > now)
+            return std::nullopt;
+        auto host = ready->top().second;
+        ready->pop();
+        auto& state = hosts_.at(host);
+        state.scheduled = false;
+        state.busy = true;
+        state.busy_slow = state.slow;
+        busy_++;
+        busy_slow_ += state.slow;
+        // Entries are ordered by priority and seq only. So the URL can be moved out before the entry is removed
+        auto url = std::move(const_cast<QueuedUrl&>(state.urls.top()).url);
+        state.urls.pop();
+        size_--;
+        state.fetching = url;
+        return std::make_pair(std::move(host), std::move(url));
+    }
+
+    /**
+     * @brief The request to the host handed out by pop() is done. The host is ready again after its delay
+     */
+    void release(const std::string& host, Clock::time_point now = Clock::now())
+    {
+        auto it = hosts_.find(host);
+        if(it == hosts_.end() || it->second.busy == false)
+            return;
+        auto& state = it->second;
+        state.known.erase(state.fetching);
+        state.fetching.clear();
+        state.busy = false;
+        busy_--;
+        busy_slow_ -= state.busy_slow;
+        state.busy_slow = false;
+        state.ready_at = now + state.delay;
+        if(state.urls.empty())
+            idle_.emplace(state.ready_at, it->first);
+        else
+            schedule(it->first, state);
+    }
+
+    /**
+     * @brief Set the delay between requests to a known host. i.e. the Crawl-delay in its robots.txt
+     */
+    void setDelay(const std::string& host, Clock::duration delay)
+    {
+        auto it = hosts_.find(host);
+        if(it != hosts_.end())
+            it->second.delay = delay;
+    }
+
+    /**
+     * @brief Mark the host slow or not. Takes effect the next time the host waits to become ready. i.e. set
+     * it while the host is busy
+     */
+    void setSlow(const std::string& host, bool slow)
+    {
+        auto it = hosts_.find(host);
+        if(it != hosts_.end())
+            it->second.slow = slow;
+    }
+
+    /**
+     * @brief When the next waiting host becomes ready. std::nullopt if no host is waiting. i.e. all hosts
+     * with queued URLs are busy
+     *
+     * @param allow_slow whether to consider slow hosts
+     */
+    std::optional<Clock::time_point> nextReadyTime(bool allow_slow = true) const
+    {
+        std::optional<Clock::time_point> next;
+        for(size_t lane = 0; lane < (allow_slow ? 2 : 1); lane++) {
+            if(!ready_[lane].empty() && (!next.has_value() || ready_[lane].top().first < *next))
+                next = ready_[lane].top().first;
+        }
+        return next;
+    }
+
+    /**
+     * @brief Number of queued URLs. Not counting the ones handed out
+     */
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    bool full() const
+    {
+        return size_ >= max_size_;
+    }
+
+    /**
+     * @brief Number of URLs that can be queued before the frontier is full. Hosts may fill up before that
+     */
+    size_t room() const
+    {
+        return full() ? 0 : max_size_ - size_;
+    }
+
+    /**
+     * @brief Number of hosts the frontier knows. Including busy hosts and hosts waiting for their delay
+     */
+    size_t hosts() const
+    {
+        return hosts_.size();
+    }
+
+    size_t busyHosts() const
+    {
+        return busy_;
+    }
+
+    /**
+     * @brief Number of busy hosts that were slow when they were handed out
+     */
+    size_t busySlowHosts() const
+    {
+        return busy_slow_;
+    }
+
+    void setMaxSize(size_t max_size)
+    {
+        max_size_ = max_size;
+    }
+
+    void setDefaultDelay(Clock::duration delay)
+    {
+        default_delay_ = delay;
+    }
+
+protected:
+    struct QueuedUrl
+    {
+        double priority;
+        uint64_t seq;
+        std::string url;
+
+        bool operator<(const QueuedUrl& other) const
+        {
+            if(priority != other.priority)
+                return priority < other.priority;
+            return seq > other.seq;
+        }
+    };
+
+    struct HostState
+    {
+        std::priority_queue<QueuedUrl> urls;
+        Clock::time_point ready_at;
+        Clock::duration delay;
+        // The queued URLs and the one being fetched
+        std::unordered_set<std::string> known;
+        std::string fetching;
+        bool busy = false;
+        // In ready_. A host is there iff it is not busy and has URLs queued
+        bool scheduled = false;
+        bool slow = false;
+        // Counted in busy_slow_
+        bool busy_slow = false;
+    };
+    using HeapEntry = std::pair<Clock::time_point, std::string>;
+    using MinHeap = std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>>;
+
+    void schedule(const std::string& host, HostState& state)
+    {
+        if(state.busy || state.scheduled)
+            return;
+        state.scheduled = true;
+        ready_[state.slow].emplace(state.ready_at, host);
+    }
+
+    /**
+     * @brief Forget hosts with nothing queued once their delay passed. They are as good as new hosts
+     */
+    void collectIdle(Clock::time_point now)
+    {
+        while(!idle_.empty() && idle_.top().first <= now) {
+            auto [ready_at, host] = idle_.top();
+            idle_.pop();
+            auto it = hosts_.find(host);
+            // Stale if the host is used again since it went idle
+            if(it == hosts_.end() || it->second.busy || !it->second.urls.empty() || it->second.ready_at != ready_at)
+                continue;
+            hosts_.erase(it);
+        }
+    }
+
+    std::unordered_map<std::string, HostState> hosts_;
+    // Normal and slow hosts waiting to become ready
+    MinHeap ready_[2];
+    MinHeap idle_;
+    size_t size_ = 0;
+    size_t busy_ = 0;
+    size_t busy_slow_ = 0;
+    uint64_t next_seq_ = 0;
+    size_t max_size_;
+    size_t max_per_host_;
+    Clock::duration default_delay_;
+};
+
+}
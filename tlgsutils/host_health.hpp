@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+
+namespace tlgs
+{
+
+/**
+ * @brief How well a host responds. Failures (timeouts, unreachable) add to a score that halves every
+ * failure_half_life. The circuit opens once the score reaches trip_score and the host is left alone for a
+ * backoff. After that the circuit is half-open: the next fetch is a probe. Success closes the circuit,
+ * failure opens it again with twice the backoff. Fetch latency is tracked as a moving average to tell slow
+ * hosts apart.
+ *
+ * A plain value, copied in and out of caches rather than shared. It is stored as numbers relative to now
+ * and rebuilt with restore(). So an open circuit survives restarts and is seen by other crawlers.
+ */
+class HostHealth
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr double failure_half_life = 6 * 3600;
+    static constexpr double trip_score = 3;
+    static constexpr double min_backoff = 3600;
+    static constexpr double max_backoff = 7 * 24 * 3600;
+    // Weight of the latest fetch in the latency average
+    static constexpr double latency_weight = 0.3;
+    // Hosts taking longer than this on average are slow
+    static constexpr double slow_latency = 5;
+
+    HostHealth(Clock::time_point now = Clock::now())
+        : scored_at_(now)
+    {
+    }
+
+    /**
+     * @brief Rebuild a state stored earlier. Times are relative to now
+     *
+     * @param failure_score the score when it was stored
+     * @param score_age seconds since the score was stored
+     * @param latency average fetch latency. 0 if unknown
+     * @param open_for seconds until the circuit is half-open. std::nullopt if it is closed. Negative if it is
+     * half-open already
+     * @param backoff seconds the circuit was opened for the last time. 0 if it is closed
+     */
+    static HostHealth restore(double failure_score, double score_age, double latency, std::optional<double> open_for,
+        double backoff, Clock::time_point now = Clock::now())
+    {
+        HostHealth health(now);
+        health.score_ = failure_score * decay(std::max(score_age, 0.0));
+        health.latency_ = latency;
+        if(open_for.has_value())
+            health.open_until_ = now + toDuration(*open_for);
+        health.backoff_ = backoff;
+        return health;
+    }
+
+    void recordSuccess(double latency, Clock::time_point now = Clock::now())
+    {
+        latency_ = latency_ == 0 ? latency : latency_ + (latency - latency_) * latency_weight;
+        if(open_until_.has_value()) {
+            // The probe went through
+            open_until_.reset();
+            backoff_ = 0;
+            score_ = 0;
+            scored_at_ = now;
+        }
+    }
+
+    void recordFailure(Clock::time_point now = Clock::now())
+    {
+        score_ = failureScore(now) + 1;
+        scored_at_ = now;
+        if(halfOpen(now)) {
+            // The probe failed
+            backoff_ = std::min(std::max(backoff_ * 2, min_backoff), max_backoff);
+            open_until_ = now + toDuration(backoff_);
+        }
+        else if(!open_until_.has_value() && score_ >= trip_score) {
+            backoff_ = min_backoff;
+            open_until_ = now + toDuration(backoff_);
+        }
+    }
+
+    /**
+     * @brief Can the host be fetched from. False while the circuit is open
+     */
+    bool available(Clock::time_point now = Clock::now()) const
+    {
+        return !open_until_.has_value() || *open_until_ <= now;
+    }
+
+    /**
+     * @brief The circuit was opened and the next fetch decides whether it closes
+     */
+    bool halfOpen(Clock::time_point now = Clock::now()) const
+    {
+        return open_until_.has_value() && *open_until_ <= now;
+    }
+
+    bool slow() const
+    {
+        return latency_ > slow_latency;
+    }
+
+    double failureScore(Clock::time_point now = Clock::now()) const
+    {
+        return score_ * decay(std::chrono::duration<double>(now - scored_at_).count());
+    }
+
+    /**
+     * @brief Average fetch latency in seconds. 0 if unknown
+     */
+    double latency() const
+    {
+        return latency_;
+    }
+
+    /**
+     * @brief Seconds until the circuit is half-open. std::nullopt if it is closed
+     */
+    std::optional<double> openFor(Clock::time_point now = Clock::now()) const
+    {
+        if(!open_until_.has_value())
+            return std::nullopt;
+        return std::chrono::duration<double>(*open_until_ - now).count();
+    }
+
+    double backoff() const
+    {
+        return backoff_;
+    }
+
+protected:
+    static double decay(double seconds)
+    {
+        return std::exp2(-std::max(seconds, 0.0) / failure_half_life);
+    }
+
+    static Clock::duration toDuration(double seconds)
+    {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    double score_ = 0;
+    Clock::time_point scored_at_;
+    double latency_ = 0;
+    std::optional<Clock::time_point> open_until_;
+    double backoff_ = 0;
+};
+
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+namespace tlgs
+{
+
+/**
+ * @brief A thread safe LRU cache bounded by the total cost of the stored values instead of the number
+ * of entries. The cost is supplied by the caller on insertion and is usually the (estimated) size in
+ * bytes of the value. The least recently used entries are evicted once the total cost goes over budget.
+ *
+ * @note A budget of 0 disables the cache. Nothing will be stored.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LruCache(size_t max_cost = 0)
+        : max_cost_(max_cost)
+    {
+    }
+
+    LruCache(const LruCache&) = delete;
+    LruCache& operator=(const LruCache&) = delete;
+
+    /**
+     * @brief Insert or replace an entry
+     *
+     * @param key the key
+     * @param value the value
+     * @param cost the cost of this entry towards the budget
+     * @param timeout seconds before the entry expires. 0 means never
+     */
+    void insert(const Key& key, Value value, size_t cost, double timeout = 0)
+    {
+        std::lock_guard lock(mutex_);
+        eraseImpl(key);
+        if(max_cost_ == 0 || cost > max_cost_)
+            return;
+
+        Entry entry{key, std::move(value), cost, {}};
+        if(timeout > 0)
+            entry.expire_at = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+        lru_.push_front(std::move(entry));
+        map_.emplace(key, lru_.begin());
+        cost_ += cost;
+        evict();
+    }
+
+    /**
+     * @brief Find the entry and copy it into value. Marks the entry as recently used
+     *
+     * @return true if the key is found and not yet expired
+     */
+    bool findAndFetch(const Key& key, Value& value)
+    {
+        std::lock_guard lock(mutex_);
+        auto it = map_.find(key);
+        if(it == map_.end())
+            return false;
+        auto entry = it->second;
+        if(entry->expire_at != Clock::time_point{} && entry->expire_at <= Clock::now()) {
+            cost_ -= entry->cost;
+            lru_.erase(entry);
+            map_.erase(it);
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, entry);
+        value = entry->value;
+        return true;
+    }
+
+    /**
+     * @brief Visit every unexpired entry, from the most recently used to the least. Does not change the LRU order
+     * 
+     * @param func called as func(key, value). Return false to stop visiting
+     * @note The cache is locked while visiting. Do not access the cache from func
+     */
+    template <typename Func>
+    void forEach(Func&& func) const
+    {
+        std::lock_guard lock(mutex_);
+        auto now = Clock::now();
+        for(const auto& entry : lru_) {
+            if(entry.expire_at != Clock::time_point{} && entry.expire_at <= now)
+                continue;
+            if(!func(entry.key, entry.value))
+                break;
+        }
+    }
+
+    void erase(const Key& key)
+    {
+        std::lock_guard lock(mutex_);
+        eraseImpl(key);
+    }
+
+    void clear()
+    {
+        std::lock_guard lock(mutex_);
+        lru_.clear();
+        map_.clear();
+        cost_ = 0;
+    }
+
+    void setMaxCost(size_t max_cost)
+    {
+        std::lock_guard lock(mutex_);
+        max_cost_ = max_cost;
+        evict();
+    }
+
+    size_t maxCost() const
+    {
+        std::lock_guard lock(mutex_);
+        return max_cost_;
+    }
+
+    size_t cost() const
+    {
+        std::lock_guard lock(mutex_);
+        return cost_;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard lock(mutex_);
+        return map_.size();
+    }
+
+protected:
+    struct Entry
+    {
+        Key key;
+        Value value;
+        size_t cost;
+        Clock::time_point expire_at;
+    };
+
+    void eraseImpl(const Key& key)
+    {
+        auto it = map_.find(key);
+        if(it == map_.end())
+            return;
+        cost_ -= it->second->cost;
+        lru_.erase(it->second);
+        map_.erase(it);
+    }
+
+    void evict()
+    {
+        // Entries costing nothing are dropped too when the cache is disabled
+        while((cost_ > max_cost_ || max_cost_ == 0) && !lru_.empty()) {
+            auto& entry = lru_.back();
+            cost_ -= entry.cost;
+            map_.erase(entry.key);
+            lru_.pop_back();
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> map_;
+    size_t cost_ = 0;
+    size_t max_cost_;
+};
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+namespace tlgs
+{
+
+/**
+ * @brief Seconds until a page should be crawled again. The page is expected to change once per
+ * observed_seconds / (change_count + 1). On top of that the interval halves every time the page is
+ * found changed and doubles every time it is found the same. So stable pages back off exponentially
+ * and pages that start changing are caught quickly.
+ *
+ * @param observed_seconds how long the content of the page has been watched. 0 if unknown
+ * @param change_count how many times the content is found changed in that time
+ * @param last_interval seconds between the previous crawl and this one
+ * @param changed is the content changed since the previous crawl
+ * @param min_interval the result is never shorter than this
+ * @param max_interval the result is never longer than this
+ */
+inline double recrawlInterval(double observed_seconds, uint64_t change_count, double last_interval, bool changed,
+    double min_interval, double max_interval)
+{
+    double estimate = last_interval;
+    if(observed_seconds > 0)
+        estimate = observed_seconds / (change_count + 1);
+    double interval = changed ? std::min(estimate, last_interval / 2) : std::max(estimate, last_interval * 2);
+    return std::clamp(interval, min_interval, std::max(min_interval, max_interval));
+}
+
+}
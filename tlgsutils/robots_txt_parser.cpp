@@ -1,18 +1,24 @@
 #include "robots_txt_parser.hpp"
 #include <drogon/utils/Utilities.h>
 #include <regex>
+#include <cmath>
+#include <cstdlib>
 #include <set>
 #include <sstream>
 #include <iostream>
 #include <filesystem>
 
-std::vector<std::string> tlgs::parseRobotsTxt(const std::string& str, const std::set<std::string>& agents)
+/**
+ * @brief Calls func(key, value) for each line in the robots.txt that applies to one of the agents.
+ * Keys are in lower case
+ */
+template <typename Func>
+static void forEachRule(const std::string& str, const std::set<std::string>& agents, Func&& func)
 {
     std::string lf_str = str;
     if(str.find("\r\n") != std::string::npos)
         drogon::utils::replaceAll(lf_str, "\r\n", "\n");
 
-    std::set<std::string> disallowed_path; 
     std::stringstream ss(lf_str);
     static const std::regex line_re(R"([ \t]*(.*):[ \t]*(.*))");
     std::smatch match;
@@ -40,17 +46,59 @@ std::vector<std::string> tlgs::parseRobotsTxt(const std::string& str, const std:
             last_line_user_agent = false;
         }
         
-        if(key == "disallow" && care == true) {
-            std::string path = match[2];
-            if(path.empty())
-                disallowed_path.clear();
-            else
-                disallowed_path.insert(path);
-        }
+        if(care == true)
+            func(key, std::string(match[2]));
     }
+}
+
+std::vector<std::string> tlgs::parseRobotsTxt(const std::string& str, const std::set<std::string>& agents)
+{
+    std::set<std::string> disallowed_path; 
+    forEachRule(str, agents, [&](const std::string& key, const std::string& path) {
+        if(key != "disallow")
+            return;
+        if(path.empty())
+            disallowed_path.clear();
+        else
+            disallowed_path.insert(path);
+    });
     return std::vector<std::string>(disallowed_path.begin(), disallowed_path.end());
 }
 
+std::optional<double> tlgs::parseRobotsCrawlDelay(const std::string& str, const std::set<std::string>& agents)
+{
+    std::optional<double> delay;
+    forEachRule(str, agents, [&](const std::string& key, const std::string& value) {
+        if(key != "crawl-delay")
+            return;
+        char* end = nullptr;
+        double seconds = std::strtod(value.c_str(), &end);
+        if(end == value.c_str() || !std::isfinite(seconds) || seconds < 0)
+            return;
+        // Be conservative if multiple groups apply
+        delay = std::max(delay.value_or(0), seconds);
+    });
+    return delay;
+}
+
+
+/**
+ * @brief The regex matching what the wildcard pattern matches. * matches anything
+ */
+static std::string wildcardToRegex(const std::string& pattern)
+{
+    std::string regex_pattern;
+    const std::string_view escape_chars = "\\.+()[]{}|";
+    for(char ch : pattern) {
+        if(ch == '*')
+            regex_pattern += ".*";
+        else if(escape_chars.find(ch) != std::string_view::npos)
+            regex_pattern += "\\" + std::string(1, ch);
+        else
+            regex_pattern += ch;
+    }
+    return regex_pattern;
+}
 
 /**
  * @brief Fast matching for common cases. Otherwise, use the regex. Fast cases include
@@ -100,18 +148,8 @@ static bool wildcardPathMatch(std::string pattern, const std::string_view& str)
         return str.starts_with(pattern.substr(0, n)) && str.rfind(pattern.substr(n+1)) > n;
     
     // Else we convert the pattern to a regex and try to match
-    std::string regex_pattern;
-    const std::string_view escape_chars = "\\.+()[]{}|";
-    for(char ch : pattern) {
-        if(ch == '*')
-            regex_pattern += ".*";
-        else if(escape_chars.find(ch) != std::string_view::npos)
-            regex_pattern += "\\" + std::string(1, ch);
-        else
-            regex_pattern += ch;
-    }
     try {
-        std::regex re(regex_pattern);
+        std::regex re(wildcardToRegex(pattern));
         std::smatch sm;
         std::string s(str);
         return std::regex_match(s, sm, re);
@@ -134,3 +172,168 @@ bool tlgs::isPathBlocked(const std::string& path, const std::string& disallowed_
 {
     return wildcardPathMatch(disallowed_path, path);
 }
+
+tlgs::RobotsMatcher::RobotsMatcher(const std::vector<std::string>& disallowed)
+{
+    trie_.emplace_back();
+    for(const auto& pattern : disallowed) {
+        // Empty rules never match
+        if(pattern.empty())
+            continue;
+        if(pattern.find('*') == std::string::npos)
+            addLiteral(pattern);
+        else
+            addWildcard(pattern);
+    }
+}
+
+void tlgs::RobotsMatcher::addLiteral(const std::string& pattern)
+{
+    uint32_t node = 0;
+    for(char ch : pattern) {
+        auto& children = trie_[node].children;
+        auto it = std::find_if(children.begin(), children.end(), [ch](const auto& child) { return child.first == ch; });
+        if(it != children.end()) {
+            node = it->second;
+            continue;
+        }
+        uint32_t child = trie_.size();
+        children.emplace_back(ch, child);
+        trie_.emplace_back();
+        node = child;
+    }
+    trie_[node].terminal = true;
+}
+
+void tlgs::RobotsMatcher::addWildcard(std::string pattern)
+{
+    // Follows wildcardPathMatch() case by case. Including its quirks
+    size_t star_count = std::count(pattern.begin(), pattern.end(), '*');
+    if(pattern.back() == '$' && (pattern.starts_with("*") || pattern.starts_with("/*")))
+        pattern.pop_back();
+
+    WildcardRule rule{RuleKind::Regex, pattern, {}, std::nullopt};
+    if(pattern[0] == '*' && pattern.back() == '*' && star_count == 2)
+        rule = {RuleKind::Contains, pattern, {pattern.substr(1, pattern.size()-2)}, std::nullopt};
+    else if(pattern.starts_with("/*") && pattern.back() == '*' && star_count == 2)
+        rule = {RuleKind::Contains, pattern, {pattern.substr(2, pattern.size()-3)}, std::nullopt};
+    else if(pattern[0] == '*' && star_count == 1)
+        rule = {RuleKind::EndsWith, pattern, {pattern.substr(1)}, std::nullopt};
+    else if(pattern.starts_with("/*") && star_count == 1)
+        rule = {RuleKind::EndsWith, pattern, {pattern.substr(2)}, std::nullopt};
+    else if(pattern.back() == '*' && star_count == 1)
+        rule = {RuleKind::StartsWith, pattern, {pattern.substr(0, pattern.size() - 1)}, std::nullopt};
+    else if(star_count == 1) {
+        auto n = pattern.find('*');
+        rule = {RuleKind::Middle, pattern, {pattern.substr(0, n), pattern.substr(n+1)}, std::nullopt};
+    }
+    else if(pattern.find_first_of("?^$") == std::string::npos) {
+        // The regex would be a plain wildcard match. Match the parts between the *s instead
+        rule.kind = RuleKind::Glob;
+        size_t begin = 0;
+        while(true) {
+            auto end = pattern.find('*', begin);
+            rule.parts.push_back(pattern.substr(begin, end - begin));
+            if(end == std::string::npos)
+                break;
+            begin = end + 1;
+        }
+    }
+    else {
+        try {
+            rule.regex.emplace(wildcardToRegex(pattern));
+        }
+        catch(std::regex_error& e) {
+            // Never matches
+            return;
+        }
+    }
+    wildcards_.push_back(std::move(rule));
+}
+
+bool tlgs::RobotsMatcher::literalBlocked(std::string_view path) const
+{
+    // A literal rule of length d blocks the path if the path is the rule, the rule followed by a /, or longer
+    // than that and continuing the rule at a /
+    uint32_t node = 0;
+    for(size_t d = 0;; d++) {
+        if(trie_[node].terminal && d != 0) {
+            if(path.size() == d)
+                return true;
+            if(path[d] == '/')
+                return true;
+            if(path.size() > d + 1 && path[d-1] == '/')
+                return true;
+        }
+        if(d == path.size())
+            return false;
+        const auto& children = trie_[node].children;
+        auto it = std::find_if(children.begin(), children.end(), [ch = path[d]](const auto& child) { return child.first == ch; });
+        if(it == children.end())
+            return false;
+        node = it->second;
+    }
+}
+
+bool tlgs::RobotsMatcher::wildcardBlocked(const WildcardRule& rule, std::string_view path)
+{
+    switch(rule.kind) {
+    case RuleKind::Contains:
+        return path.find(rule.parts[0]) != std::string_view::npos;
+    case RuleKind::EndsWith:
+        return path.ends_with(rule.parts[0]);
+    case RuleKind::StartsWith:
+        return path.starts_with(rule.parts[0]);
+    case RuleKind::Middle:
+        // Not found counts as after the *. Same as wildcardPathMatch()
+        return path.starts_with(rule.parts[0]) && path.rfind(rule.parts[1]) > rule.parts[0].size();
+    case RuleKind::Glob: {
+        // . in a regex doesn't match line breaks. Leave those paths to the regex
+        if(path.find_first_of("\r\n") != std::string_view::npos)
+            return wildcardPathMatch(rule.pattern, path);
+        const auto& first = rule.parts.front();
+        const auto& last = rule.parts.back();
+        if(path.size() < first.size() + last.size() || !path.starts_with(first) || !path.ends_with(last))
+            return false;
+        size_t pos = first.size();
+        auto middle = path.substr(0, path.size() - last.size());
+        for(size_t i = 1; i + 1 < rule.parts.size(); i++) {
+            pos = middle.find(rule.parts[i], pos);
+            if(pos == std::string_view::npos)
+                return false;
+            pos += rule.parts[i].size();
+        }
+        return true;
+    }
+    case RuleKind::Regex:
+        return std::regex_match(path.begin(), path.end(), *rule.regex);
+    }
+    return false;
+}
+
+bool tlgs::RobotsMatcher::isBlocked(std::string_view path) const
+{
+    if(literalBlocked(path))
+        return true;
+    for(const auto& rule : wildcards_) {
+        if(wildcardBlocked(rule, path))
+            return true;
+    }
+    return false;
+}
+
+size_t tlgs::RobotsMatcher::memoryUsage() const
+{
+    size_t bytes = sizeof(*this) + trie_.capacity() * sizeof(TrieNode) + wildcards_.capacity() * sizeof(WildcardRule);
+    for(const auto& node : trie_)
+        bytes += node.children.capacity() * sizeof(node.children[0]);
+    for(const auto& rule : wildcards_) {
+        bytes += rule.pattern.capacity();
+        for(const auto& part : rule.parts)
+            bytes += sizeof(part) + part.capacity();
+        // Rough size of a compiled regex
+        if(rule.regex.has_value())
+            bytes += 64 * rule.pattern.size();
+    }
+    return bytes;
+}
@@ -3,6 +3,11 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <regex>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <string_view>
 
 namespace tlgs
 {
@@ -13,6 +18,14 @@ namespace tlgs
  * @param agents the user agents we care about. '*' must be explicitly specified otherwise it is ignored
  */
 std::vector<std::string> parseRobotsTxt(const std::string& str, const std::set<std::string>& agents);
+/**
+ * @brief Parse the Crawl-delay (in seconds) from robots.txt.
+ *
+ * @param str robots.txt content
+ * @param agents the user agents we care about. Same as parseRobotsTxt()
+ * @return std::nullopt if no valid Crawl-delay applies to the agents. The largest one if multiple do
+ */
+std::optional<double> parseRobotsCrawlDelay(const std::string& str, const std::set<std::string>& agents);
 /**
  * @brief Check if the path is disallowed by a set of robots.txt rules.
  *
@@ -22,4 +35,62 @@ std::vector<std::string> parseRobotsTxt(const std::string& str, const std::set<s
  */
 bool isPathBlocked(const std::string& str, const std::vector<std::string>& disallowed);
 bool isPathBlocked(const std::string& str, const std::string& disallowed_path);
+
+/**
+ * @brief robots.txt rules compiled once for checking many paths. Literal rules are walked in a trie in a
+ * single pass over the path. Rules with wildcards are sorted into the cases isPathBlocked() handles up front.
+ * Only those using other regex syntax keep a regex, compiled here. Blocks exactly the paths isPathBlocked()
+ * blocks with the same rules.
+ */
+class RobotsMatcher
+{
+public:
+    explicit RobotsMatcher(const std::vector<std::string>& disallowed = {});
+
+    bool isBlocked(std::string_view path) const;
+    /**
+     * @brief Estimated number of bytes the matcher takes. For bounding caches
+     */
+    size_t memoryUsage() const;
+
+protected:
+    enum class RuleKind
+    {
+        // *foo* and /*foo*
+        Contains,
+        // *foo and /*foo
+        EndsWith,
+        // foo*
+        StartsWith,
+        // foo*bar
+        Middle,
+        // Multiple *s and nothing else regex would treat specially
+        Glob,
+        Regex
+    };
+
+    struct WildcardRule
+    {
+        RuleKind kind;
+        std::string pattern;
+        // The literal parts between the *s
+        std::vector<std::string> parts;
+        std::optional<std::regex> regex;
+    };
+
+    struct TrieNode
+    {
+        std::vector<std::pair<char, uint32_t>> children;
+        // A rule ends here
+        bool terminal = false;
+    };
+
+    void addLiteral(const std::string& pattern);
+    void addWildcard(std::string pattern);
+    bool literalBlocked(std::string_view path) const;
+    static bool wildcardBlocked(const WildcardRule& rule, std::string_view path);
+
+    std::vector<TrieNode> trie_;
+    std::vector<WildcardRule> wildcards_;
+};
 }
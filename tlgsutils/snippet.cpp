@@ -0,0 +1,148 @@
+#include "snippet.hpp"
+#include "utils.hpp"
+
+#include <cctype>
+
+namespace
+{
+struct Word
+{
+    // The whole word
+    size_t begin;
+    size_t end;
+    // The word without surrounding punctuation
+    size_t core_begin;
+    size_t core_end;
+    // Index of the matched term. -1 if none
+    int term;
+};
+
+bool isSpace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+bool isPunct(char ch)
+{
+    unsigned char uch = ch;
+    return uch < 0x80 && !std::isalnum(uch);
+}
+}
+
+std::string tlgs::highlightSnippet(std::string_view text, const std::vector<std::string>& terms, size_t max_words,
+    size_t min_words)
+{
+    std::vector<Word> words;
+    size_t matched_words = 0;
+    size_t i = 0;
+    while(i < text.size()) {
+        while(i < text.size() && isSpace(text[i]))
+            i++;
+        if(i == text.size())
+            break;
+        Word word{i, i, i, i, -1};
+        while(i < text.size() && !isSpace(text[i]))
+            i++;
+        word.end = i;
+        word.core_begin = word.begin;
+        word.core_end = word.end;
+        while(word.core_begin < word.core_end && isPunct(text[word.core_begin]))
+            word.core_begin++;
+        while(word.core_end > word.core_begin && isPunct(text[word.core_end-1]))
+            word.core_end--;
+
+        if(word.core_begin != word.core_end) {
+            auto core = text.substr(word.core_begin, word.core_end - word.core_begin);
+            // Words are lowered lazily. Most words don't even have the right first letter
+            std::string lowered;
+            for(size_t t = 0; t < terms.size(); t++) {
+                const auto& term = terms[t];
+                if(term.empty() || term.size() > core.size())
+                    continue;
+                unsigned char first = core[0];
+                if(first < 0x80 && (unsigned char)term[0] < 0x80 && std::tolower(first) != term[0])
+                    continue;
+                if(lowered.empty())
+                    lowered = utf8ToLower(core);
+                if(std::string_view(lowered).starts_with(term)) {
+                    word.term = t;
+                    matched_words++;
+                    break;
+                }
+            }
+        }
+        words.push_back(word);
+    }
+
+    if(words.empty())
+        return "";
+
+    size_t first = 0;
+    size_t last = std::min(words.size(), max_words);
+    if(matched_words == 0) {
+        last = std::min(words.size(), std::max(min_words, size_t{1}));
+    }
+    else if(words.size() > max_words && max_words != 0) {
+        // Slide a window of max_words over the text. Counting the distinct terms and matches in it
+        std::vector<size_t> term_count(terms.size());
+        size_t distinct = 0;
+        size_t matches = 0;
+        auto add = [&](const Word& word) {
+            if(word.term < 0)
+                return;
+            matches++;
+            if(term_count[word.term]++ == 0)
+                distinct++;
+        };
+        auto remove = [&](const Word& word) {
+            if(word.term < 0)
+                return;
+            matches--;
+            if(--term_count[word.term] == 0)
+                distinct--;
+        };
+        for(size_t w = 0; w < max_words; w++)
+            add(words[w]);
+        size_t best_begin = 0;
+        size_t best_distinct = distinct;
+        size_t best_matches = matches;
+        for(size_t w = max_words; w < words.size(); w++) {
+            add(words[w]);
+            remove(words[w - max_words]);
+            if(distinct > best_distinct || (distinct == best_distinct && matches > best_matches)) {
+                best_begin = w - max_words + 1;
+                best_distinct = distinct;
+                best_matches = matches;
+            }
+        }
+
+        // Center the window around the matches in it. So they have context on both sides
+        size_t first_match = best_begin;
+        while(words[first_match].term < 0)
+            first_match++;
+        size_t last_match = best_begin + max_words - 1;
+        while(words[last_match].term < 0)
+            last_match--;
+        size_t slack = max_words - (last_match - first_match + 1);
+        first = first_match - std::min(first_match, slack / 2);
+        first = std::min(first, words.size() - max_words);
+        last = first + max_words;
+    }
+
+    std::string result;
+    for(size_t w = first; w < last; w++) {
+        const auto& word = words[w];
+        if(!result.empty())
+            result += ' ';
+        if(word.term < 0) {
+            result += text.substr(word.begin, word.end - word.begin);
+            continue;
+        }
+        result += text.substr(word.begin, word.core_begin - word.begin);
+        result += '[';
+        result += text.substr(word.core_begin, word.core_end - word.core_begin);
+        result += ']';
+        result += text.substr(word.core_end, word.end - word.core_end);
+    }
+    return result;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <string_view>
+
+namespace tlgs
+{
+/**
+ * @brief Make a short preview of the part of a text where the search terms appear. Matching words are
+ * surrounded with `[` and `]`. The window of words containing the most distinct terms (then the most
+ * matches) is picked and centered around its matches.
+ *
+ * @param text the text to make the preview from
+ * @param terms lower case search terms. A word matches a term if it starts with it, ignoring case and
+ * surrounding punctuation
+ * @param max_words max number of words in the preview
+ * @param min_words number of words from the beginning of the text to use if no term is found
+ */
+std::string highlightSnippet(std::string_view text, const std::vector<std::string>& terms, size_t max_words = 37,
+    size_t min_words = 23);
+}
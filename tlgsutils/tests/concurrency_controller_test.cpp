@@ -0,0 +1,104 @@
+#include <tlgsutils/concurrency_controller.hpp>
+#include <drogon/drogon_test.h>
+
+using namespace std::chrono_literals;
+
+// Run a window with n fetches of the given latency, the limit fully used
+static bool busyWindow(tlgs::AimdController& controller, tlgs::AimdController::Clock::time_point& now, size_t n,
+    double latency, size_t timeouts = 0, size_t backlog = 0)
+{
+    while(controller.tryAcquire());
+    for(size_t i = 0; i < n; i++)
+        controller.recordFetch(latency, i < timeouts);
+    while(controller.active() != 0)
+        controller.release();
+    now += 5s;
+    return controller.update(backlog, now);
+}
+
+DROGON_TEST(AimdControllerTest)
+{
+    auto now = tlgs::AimdController::Clock::now();
+    tlgs::AimdController controller(2, 20, 5s, now);
+    CHECK(controller.limit() == 2);
+    CHECK(controller.tryAcquire() == true);
+    CHECK(controller.tryAcquire() == true);
+    CHECK(controller.tryAcquire() == false);
+    CHECK(controller.active() == 2);
+    controller.release();
+    controller.release();
+
+    // Nothing happens before the window is over
+    controller.tryAcquire();
+    controller.tryAcquire();
+    controller.tryAcquire();
+    CHECK(controller.update(0, now + 1s) == false);
+    controller.release();
+    controller.release();
+
+    // Slow start doubles the limit while it is the bottleneck
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 4);
+    CHECK(controller.baselineLatency() == 1.0);
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 8);
+
+    // The limit stays if it isn't reached
+    controller.tryAcquire();
+    controller.release();
+    now += 5s;
+    CHECK(controller.update(0, now) == false);
+    CHECK(controller.limit() == 8);
+
+    // Latency far above the baseline halves it. Then a window is skipped
+    CHECK(busyWindow(controller, now, 20, 3.0) == true);
+    CHECK(controller.limit() == 4);
+    CHECK(busyWindow(controller, now, 20, 3.0) == false);
+    CHECK(controller.limit() == 4);
+
+    // Out of slow start. Increases are additive
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 5);
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 6);
+
+    // Timeouts
+    CHECK(busyWindow(controller, now, 20, 1.0, 10) == true);
+    CHECK(controller.limit() == 3);
+    busyWindow(controller, now, 20, 1.0);
+    // Too few fetches to judge
+    CHECK(busyWindow(controller, now, 5, 1.0, 5) == true);
+    CHECK(controller.limit() == 4);
+
+    // DB backlog
+    CHECK(busyWindow(controller, now, 20, 1.0, 0, 100) == true);
+    CHECK(controller.limit() == 2);
+    busyWindow(controller, now, 20, 1.0);
+    // Never below the min
+    CHECK(busyWindow(controller, now, 20, 1.0, 0, 100) == false);
+    CHECK(controller.limit() == 2);
+}
+
+DROGON_TEST(AimdControllerBoundsTest)
+{
+    auto now = tlgs::AimdController::Clock::now();
+    tlgs::AimdController controller(1, 6, 5s, now);
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 4);
+    // Never above the max
+    CHECK(busyWindow(controller, now, 20, 1.0) == true);
+    CHECK(controller.limit() == 6);
+    CHECK(busyWindow(controller, now, 20, 1.0) == false);
+    CHECK(controller.limit() == 6);
+
+    // The baseline slowly follows slower fetches that don't overload anything
+    CHECK(busyWindow(controller, now, 20, 1.5) == false);
+    CHECK(controller.baselineLatency() > 1.0);
+    CHECK(controller.baselineLatency() < 1.5);
+
+    controller.setLimits(2, 3);
+    CHECK(controller.limit() == 3);
+    controller.setLimits(0, 0);
+    CHECK(controller.limit() == 1);
+}
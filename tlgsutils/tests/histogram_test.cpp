@@ -0,0 +1,60 @@
+#include <tlgsutils/histogram.hpp>
+#include <drogon/drogon_test.h>
+#include <thread>
+#include <vector>
+
+DROGON_TEST(HistogramBucketTest)
+{
+    using tlgs::Histogram;
+    // Small values are exact
+    for(uint64_t i = 0; i < 16; i++)
+        CHECK(Histogram::bucketUpperBound(Histogram::bucketIndex(i)) == i);
+
+    // Every value falls into a bucket whose bounds contains it, within the relative error
+    bool all_good = true;
+    for(uint64_t value : {17ull, 100ull, 1000ull, 123456ull, 999999999ull}) {
+        auto index = Histogram::bucketIndex(value);
+        auto upper = Histogram::bucketUpperBound(index);
+        all_good &= upper >= value;
+        all_good &= (upper - value) <= value / Histogram::sub_buckets;
+        all_good &= index == 0 || Histogram::bucketUpperBound(index-1) < value;
+    }
+    CHECK(all_good);
+
+    // Huge values are clamped
+    CHECK(Histogram::bucketIndex(~uint64_t{0}) == Histogram::bucket_count - 1);
+}
+
+DROGON_TEST(HistogramQuantileTest)
+{
+    tlgs::Histogram histogram;
+    CHECK(histogram.snapshot().valueAtQuantile(0.5) == 0);
+    for(uint64_t i = 1; i <= 100; i++)
+        histogram.record(i);
+    auto snapshot = histogram.snapshot();
+    CHECK(snapshot.count == 100);
+    CHECK(snapshot.sum == 5050);
+    auto median = snapshot.valueAtQuantile(0.5);
+    CHECK(median >= 50);
+    CHECK(median <= 50 + 50/tlgs::Histogram::sub_buckets);
+    CHECK(snapshot.valueAtQuantile(1) >= 100);
+    CHECK(snapshot.valueAtQuantile(0) == 1);
+}
+
+DROGON_TEST(ShardedHistogramTest)
+{
+    tlgs::ShardedHistogram histogram;
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; t++) {
+        threads.emplace_back([&histogram]() {
+            for(int i = 0; i < 1000; i++)
+                histogram.record(10);
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    auto snapshot = histogram.snapshot();
+    CHECK(snapshot.count == 4000);
+    CHECK(snapshot.sum == 40000);
+    CHECK(snapshot.valueAtQuantile(0.99) == 10);
+}
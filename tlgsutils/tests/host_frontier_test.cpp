@@ -0,0 +1,163 @@
+#include <tlgsutils/host_frontier.hpp>
+#include <drogon/drogon_test.h>
+
+using namespace std::chrono_literals;
+
+DROGON_TEST(HostFrontierTest)
+{
+    auto now = tlgs::HostFrontier::Clock::now();
+    tlgs::HostFrontier frontier(5, 3, 1s);
+    CHECK(frontier.empty());
+    CHECK(frontier.pop(now).has_value() == false);
+    CHECK(frontier.nextReadyTime().has_value() == false);
+
+    CHECK(frontier.push("a.com", "gemini://a.com/1", 0, now));
+    CHECK(frontier.push("a.com", "gemini://a.com/2", 0, now));
+    CHECK(frontier.push("b.com", "gemini://b.com/1", 0, now + 1ms));
+    CHECK(frontier.size() == 3);
+    CHECK(frontier.hosts() == 2);
+    CHECK(frontier.room() == 2);
+
+    // Hosts that became ready first go first. URLs of a host are FIFO
+    auto next = frontier.pop(now + 1ms);
+    REQUIRE(next.has_value());
+    CHECK(next->first == "a.com");
+    CHECK(next->second == "gemini://a.com/1");
+    // a.com is busy. Only one request per host at a time
+    next = frontier.pop(now + 1ms);
+    REQUIRE(next.has_value());
+    CHECK(next->first == "b.com");
+    CHECK(frontier.pop(now + 1ms).has_value() == false);
+    CHECK(frontier.busyHosts() == 2);
+    CHECK(frontier.nextReadyTime().has_value() == false);
+
+    // a.com waits for its delay after the request is done
+    frontier.release("a.com", now + 10ms);
+    CHECK(frontier.busyHosts() == 1);
+    REQUIRE(frontier.nextReadyTime().has_value());
+    CHECK(*frontier.nextReadyTime() == now + 10ms + 1s);
+    CHECK(frontier.pop(now + 500ms).has_value() == false);
+    next = frontier.pop(now + 10ms + 1s);
+    REQUIRE(next.has_value());
+    CHECK(next->second == "gemini://a.com/2");
+    CHECK(frontier.empty());
+
+    // Per host delays. i.e. Crawl-delay
+    frontier.setDelay("a.com", 5s);
+    frontier.release("a.com", now + 2s);
+    CHECK(frontier.push("a.com", "gemini://a.com/3", 0, now + 2s));
+    CHECK(frontier.pop(now + 6s).has_value() == false);
+    CHECK(frontier.pop(now + 7s).has_value());
+    frontier.release("a.com", now + 7s);
+
+    // Idle hosts are forgotten once their delay passed
+    frontier.release("b.com", now + 2s);
+    CHECK(frontier.hosts() == 2);
+    CHECK(frontier.pop(now + 20s).has_value() == false);
+    CHECK(frontier.hosts() == 0);
+    // Releasing an unknown host does nothing
+    frontier.release("c.com", now + 20s);
+    CHECK(frontier.busyHosts() == 0);
+}
+
+DROGON_TEST(HostFrontierBoundTest)
+{
+    auto now = tlgs::HostFrontier::Clock::now();
+    tlgs::HostFrontier frontier(5, 3, 0s);
+    CHECK(frontier.push("a.com", "1", 0, now));
+    CHECK(frontier.push("a.com", "2", 0, now));
+    CHECK(frontier.push("a.com", "3", 0, now));
+    // The host is full. But other hosts can still be queued
+    CHECK(frontier.push("a.com", "4", 0, now) == false);
+    CHECK(frontier.push("b.com", "1", 0, now));
+    CHECK(frontier.push("b.com", "2", 0, now));
+    CHECK(frontier.full());
+    CHECK(frontier.push("c.com", "1", 0, now) == false);
+    CHECK(frontier.size() == 5);
+
+    // Room is made by handing out URLs
+    CHECK(frontier.pop(now).has_value());
+    CHECK(frontier.push("c.com", "1", 0, now));
+
+    // With no delay a released host is ready right away
+    auto next = frontier.pop(now);
+    REQUIRE(next.has_value());
+    frontier.release(next->first, now);
+    CHECK(frontier.pop(now).has_value());
+}
+
+DROGON_TEST(HostFrontierDuplicateTest)
+{
+    auto now = tlgs::HostFrontier::Clock::now();
+    tlgs::HostFrontier frontier(100, 100, 0s);
+    CHECK(frontier.push("a.com", "1", 0, now));
+    CHECK(frontier.push("a.com", "2", 0, now));
+    // Claimed again while queued. i.e. the lease expired
+    CHECK(frontier.push("a.com", "1", 0, now));
+    CHECK(frontier.size() == 2);
+
+    // Nor while being fetched
+    auto next = frontier.pop(now);
+    REQUIRE(next.has_value());
+    CHECK(next->second == "1");
+    CHECK(frontier.push("a.com", "1", 0, now));
+    CHECK(frontier.size() == 1);
+
+    // Once fetched it can be queued again. i.e. when it is due for a recrawl
+    frontier.release("a.com", now);
+    CHECK(frontier.push("a.com", "1", 0, now));
+    CHECK(frontier.size() == 2);
+}
+
+DROGON_TEST(HostFrontierPriorityTest)
+{
+    auto now = tlgs::HostFrontier::Clock::now();
+    tlgs::HostFrontier frontier(100, 100, 0s);
+    CHECK(frontier.push("a.com", "low", 0.5, now));
+    CHECK(frontier.push("a.com", "high", 3, now));
+    CHECK(frontier.push("a.com", "mid-1", 1, now));
+    CHECK(frontier.push("a.com", "mid-2", 1, now));
+
+    // Most important first. FIFO among equals
+    std::vector<std::string> order;
+    while(auto next = frontier.pop(now)) {
+        order.push_back(next->second);
+        frontier.release(next->first, now);
+    }
+    CHECK((order == std::vector<std::string>{"high", "mid-1", "mid-2", "low"}));
+}
+
+DROGON_TEST(HostFrontierSlowLaneTest)
+{
+    auto now = tlgs::HostFrontier::Clock::now();
+    tlgs::HostFrontier frontier(10, 3, 1s);
+    CHECK(frontier.push("slow.com", "gemini://slow.com/1", 0, now));
+    CHECK(frontier.push("slow.com", "gemini://slow.com/2", 0, now));
+    CHECK(frontier.push("fast.com", "gemini://fast.com/1", 0, now + 1ms));
+
+    // Slowness is known after a request. It applies once the host is released
+    auto next = frontier.pop(now + 1ms);
+    REQUIRE(next.has_value());
+    CHECK(next->first == "slow.com");
+    frontier.setSlow("slow.com", true);
+    CHECK(frontier.busySlowHosts() == 0);
+    frontier.release("slow.com", now + 1ms);
+
+    // Slow hosts can be left out
+    CHECK(frontier.nextReadyTime(false) == now + 1ms);
+    CHECK(frontier.nextReadyTime(true) == now + 1ms);
+    next = frontier.pop(now + 2s, false);
+    REQUIRE(next.has_value());
+    CHECK(next->first == "fast.com");
+    CHECK(frontier.pop(now + 2s, false).has_value() == false);
+    CHECK(frontier.nextReadyTime(false).has_value() == false);
+    REQUIRE(frontier.nextReadyTime(true).has_value());
+
+    next = frontier.pop(now + 2s);
+    REQUIRE(next.has_value());
+    CHECK(next->first == "slow.com");
+    CHECK(frontier.busySlowHosts() == 1);
+    frontier.release("slow.com", now + 2s);
+    CHECK(frontier.busySlowHosts() == 0);
+    CHECK(frontier.busyHosts() == 1);
+}
@@ -0,0 +1,84 @@
+#include <tlgsutils/host_health.hpp>
+#include <drogon/drogon_test.h>
+#include <cmath>
+
+using namespace std::chrono_literals;
+
+DROGON_TEST(HostHealthTest)
+{
+    auto now = tlgs::HostHealth::Clock::now();
+    tlgs::HostHealth health(now);
+    CHECK(health.available(now));
+    CHECK(health.failureScore(now) == 0);
+    CHECK(health.openFor(now).has_value() == false);
+
+    // Failures decay. Two failures a half-life apart count as 1.5
+    health.recordFailure(now);
+    now += 6h;
+    CHECK(std::abs(health.failureScore(now) - 0.5) < 1e-9);
+    health.recordFailure(now);
+    CHECK(std::abs(health.failureScore(now) - 1.5) < 1e-9);
+    CHECK(health.available(now));
+
+    // Enough failures in a row open the circuit
+    health.recordFailure(now);
+    health.recordFailure(now);
+    CHECK(health.available(now) == false);
+    CHECK(health.halfOpen(now) == false);
+    REQUIRE(health.openFor(now).has_value());
+    CHECK(*health.openFor(now) == tlgs::HostHealth::min_backoff);
+
+    // Half-open after the backoff. A failed probe doubles it
+    now += 1h;
+    CHECK(health.available(now));
+    CHECK(health.halfOpen(now));
+    health.recordFailure(now);
+    CHECK(health.available(now) == false);
+    CHECK(health.backoff() == 2 * tlgs::HostHealth::min_backoff);
+    // Failures while open (requests already in flight) don't extend it
+    health.recordFailure(now + 1s);
+    CHECK(health.backoff() == 2 * tlgs::HostHealth::min_backoff);
+
+    // A successful probe closes it
+    now += 2h;
+    CHECK(health.halfOpen(now));
+    health.recordSuccess(1, now);
+    CHECK(health.available(now));
+    CHECK(health.halfOpen(now) == false);
+    CHECK(health.failureScore(now) == 0);
+    CHECK(health.backoff() == 0);
+}
+
+DROGON_TEST(HostHealthLatencyTest)
+{
+    auto now = tlgs::HostHealth::Clock::now();
+    tlgs::HostHealth health(now);
+    CHECK(health.latency() == 0);
+    health.recordSuccess(10, now);
+    CHECK(health.latency() == 10);
+    CHECK(health.slow());
+    health.recordSuccess(0, now);
+    health.recordSuccess(0, now);
+    health.recordSuccess(0, now);
+    CHECK(std::abs(health.latency() - 10 * 0.7 * 0.7 * 0.7) < 1e-9);
+    CHECK(health.slow() == false);
+
+    // Backoff never grows past the max
+    for(int i = 0; i < 3; i++)
+        health.recordFailure(now);
+    for(int i = 0; i < 20; i++) {
+        now += std::chrono::seconds(int64_t(tlgs::HostHealth::max_backoff));
+        health.recordFailure(now);
+    }
+    CHECK(health.backoff() == tlgs::HostHealth::max_backoff);
+
+    // Stored states come back relative to now
+    auto restored = tlgs::HostHealth::restore(4, 6 * 3600, 7, 30, 3600, now);
+    CHECK(std::abs(restored.failureScore(now) - 2) < 1e-9);
+    CHECK(restored.slow());
+    CHECK(restored.available(now) == false);
+    CHECK(restored.available(now + 30s));
+    auto closed = tlgs::HostHealth::restore(0, 0, 0, std::nullopt, 0, now);
+    CHECK(closed.available(now));
+    CHECK(closed.halfOpen(now) == false);
+}
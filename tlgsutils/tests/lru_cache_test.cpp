@@ -0,0 +1,104 @@
+#include <tlgsutils/lru_cache.hpp>
+#include <drogon/drogon_test.h>
+#include <thread>
+#include <string>
+#include <vector>
+
+DROGON_TEST(LruCacheTest)
+{
+    tlgs::LruCache<std::string, int> cache(10);
+    int value = 0;
+    cache.insert("a", 1, 4);
+    cache.insert("b", 2, 4);
+    CHECK(cache.size() == 2);
+    CHECK(cache.cost() == 8);
+    REQUIRE(cache.findAndFetch("a", value));
+    CHECK(value == 1);
+
+    // "b" is the least recently used now
+    cache.insert("c", 3, 4);
+    CHECK(cache.findAndFetch("b", value) == false);
+    CHECK(cache.findAndFetch("a", value) == true);
+    CHECK(cache.findAndFetch("c", value) == true);
+    CHECK(cache.cost() == 8);
+
+    // Replacing an entry updates the cost
+    cache.insert("a", 4, 2);
+    CHECK(cache.cost() == 6);
+    REQUIRE(cache.findAndFetch("a", value));
+    CHECK(value == 4);
+
+    // Entries larger than the budget are never stored
+    cache.insert("d", 5, 11);
+    CHECK(cache.findAndFetch("d", value) == false);
+    CHECK(cache.size() == 2);
+
+    cache.erase("a");
+    CHECK(cache.findAndFetch("a", value) == false);
+    CHECK(cache.cost() == 4);
+
+    cache.setMaxCost(3);
+    CHECK(cache.size() == 0);
+    CHECK(cache.cost() == 0);
+
+    cache.setMaxCost(10);
+    cache.insert("e", 6, 1);
+    cache.clear();
+    CHECK(cache.size() == 0);
+    CHECK(cache.cost() == 0);
+}
+
+DROGON_TEST(LruCacheForEachTest)
+{
+    tlgs::LruCache<int, int> cache(100);
+    cache.insert(1, 10, 1);
+    cache.insert(2, 20, 1);
+    cache.insert(3, 30, 1);
+    int value;
+    cache.findAndFetch(1, value);
+
+    std::vector<int> keys;
+    cache.forEach([&](int key, int value) {
+        CHECK(value == key*10);
+        keys.push_back(key);
+        return true;
+    });
+    CHECK((keys == std::vector<int>{1, 3, 2}));
+
+    keys.clear();
+    cache.forEach([&](int key, int) {
+        keys.push_back(key);
+        return keys.size() < 2;
+    });
+    CHECK((keys == std::vector<int>{1, 3}));
+}
+
+DROGON_TEST(LruCacheDisabledTest)
+{
+    tlgs::LruCache<int, int> cache;
+    int value;
+    cache.insert(1, 1, 0);
+    CHECK(cache.findAndFetch(1, value) == false);
+    cache.insert(2, 2, 1);
+    CHECK(cache.findAndFetch(2, value) == false);
+
+    // Setting the budget to 0 empties the cache. Even of entries costing nothing
+    cache.setMaxCost(10);
+    cache.insert(3, 3, 0);
+    CHECK(cache.findAndFetch(3, value) == true);
+    cache.setMaxCost(0);
+    CHECK(cache.findAndFetch(3, value) == false);
+}
+
+DROGON_TEST(LruCacheExpiryTest)
+{
+    tlgs::LruCache<int, int> cache(100);
+    int value;
+    cache.insert(1, 1, 1, 0.01);
+    cache.insert(2, 2, 1);
+    CHECK(cache.findAndFetch(1, value) == true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(cache.findAndFetch(1, value) == false);
+    CHECK(cache.findAndFetch(2, value) == true);
+    CHECK(cache.cost() == 1);
+}
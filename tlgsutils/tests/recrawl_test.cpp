@@ -0,0 +1,28 @@
+#include <tlgsutils/recrawl.hpp>
+#include <drogon/drogon_test.h>
+
+DROGON_TEST(RecrawlIntervalTest)
+{
+    constexpr double hour = 3600;
+    constexpr double day = 24 * hour;
+    constexpr double min = 12 * hour;
+    constexpr double max = 60 * day;
+
+    // Stable pages back off exponentially
+    CHECK(tlgs::recrawlInterval(0, 0, 3 * day, false, min, max) == 6 * day);
+    CHECK(tlgs::recrawlInterval(9 * day, 0, 6 * day, false, min, max) == 12 * day);
+    CHECK(tlgs::recrawlInterval(400 * day, 0, 48 * day, false, min, max) == max);
+
+    // Pages changing often are crawled about as often as they change
+    CHECK(tlgs::recrawlInterval(30 * day, 14, 3 * day, true, min, max) == 1.5 * day);
+    CHECK(tlgs::recrawlInterval(30 * day, 29, 1 * day, true, min, max) == min);
+    // The observed rate wins over backing off if the page usually changes more often
+    CHECK(tlgs::recrawlInterval(30 * day, 9, 1 * day, false, min, max) == 3 * day);
+
+    // A change cuts the interval of a page that used to be stable
+    CHECK(tlgs::recrawlInterval(100 * day, 0, 32 * day, true, min, max) == 16 * day);
+
+    // No history
+    CHECK(tlgs::recrawlInterval(0, 0, 3 * day, true, min, max) == 1.5 * day);
+    CHECK(tlgs::recrawlInterval(0, 0, 0, false, min, max) == min);
+}
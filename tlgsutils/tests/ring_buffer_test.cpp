@@ -0,0 +1,69 @@
+#include <tlgsutils/ring_buffer.hpp>
+#include <drogon/drogon_test.h>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+DROGON_TEST(RingBufferTest)
+{
+    tlgs::RingBuffer<std::string> buffer(3);
+    CHECK(buffer.capacity() == 4);
+
+    std::string value;
+    CHECK(buffer.tryPop(value) == false);
+    for(int i = 0; i < 4; i++)
+        CHECK(buffer.tryPush(std::to_string(i)) == true);
+
+    // Full. The item is not consumed on failure
+    std::string extra = "extra";
+    CHECK(buffer.tryPush(std::move(extra)) == false);
+    CHECK(extra == "extra");
+
+    for(int i = 0; i < 4; i++) {
+        REQUIRE(buffer.tryPop(value));
+        CHECK(value == std::to_string(i));
+    }
+    CHECK(buffer.tryPop(value) == false);
+
+    // Wrap around
+    CHECK(buffer.tryPush("a") == true);
+    REQUIRE(buffer.tryPop(value));
+    CHECK(value == "a");
+}
+
+DROGON_TEST(RingBufferConcurrentTest)
+{
+    constexpr int producers = 4;
+    constexpr int items_per_producer = 10000;
+    tlgs::RingBuffer<int> buffer(64);
+
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producers; p++) {
+        threads.emplace_back([&buffer, p]() {
+            for(int i = 0; i < items_per_producer; i++) {
+                int value = p*items_per_producer + i;
+                while(!buffer.tryPush(std::move(value)))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    std::vector<int> received;
+    int value;
+    while(received.size() < producers*items_per_producer) {
+        if(buffer.tryPop(value))
+            received.push_back(value);
+        else
+            std::this_thread::yield();
+    }
+    for(auto& thread : threads)
+        thread.join();
+
+    CHECK(buffer.tryPop(value) == false);
+    std::sort(received.begin(), received.end());
+    bool all_received = true;
+    for(int i = 0; i < (int)received.size(); i++)
+        all_received &= received[i] == i;
+    CHECK(all_received);
+}
@@ -1,5 +1,6 @@
 #include <robots_txt_parser.hpp>
 #include <drogon/drogon_test.h>
+#include <random>
 
 DROGON_TEST(RobotTextTest)
 {
@@ -148,3 +149,108 @@ DROGON_TEST(BlockedPathTest)
     CHECK(tlgs::isPathBlocked("/*/asd/*/.mp3", "/foo/asd/bar/1mp3") == false);
     CHECK(tlgs::isPathBlocked("/foo/\\*", "/foo/*") == true);
 }
+
+DROGON_TEST(CrawlDelayTest)
+{
+    std::string robots =
+        "User-agent: *\n"
+        "Crawl-delay: 2.5\n"
+        "Disallow: /private\n";
+    auto delay = tlgs::parseRobotsCrawlDelay(robots, {"*"});
+    REQUIRE(delay.has_value());
+    CHECK(*delay == 2.5);
+    // Crawl-delay is not a disallowed path
+    CHECK(tlgs::parseRobotsTxt(robots, {"*"}).size() == 1);
+
+    robots =
+        "User-agent: gus\n"
+        "Crawl-delay: 10\n";
+    CHECK(tlgs::parseRobotsCrawlDelay(robots, {"*", "tlgs"}).has_value() == false);
+
+    // The largest applying delay wins
+    robots =
+        "User-agent: *\n"
+        "Crawl-delay: 1\n"
+        "\n"
+        "User-agent: tlgs\n"
+        "crawl-delay: 5\n"
+        "\n"
+        "User-agent: gus\n"
+        "Crawl-delay: 60\n";
+    delay = tlgs::parseRobotsCrawlDelay(robots, {"*", "tlgs"});
+    REQUIRE(delay.has_value());
+    CHECK(*delay == 5);
+
+    // Ignore garbage
+    robots =
+        "User-agent: *\n"
+        "Crawl-delay: soon\n"
+        "Crawl-delay: -3\n";
+    CHECK(tlgs::parseRobotsCrawlDelay(robots, {"*"}).has_value() == false);
+    CHECK(tlgs::parseRobotsCrawlDelay("", {"*"}).has_value() == false);
+}
+
+DROGON_TEST(RobotsMatcherTest)
+{
+    const std::vector<std::pair<std::string, std::string>> cases = {
+        {"/", "/"}, {"/foo", "/"}, {"/bar", "/foo"}, {"/foo", "/foobar"}, {"/foo", "/foo/"}, {"/foo/", "/foo"},
+        {"/foo/bar/", "/foo"}, {"/foo/", "/foo/bar"}, {"/foo.txt", "/foo"}, {"/foo/bar.txt", "/foo"},
+        {"/foo/bar.txt", "/foo/*"}, {"/foo/bar.txt", "*.txt"}, {"/foo/bar.txt", "*.ogg"}, {"/foo/dir1/bar.txt", "*.txt$"},
+        {"/foo/some_dir/bar.txt", "*some_dir*"}, {"/foo/other_dir/bar.txt", "*some_dir*"},
+        {"/foo/other_dir/baz/bar.txt", "/foo/*/baz"}, {"/~testuser/gci-bin/test.txt", "/~*/cgi-bin/"},
+        {"/foo/123/bar/456/baz", "/foo/*/bar/*/baz"}, {"/foo/123/bar/baz", "/foo/*/bar/*/baz"},
+        {"/foo/123/bar/baz", "/foo/*/bar/*"}, {"/foo", "/***"}, {"/foo/(", "/foo/("}, {"/foo/\\*", "/foo/*"},
+        // A / ending the rule only blocks paths longer than the rule by at least 2
+        {"/a/b", "/a/"}, {"/a/bc", "/a/"}, {"/a//", "/a/"},
+        // $ is only dropped from rules starting with a *. Otherwise it is literal or a regex anchor
+        {"/foo$", "/foo$"}, {"/foo/x.txt", "/foo/*.txt$"}, {"/foo/x.txt$", "/foo/*.txt$"}, {"/x/a.txt", "/*/*.txt$"},
+        {"/x/a?b", "/*/a?b*"}, {"/x/ab", "/x/*/a?b*c"}, {"/x/y/abc", "/x/*/a?b*c"},
+        {"/a\nb/c", "/a*b*c"}, {"/ab/c", "/a*b*c"}, {"/foo", ""}, {"/foo", "*"}, {"/foo", "/*$"}, {"/foo", "**"},
+    };
+    for(const auto& [path, rule] : cases) {
+        tlgs::RobotsMatcher matcher({rule});
+        CHECK(matcher.isBlocked(path) == tlgs::isPathBlocked(path, rule));
+    }
+
+    tlgs::RobotsMatcher matcher({"/private", "/foo/", "*.mp3", "/*/cgi-bin/*", "/a*b*c*d"});
+    CHECK(matcher.isBlocked("/private/x") == true);
+    CHECK(matcher.isBlocked("/privateer") == false);
+    CHECK(matcher.isBlocked("/foo/x/y") == true);
+    CHECK(matcher.isBlocked("/music/a.mp3") == true);
+    CHECK(matcher.isBlocked("/~me/cgi-bin/run") == true);
+    CHECK(matcher.isBlocked("/a1b2c3d") == true);
+    CHECK(matcher.isBlocked("/a1b2c3") == false);
+    CHECK(matcher.isBlocked("/public/index.gmi") == false);
+    CHECK(tlgs::RobotsMatcher().isBlocked("/") == false);
+    CHECK(matcher.memoryUsage() > sizeof(matcher));
+}
+
+DROGON_TEST(RobotsMatcherDifferentialTest)
+{
+    // Random rules and paths over a small alphabet. So rules and paths often overlap
+    std::mt19937 rng(42);
+    const std::string rule_chars = "/ab.*$?";
+    const std::string path_chars = "/ab.$?";
+    auto randomString = [&](const std::string& chars, size_t max_length) {
+        std::string str;
+        size_t length = rng() % (max_length + 1);
+        for(size_t i = 0; i < length; i++)
+            str += chars[rng() % chars.size()];
+        return str;
+    };
+
+    size_t mismatches = 0;
+    for(int i = 0; i < 300; i++) {
+        std::vector<std::string> rules;
+        size_t rule_count = rng() % 4 + 1;
+        for(size_t j = 0; j < rule_count; j++)
+            rules.push_back((rng() % 2 ? "/" : "") + randomString(rule_chars, 6));
+        tlgs::RobotsMatcher matcher(rules);
+        for(int j = 0; j < 30; j++) {
+            auto path = "/" + randomString(path_chars, 8);
+            if(matcher.isBlocked(path) != tlgs::isPathBlocked(path, rules))
+                mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+}
@@ -0,0 +1,35 @@
+#include <tlgsutils/snippet.hpp>
+#include <drogon/drogon_test.h>
+
+DROGON_TEST(SnippetHighlightTest)
+{
+    CHECK(tlgs::highlightSnippet("Gemini is a protocol", {"gemini"}) == "[Gemini] is a protocol");
+    CHECK(tlgs::highlightSnippet("About the Gemini protocol.", {"protocol"}) == "About the Gemini [protocol].");
+    CHECK(tlgs::highlightSnippet("(capsules) are neat", {"capsule"}) == "([capsules]) are neat");
+    CHECK(tlgs::highlightSnippet("  many   spaces\there ", {"here"}) == "many spaces [here]");
+    CHECK(tlgs::highlightSnippet("", {"gemini"}) == "");
+    CHECK(tlgs::highlightSnippet("semigemini", {"gemini"}) == "semigemini");
+    CHECK(tlgs::highlightSnippet("ÜBER alles", {"über"}) == "[ÜBER] alles");
+}
+
+DROGON_TEST(SnippetWindowTest)
+{
+    std::string text;
+    for(int i = 0; i < 100; i++)
+        text += "w" + std::to_string(i) + " ";
+    // No match. The beginning of the text
+    CHECK(tlgs::highlightSnippet(text, {"nothing"}, 10, 3) == "w0 w1 w2");
+
+    // Centered around the match
+    auto snippet = tlgs::highlightSnippet(text, {"w50"}, 5);
+    CHECK(snippet == "w48 w49 [w50] w51 w52");
+
+    // Prefers the window with more distinct terms
+    text = "apple apple apple apple filler filler filler filler filler filler apple banana filler";
+    snippet = tlgs::highlightSnippet(text, {"apple", "banana"}, 3);
+    CHECK(snippet == "[apple] [banana] filler");
+
+    // Near the end. The window is not cut short
+    snippet = tlgs::highlightSnippet("a b c d e f target", {"target"}, 4);
+    CHECK(snippet == "d e f [target]");
+}
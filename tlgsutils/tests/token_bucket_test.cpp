@@ -0,0 +1,37 @@
+#include <tlgsutils/token_bucket.hpp>
+#include <drogon/drogon_test.h>
+#include <cmath>
+
+using namespace std::chrono_literals;
+
+DROGON_TEST(TokenBucketTest)
+{
+    auto now = tlgs::TokenBucket::Clock::now();
+    tlgs::TokenBucket bucket(2, 4, now);
+    CHECK(bucket.full(now));
+    CHECK(bucket.tryConsume(3, now) == true);
+    CHECK(bucket.tryConsume(3, now) == false);
+    CHECK(std::abs(bucket.tokens(now) - 1) < 1e-9);
+    CHECK(std::abs(bucket.timeUntil(3, now) - 1) < 1e-9);
+    CHECK(bucket.timeUntil(1, now) == 0);
+
+    // Refills at 2 tokens per second
+    now += 1s;
+    CHECK(bucket.tryConsume(3, now) == true);
+    CHECK(std::abs(bucket.tokens(now)) < 1e-9);
+
+    // Never goes above the burst size
+    now += 10s;
+    CHECK(std::abs(bucket.tokens(now) - 4) < 1e-9);
+    CHECK(bucket.full(now));
+
+    // Refunds are capped too
+    CHECK(bucket.tryConsume(1, now) == true);
+    bucket.refund(2, now);
+    CHECK(std::abs(bucket.tokens(now) - 4) < 1e-9);
+
+    // Time going backwards does not take away tokens
+    CHECK(bucket.tryConsume(4, now) == true);
+    CHECK(bucket.tokens(now - 1s) == 0);
+    CHECK(bucket.tryConsume(1, now + 500ms) == true);
+}
@@ -147,3 +147,35 @@ DROGON_TEST(XXHashTest)
 {
   CHECK(tlgs::xxHash64("Hello, World!") == "C49AACF8080FE47F");
 }
+
+DROGON_TEST(XXHash128Test)
+{
+  auto hash = tlgs::xxHash128("Hello, World!");
+  CHECK(hash.size() == 32);
+  CHECK(hash == tlgs::xxHash128("Hello, World!"));
+  CHECK(hash != tlgs::xxHash128("Hello, World?"));
+  CHECK(hash != tlgs::xxHash128("Hello, World!", 42));
+}
+
+DROGON_TEST(Utf8ToLowerTest)
+{
+  CHECK(tlgs::utf8ToLower("Hello, World!") == "hello, world!");
+  CHECK(tlgs::utf8ToLower("ÀÉÎÕÜ×") == "àéîõü×");
+  CHECK(tlgs::utf8ToLower("ŁÓDŹ") == "łódź");
+  CHECK(tlgs::utf8ToLower("ΑΘΗΝΑ Ά") == "αθηνα ά");
+  CHECK(tlgs::utf8ToLower("МОСКВА Ё") == "москва ё");
+  CHECK(tlgs::utf8ToLower("ＧＥＭＩＮＩ") == "ｇｅｍｉｎｉ");
+  CHECK(tlgs::utf8ToLower("日本語") == "日本語");
+  // Invalid UTF-8 is passed through
+  CHECK(tlgs::utf8ToLower("A\xC3") == "a\xC3");
+  CHECK(tlgs::utf8ToLower("\xFFB") == "\xFFb");
+}
+
+DROGON_TEST(PgTextArrayTest)
+{
+  CHECK(tlgs::pgTextArray({}) == "{}");
+  CHECK(tlgs::pgTextArray({"a", "b"}) == R"({"a","b"})");
+  CHECK(tlgs::pgTextArray({""}) == R"({""})");
+  CHECK(tlgs::pgTextArray({"gemini://example.com/it's"}) == R"({"gemini://example.com/it's"})");
+  CHECK(tlgs::pgTextArray({R"(a"b\c)", "{x,y}"}) == R"({"a\"b\\c","{x,y}"})");
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+namespace tlgs
+{
+
+/**
+ * @brief A token bucket rate limiter. Holds up to `burst` tokens and refills at `rate` tokens per second.
+ * Refilling is lazy. The bucket catches up whenever it is used, so idle buckets cost nothing and a caller
+ * holding one bucket per client only pays for the clients it sees. Callers guard it with their own lock.
+ *
+ * @note A rate of 0 never refills. timeUntil() is infinite then
+ */
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate, double burst, Clock::time_point now = Clock::now())
+        : rate_(rate)
+        , burst_(burst)
+        , tokens_(burst)
+        , last_update_(now)
+    {
+    }
+
+    /**
+     * @brief Take tokens from the bucket if there are enough of them
+     *
+     * @return true if the tokens are taken
+     */
+    bool tryConsume(double tokens, Clock::time_point now = Clock::now())
+    {
+        refill(now);
+        if(tokens_ < tokens)
+            return false;
+        tokens_ -= tokens;
+        return true;
+    }
+
+    /**
+     * @brief Give back tokens taken by tryConsume(). i.e. the work never happened
+     */
+    void refund(double tokens, Clock::time_point now = Clock::now())
+    {
+        refill(now);
+        tokens_ = std::min(tokens_ + tokens, burst_);
+    }
+
+    /**
+     * @brief Seconds until the bucket holds the given amount of tokens. 0 if it already does
+     */
+    double timeUntil(double tokens, Clock::time_point now = Clock::now())
+    {
+        refill(now);
+        if(tokens_ >= tokens)
+            return 0;
+        if(rate_ <= 0)
+            return std::numeric_limits<double>::infinity();
+        return (tokens - tokens_) / rate_;
+    }
+
+    double tokens(Clock::time_point now = Clock::now())
+    {
+        refill(now);
+        return tokens_;
+    }
+
+    bool full(Clock::time_point now = Clock::now())
+    {
+        return tokens(now) >= burst_;
+    }
+
+    double burst() const
+    {
+        return burst_;
+    }
+
+protected:
+    void refill(Clock::time_point now)
+    {
+        if(now <= last_update_)
+            return;
+        double elapsed = std::chrono::duration<double>(now - last_update_).count();
+        tokens_ = std::min(tokens_ + elapsed * rate_, burst_);
+        last_update_ = now;
+    }
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_update_;
+};
+
+}
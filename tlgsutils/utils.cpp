@@ -124,6 +124,122 @@ std::string tlgs::xxHash64(const std::string_view str)
     return drogon::utils::binaryStringToHex((unsigned char*)&hash, sizeof(hash));
 }
 
+std::string tlgs::xxHash128(const std::string_view str, uint64_t seed)
+{
+    auto hash = XXH3_128bits_withSeed(str.data(), str.size(), seed);
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash(&canonical, hash);
+    return drogon::utils::binaryStringToHex(canonical.digest, sizeof(canonical.digest));
+}
+
+static char32_t toLowerCodepoint(char32_t ch)
+{
+    if(ch < 0x80)
+        return (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+    // Latin-1 Supplement. Except for the multiplication sign
+    if(ch >= 0xC0 && ch <= 0xDE && ch != 0xD7)
+        return ch + 32;
+    // Latin Extended-A. Mostly pairs of upper and lower case letters
+    if(ch >= 0x100 && ch <= 0x17F) {
+        if(ch == 0x130)
+            return 'i';
+        if(ch == 0x178)
+            return 0xFF;
+        if((ch >= 0x139 && ch <= 0x148) || (ch >= 0x179 && ch <= 0x17E))
+            return ch % 2 == 1 ? ch + 1 : ch;
+        if(ch == 0x138 || ch == 0x149 || ch == 0x17F)
+            return ch;
+        return ch % 2 == 0 ? ch + 1 : ch;
+    }
+    // Greek
+    if(ch >= 0x391 && ch <= 0x3AB && ch != 0x3A2)
+        return ch + 32;
+    if(ch == 0x386)
+        return 0x3AC;
+    if(ch >= 0x388 && ch <= 0x38A)
+        return ch + 37;
+    if(ch == 0x38C)
+        return 0x3CC;
+    if(ch == 0x38E || ch == 0x38F)
+        return ch + 63;
+    // Cyrillic
+    if(ch >= 0x400 && ch <= 0x40F)
+        return ch + 80;
+    if(ch >= 0x410 && ch <= 0x42F)
+        return ch + 32;
+    if((ch >= 0x460 && ch <= 0x481) || (ch >= 0x48A && ch <= 0x4BF))
+        return ch % 2 == 0 ? ch + 1 : ch;
+    // Armenian
+    if(ch >= 0x531 && ch <= 0x556)
+        return ch + 48;
+    // Full width Latin
+    if(ch >= 0xFF21 && ch <= 0xFF3A)
+        return ch + 32;
+    return ch;
+}
+
+std::string tlgs::utf8ToLower(const std::string_view str)
+{
+    std::string result;
+    result.reserve(str.size());
+    size_t i = 0;
+    while(i < str.size()) {
+        unsigned char ch = str[i];
+        size_t len = 0;
+        char32_t codepoint = 0;
+        if(ch < 0x80) {
+            result.push_back((ch >= 'A' && ch <= 'Z') ? ch + 32 : ch);
+            i++;
+            continue;
+        }
+        else if((ch & 0xE0) == 0xC0) {
+            len = 2;
+            codepoint = ch & 0x1F;
+        }
+        else if((ch & 0xF0) == 0xE0) {
+            len = 3;
+            codepoint = ch & 0x0F;
+        }
+        else if((ch & 0xF8) == 0xF0) {
+            len = 4;
+            codepoint = ch & 0x07;
+        }
+
+        bool valid = len != 0 && i + len <= str.size();
+        for(size_t j = 1; valid && j < len; j++) {
+            unsigned char cont = str[i+j];
+            if((cont & 0xC0) != 0x80)
+                valid = false;
+            codepoint = (codepoint << 6) | (cont & 0x3F);
+        }
+        if(!valid) {
+            result.push_back(ch);
+            i++;
+            continue;
+        }
+
+        char32_t lower = toLowerCodepoint(codepoint);
+        if(lower == codepoint) {
+            result.append(str.substr(i, len));
+        }
+        else if(lower < 0x80) {
+            result.push_back(char(lower));
+        }
+        else if(lower < 0x800) {
+            result.push_back(char(0xC0 | (lower >> 6)));
+            result.push_back(char(0x80 | (lower & 0x3F)));
+        }
+        else {
+            // All mapped letters are in the BMP
+            result.push_back(char(0xE0 | (lower >> 12)));
+            result.push_back(char(0x80 | ((lower >> 6) & 0x3F)));
+            result.push_back(char(0x80 | (lower & 0x3F)));
+        }
+        i += len;
+    }
+    return result;
+}
+
 std::optional<unsigned long long> tlgs::try_strtoull(const std::string& str)
 {
     char* endptr;
@@ -154,3 +270,22 @@ std::string tlgs::pgSQLRealEscape(std::string str)
     drogon::utils::replaceAll(str, "\x1a", "\\Z");
     return str;
 }
+
+std::string tlgs::pgTextArray(const std::vector<std::string>& values)
+{
+    std::string result = "{";
+    for(const auto& value : values) {
+        if(result.size() != 1)
+            result += ',';
+        // Quote every element. So empty strings, NULL, commas and braces are taken literally
+        result += '"';
+        for(char ch : value) {
+            if(ch == '"' || ch == '\\')
+                result += '\\';
+            result += ch;
+        }
+        result += '"';
+    }
+    result += '}';
+    return result;
+}
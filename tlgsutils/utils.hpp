@@ -49,6 +49,23 @@ bool isNonUriAction(const std::string& sv);
  */
 std::string xxHash64(const std::string_view str);
 
+/**
+ * @brief Computes the 128 bit xxhash (XXH3) of a string
+ * 
+ * @param str the string
+ * @param seed seed of the hash
+ * @return std::string hex encoded hash
+ */
+std::string xxHash128(const std::string_view str, uint64_t seed = 0);
+
+/**
+ * @brief Lower case an UTF-8 string. Handles Latin, Greek, Cyrillic, Armenian and full width Latin
+ * letters. Other characters and invalid UTF-8 sequences are passed through untouched
+ * 
+ * @param str the UTF-8 string
+ */
+std::string utf8ToLower(const std::string_view str);
+
 template <typename T, typename Func>
     requires std::is_invocable_v<Func, typename T::value_type>
 auto filter(const T& data, Func&& func)
@@ -73,6 +90,12 @@ std::optional<unsigned long long> try_strtoull(const std::string& str);
 
 std::string pgSQLRealEscape(std::string str);
 
+/**
+ * @brief Encode strings as a Postgres array literal. Drogon can't bind arrays, pass the literal as a
+ * text parameter and cast it with $1::text[] instead
+ */
+std::string pgTextArray(const std::vector<std::string>& values);
+
 /**
  * @brief Convert URL into index-friendly string
  */